@@ -42,5 +42,8 @@ if not exist glew32.dll (
 
 echo Start
 clang-cl %CommonCompilerFlags% %ROOT_DIR%\src\main.c -link -subsystem:windows %CommonLinkerFlags% /out:%EXE_NAME%
+clang-cl %CommonCompilerFlags% %ROOT_DIR%\src\file_benchmark.c -link -subsystem:console /out:file_benchmark.exe
+clang-cl %CommonCompilerFlags% %ROOT_DIR%\src\asset_packer.c -link -subsystem:console /out:asset_packer.exe
+clang-cl %CommonCompilerFlags% %ROOT_DIR%\src\texture_cooker.c -link -subsystem:console /out:texture_cooker.exe
 popd
 echo Done
@@ -1,43 +1,42 @@
 #version 330 core
+#pragma keywords TEXTURED VERTEX_COLOR
+#include "lighting.glsl"
+
 out vec4 color;
-/*
+#ifdef VERTEX_COLOR
 in vec3 vertex_color;
+#endif
+#ifdef TEXTURED
 in vec2 tex_coord;
-*/
+flat in vec4 uv_transform_0;
+flat in vec4 uv_transform_1;
 
-/*
 uniform sampler2D in_texture_0;
-uniform sampler3D in_texture_1;
-*/
+uniform sampler2D in_texture_1;
+
+// Repeats within the texture's part of an atlas page like GL_REPEAT does
+// for a whole texture, see texture_atlas.c. The gradients come from the
+// coordinates before the wrap so the seam doesn't drop to the smallest mip.
+vec4 sample_texture(sampler2D source, vec2 uv, vec4 transform) {
+    vec2 scale = transform.xy;
+    return textureGrad(source, fract(uv) * scale + transform.zw, dFdx(uv) * scale, dFdy(uv) * scale);
+}
+#endif
 
 uniform vec3 object_color;
 
-uniform vec3 light_color;
-uniform vec3 light_pos;
-
-uniform vec3 view_pos;
-
 in vec3 frag_pos;
 in vec3 normal;
 
 void main() {
-    float ambient_strength = 0.1;
-    vec3 ambient = ambient_strength * light_color;
-
-    vec3 norm = normalize(normal);
-    vec3 light_dir = normalize(light_pos - frag_pos);
-
-    float diff = max(dot(norm, light_dir), 0);
-    vec3 diffuse = diff * light_color;
-
-    float specular_strength = 0.5;
-
-    vec3 view_dir = normalize(view_pos - frag_pos);
-    vec3 reflect_dir = reflect(-light_dir, norm);
-
-    float spec = pow(max(dot(view_dir, reflect_dir), 0.0), 32);
-    vec3 specular = specular_strength * spec * light_color;
-
-    vec3 result = (ambient + diffuse + specular) * object_color;
-    color = vec4(result, 1.0);
+    vec3 surface_color = object_color;
+#ifdef TEXTURED
+    surface_color = mix(sample_texture(in_texture_0, tex_coord, uv_transform_0),
+                        sample_texture(in_texture_1, tex_coord, uv_transform_1), 0.2).rgb;
+#endif
+#ifdef VERTEX_COLOR
+    surface_color *= vertex_color;
+#endif
+
+    color = vec4(phong_lighting(surface_color, normal, frag_pos), 1.0);
 }
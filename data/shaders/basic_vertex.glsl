@@ -1,16 +1,45 @@
 #version 330 core
+#pragma keywords TEXTURED VERTEX_COLOR
 layout(location = 0) in vec3 in_vertex_position;
 layout(location = 1) in vec3 in_normal;
+// Per-instance, the model matrix takes up locations 2-5
+layout(location = 2) in mat4 in_model;
+// Positions may be quantized, see vertex_layout.c
+layout(location = 6) in vec3 in_position_scale;
+#ifdef VERTEX_COLOR
+layout(location = 7) in vec3 in_vertex_color;
+#endif
+#ifdef TEXTURED
+layout(location = 8) in vec2 in_tex_coord;
+// Per-instance, where each texture is in its atlas page
+layout(location = 9) in vec4 in_uv_transform_0;
+layout(location = 10) in vec4 in_uv_transform_1;
+#endif
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+#include "frame_uniforms.glsl"
 
 out vec3 frag_pos;
 out vec3 normal;
+#ifdef VERTEX_COLOR
+out vec3 vertex_color;
+#endif
+#ifdef TEXTURED
+out vec2 tex_coord;
+flat out vec4 uv_transform_0;
+flat out vec4 uv_transform_1;
+#endif
 
 void main(){
-    gl_Position = projection * view * model * vec4(in_vertex_position, 1.0f);
-    frag_pos = vec3(model * vec4(in_vertex_position, 1.0));
-    normal = mat3(transpose(inverse(model))) * in_normal;
+    vec3 position = in_vertex_position * in_position_scale;
+    gl_Position = projection * view * in_model * vec4(position, 1.0f);
+    frag_pos = vec3(in_model * vec4(position, 1.0));
+    normal = mat3(transpose(inverse(in_model))) * in_normal;
+#ifdef VERTEX_COLOR
+    vertex_color = in_vertex_color;
+#endif
+#ifdef TEXTURED
+    tex_coord = in_tex_coord;
+    uv_transform_0 = in_uv_transform_0;
+    uv_transform_1 = in_uv_transform_1;
+#endif
 }
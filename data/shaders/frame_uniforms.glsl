@@ -0,0 +1,13 @@
+// Per-frame globals, matches FrameUniforms in uniforms.c
+layout(std140) uniform FrameUniforms {
+    mat4 view;
+    mat4 projection;
+    vec4 view_pos;
+    vec4 light_pos;
+    vec4 light_color;
+};
+
+// Baked in by the loader, see shader_permutations.c
+#ifndef LIGHT_COLOR
+#define LIGHT_COLOR light_color.rgb
+#endif
@@ -1,6 +1,8 @@
 #version 330 core
+#include "frame_uniforms.glsl"
+
 out vec4 color;
 
 void main() {
-    color = vec4(1.0f);
+    color = vec4(LIGHT_COLOR, 1.0f);
 }
@@ -0,0 +1,23 @@
+#include "frame_uniforms.glsl"
+
+// Phong lighting from the single light in FrameUniforms
+vec3 phong_lighting(vec3 surface_color, vec3 normal, vec3 frag_pos) {
+    float ambient_strength = 0.1;
+    vec3 ambient = ambient_strength * LIGHT_COLOR;
+
+    vec3 norm = normalize(normal);
+    vec3 light_dir = normalize(light_pos.xyz - frag_pos);
+
+    float diff = max(dot(norm, light_dir), 0);
+    vec3 diffuse = diff * LIGHT_COLOR;
+
+    float specular_strength = 0.5;
+
+    vec3 view_dir = normalize(view_pos.xyz - frag_pos);
+    vec3 reflect_dir = reflect(-light_dir, norm);
+
+    float spec = pow(max(dot(view_dir, reflect_dir), 0.0), 32);
+    vec3 specular = specular_strength * spec * LIGHT_COLOR;
+
+    return (ambient + diffuse + specular) * surface_color;
+}
@@ -0,0 +1,234 @@
+/*
+  Packed asset archive.
+
+  All of data/ can be packed into one file with asset_packer.c, so loading
+  the game opens and maps one file instead of opening, stating and reading
+  every shader and texture on its own. The archive is mapped once by
+  mount_asset_archive and never copied, entries are views into the mapping.
+
+  read_file_contents looks a path up in the mounted archive and falls back
+  to the loose file when there is no archive or it doesn't have the path,
+  so callers don't know or care where their bytes come from. The archive is
+  mounted before anything else starts reading and isn't touched until it's
+  unmounted, so lookups from the async I/O threads need no lock.
+
+  Layout, all little endian:
+
+    AssetArchiveHeader
+    AssetArchiveEntry[entry_count]   sorted by path hash
+    u32 slots[slot_count]            hash table, entry index + 1, 0 is empty
+    names                            paths, not null terminated
+    entry data                       each entry starts on a 4K boundary
+
+  The slot count is a power of two at least twice the entry count, so a
+  lookup is one hash and a probe or two, however many entries there are.
+  Starting every entry on a page means its pages belong to it alone and
+  read ahead for it doesn't drag in pieces of its neighbours.
+
+  Entries can be stored deflated, which the packer does when it saves
+  enough to be worth it. Those are inflated into the heap on every read, so
+  things that compress poorly anyway, like JPEGs, are better left stored.
+  Every entry carries a hash of its unpacked bytes, checked on every read
+  with ASSET_ARCHIVE_VERIFY and by asset_packer verify.
+*/
+
+#define ASSET_ARCHIVE_MAGIC 0x4b504c47 // "GLPK"
+#define ASSET_ARCHIVE_VERSION 1
+#define ASSET_ARCHIVE_ALIGNMENT 4096
+#define ASSET_ARCHIVE_VERIFY 0
+
+typedef enum {
+    ASSET_COMPRESSION_NONE,
+    ASSET_COMPRESSION_DEFLATE,
+} AssetCompression;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 entry_count;
+    u32 slot_count;
+    u64 entries_offset;
+    u64 slots_offset;
+    u64 names_offset;
+    u64 names_size;
+} AssetArchiveHeader;
+
+typedef struct {
+    u64 path_hash;
+    // Of the unpacked bytes
+    u64 content_hash;
+    // From the start of the archive
+    u64 offset;
+    u64 stored_size;
+    u64 size;
+    u32 name_offset;
+    u32 name_length;
+    u32 compression;
+    u32 reserved;
+} AssetArchiveEntry;
+
+typedef struct {
+    FileContents file;
+    const AssetArchiveHeader* header;
+    const AssetArchiveEntry* entries;
+    const u32* slots;
+    const char* names;
+} AssetArchive;
+
+static AssetArchive asset_archive;
+
+static inline u64
+hash_archive_path(const char* path, size_t length) {
+    return hash_bytes_64(path, length);
+}
+
+// Checks everything an entry lookup or read relies on, so a truncated or
+// corrupt archive is refused when it's mounted rather than read out of
+// bounds later
+static b32
+validate_asset_archive(const char* data, size_t size) {
+    if(size < sizeof(AssetArchiveHeader)) {
+        return false;
+    }
+    const AssetArchiveHeader* header = (const AssetArchiveHeader*)data;
+    if(header->magic != ASSET_ARCHIVE_MAGIC || header->version != ASSET_ARCHIVE_VERSION) {
+        return false;
+    }
+    u32 slot_count = header->slot_count;
+    if(!slot_count || (slot_count & (slot_count - 1)) || slot_count < header->entry_count ||
+       header->entries_offset % sizeof(u64) || header->slots_offset % sizeof(u32) ||
+       header->entries_offset > size ||
+       (size - header->entries_offset) / sizeof(AssetArchiveEntry) < header->entry_count ||
+       header->slots_offset > size || (size - header->slots_offset) / sizeof(u32) < slot_count ||
+       header->names_offset > size || size - header->names_offset < header->names_size) {
+        return false;
+    }
+
+    const AssetArchiveEntry* entries = (const AssetArchiveEntry*)(data + header->entries_offset);
+    for(u32 i = 0; i < header->entry_count; ++i) {
+        const AssetArchiveEntry* entry = &entries[i];
+        if((u64)entry->name_offset + entry->name_length > header->names_size ||
+           entry->offset > size || size - entry->offset < entry->stored_size ||
+           entry->compression > ASSET_COMPRESSION_DEFLATE ||
+           (entry->compression == ASSET_COMPRESSION_NONE && entry->stored_size != entry->size)) {
+            return false;
+        }
+    }
+    const u32* slots = (const u32*)(data + header->slots_offset);
+    for(u32 i = 0; i < slot_count; ++i) {
+        if(slots[i] > header->entry_count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static b32
+mount_asset_archive(const char* path) {
+    memset(&asset_archive, 0, sizeof(asset_archive));
+    FileContents file;
+    if(!map_whole_file(path, &file)) {
+        return false;
+    }
+    if(!validate_asset_archive(file.data, file.size)) {
+        log_error_message("%s isn't a valid asset archive\n", path);
+        free_file_contents(&file);
+        return false;
+    }
+
+    const AssetArchiveHeader* header = (const AssetArchiveHeader*)file.data;
+    asset_archive.file    = file;
+    asset_archive.header  = header;
+    asset_archive.entries = (const AssetArchiveEntry*)(file.data + header->entries_offset);
+    asset_archive.slots   = (const u32*)(file.data + header->slots_offset);
+    asset_archive.names   = file.data + header->names_offset;
+    log_debug_message("Mounted %s, %u entries in %.2f MB\n", path, header->entry_count,
+                      (f64)file.size / (1024.0 * 1024.0));
+    return true;
+}
+
+static void
+unmount_asset_archive(void) {
+    free_file_contents(&asset_archive.file);
+    memset(&asset_archive, 0, sizeof(asset_archive));
+}
+
+// 0 when nothing is mounted or the archive doesn't have the path
+static const AssetArchiveEntry*
+find_archive_entry(const char* path) {
+    if(!asset_archive.header) {
+        return 0;
+    }
+    size_t length = strlen(path);
+    u64 path_hash = hash_archive_path(path, length);
+    u32 mask = asset_archive.header->slot_count - 1;
+    for(u32 probe = 0; probe <= mask; ++probe) {
+        u32 slot = asset_archive.slots[(path_hash + probe) & mask];
+        if(!slot) {
+            return 0;
+        }
+        const AssetArchiveEntry* entry = &asset_archive.entries[slot - 1];
+        if(entry->path_hash == path_hash && entry->name_length == length &&
+           memcmp(asset_archive.names + entry->name_offset, path, length) == 0) {
+            return entry;
+        }
+    }
+    return 0;
+}
+
+// Unpacked bytes of the entry. Stored entries are a view into the mapping,
+// deflated ones are inflated into the heap.
+static b32
+read_archive_entry(const AssetArchiveEntry* entry, FileContents* file) {
+    memset(file, 0, sizeof(*file));
+    const char* stored = asset_archive.file.data + entry->offset;
+
+    if(entry->compression == ASSET_COMPRESSION_NONE) {
+#ifndef _WIN32
+        // Starts reading the whole entry in now instead of a fault at a time
+        if(entry->size) {
+            madvise((void*)stored, entry->size, MADV_WILLNEED);
+        }
+#endif
+        file->data    = stored;
+        file->size    = entry->size;
+        file->backing = FILE_BACKING_ARCHIVE;
+    } else {
+        char* buffer = malloc(max(entry->size, 1));
+        i32 size = stbi_zlib_decode_buffer(buffer, (i32)entry->size, stored, (i32)entry->stored_size);
+        if(size < 0 || (u64)size != entry->size) {
+            log_error_message("Couldn't inflate %.*s\n", entry->name_length,
+                              asset_archive.names + entry->name_offset);
+            free(buffer);
+            return false;
+        }
+        file->data    = buffer;
+        file->size    = entry->size;
+        file->backing = FILE_BACKING_HEAP;
+    }
+
+#if ASSET_ARCHIVE_VERIFY
+    if(hash_bytes_64(file->data, file->size) != entry->content_hash) {
+        log_error_message("%.*s doesn't match its hash\n", entry->name_length,
+                          asset_archive.names + entry->name_offset);
+        free_file_contents(file);
+        return false;
+    }
+#endif
+    return true;
+}
+
+static b32
+read_file_contents(const char* path, FileContents* file) {
+    const AssetArchiveEntry* entry = find_archive_entry(path);
+    if(entry) {
+        return read_archive_entry(entry, file);
+    }
+    return read_loose_file_contents(path, file);
+}
+
+// Whether read_file_contents would find anything
+static b32
+file_exists(const char* path) {
+    return find_archive_entry(path) || loose_file_exists(path);
+}
@@ -0,0 +1,389 @@
+/*
+  Asset packer.
+
+  Builds the archive asset_archive.c mounts, and checks existing ones.
+
+    asset_packer pack [-store] data.pack data/shaders data/textures
+    asset_packer list data.pack
+    asset_packer verify data.pack
+
+  pack takes files and directories, which are walked recursively, and
+  stores every file under the path it was found at, so the game finds
+  data/shaders/basic_vertex.glsl in the archive by the same path it would
+  open it by. Entries are deflated when that makes them at least an eighth
+  smaller, and -store keeps everything uncompressed and zero-copy.
+
+  verify inflates every entry and checks it against its content hash.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#include "stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_STATIC
+#include "stb_image_write.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define array_count(x) ((sizeof(x) / sizeof(0 [x])) / ((size_t)(!(sizeof(x) % sizeof(0 [x])))))
+
+#define HANDMADE_MATH_IMPLEMENTATION
+#include "HandmadeMath.h"
+
+#include "types.c"
+#include "math.c"
+#include "hash.c"
+
+static void
+log_debug_message(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+static void
+log_error_message(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+#include "platform_files.c"
+#include "asset_archive.c"
+
+#define MAX_PACK_PATH_LENGTH 512
+
+typedef struct {
+    char* path;
+    AssetArchiveEntry entry;
+} PackFile;
+
+typedef struct {
+    PackFile* files;
+    u32 count;
+    u32 capacity;
+} PackFileList;
+
+static void
+add_pack_file(PackFileList* list, const char* path) {
+    if(list->count == list->capacity) {
+        list->capacity = max(list->capacity * 2, 64);
+        list->files = realloc(list->files, list->capacity * sizeof(PackFile));
+    }
+    PackFile* file = &list->files[list->count++];
+    memset(file, 0, sizeof(*file));
+    file->path = malloc(strlen(path) + 1);
+    strcpy(file->path, path);
+    // The game always asks with forward slashes
+    for(char* c = file->path; *c; ++c) {
+        if(*c == '\\') {
+            *c = '/';
+        }
+    }
+}
+
+// Adds the file, or every file under the directory
+static b32
+collect_pack_files(PackFileList* list, const char* path) {
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesA(path);
+    if(attributes == INVALID_FILE_ATTRIBUTES) {
+        log_error_message("Can't find %s\n", path);
+        return false;
+    }
+    if(!(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        add_pack_file(list, path);
+        return true;
+    }
+
+    char pattern[MAX_PACK_PATH_LENGTH];
+    snprintf(pattern, sizeof(pattern), "%s/*", path);
+    WIN32_FIND_DATAA find_data;
+    HANDLE find = FindFirstFileA(pattern, &find_data);
+    if(find == INVALID_HANDLE_VALUE) {
+        return true;
+    }
+    b32 result = true;
+    do {
+        const char* name = find_data.cFileName;
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        char child[MAX_PACK_PATH_LENGTH];
+        snprintf(child, sizeof(child), "%s/%s", path, name);
+        result = collect_pack_files(list, child) && result;
+    } while(FindNextFileA(find, &find_data));
+    FindClose(find);
+    return result;
+#else
+    struct stat file_stat;
+    if(stat(path, &file_stat) != 0) {
+        log_error_message("Can't find %s\n", path);
+        return false;
+    }
+    if(!S_ISDIR(file_stat.st_mode)) {
+        add_pack_file(list, path);
+        return true;
+    }
+
+    DIR* directory = opendir(path);
+    if(!directory) {
+        log_error_message("Can't open %s\n", path);
+        return false;
+    }
+    b32 result = true;
+    struct dirent* child_entry;
+    while((child_entry = readdir(directory))) {
+        const char* name = child_entry->d_name;
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        char child[MAX_PACK_PATH_LENGTH];
+        snprintf(child, sizeof(child), "%s/%s", path, name);
+        result = collect_pack_files(list, child) && result;
+    }
+    closedir(directory);
+    return result;
+#endif
+}
+
+static int
+compare_pack_files(const void* a, const void* b) {
+    const PackFile* file_a = a;
+    const PackFile* file_b = b;
+    if(file_a->entry.path_hash != file_b->entry.path_hash) {
+        return file_a->entry.path_hash < file_b->entry.path_hash ? -1 : 1;
+    }
+    return strcmp(file_a->path, file_b->path);
+}
+
+static inline u64
+align_archive_offset(u64 offset) {
+    return (offset + ASSET_ARCHIVE_ALIGNMENT - 1) & ~(u64)(ASSET_ARCHIVE_ALIGNMENT - 1);
+}
+
+static b32
+write_padding(FILE* out, u64 to_offset) {
+    static const char zeros[ASSET_ARCHIVE_ALIGNMENT];
+    u64 offset = (u64)ftell(out);
+    while(offset < to_offset) {
+        size_t count = (size_t)min(to_offset - offset, sizeof(zeros));
+        if(fwrite(zeros, 1, count, out) != count) {
+            return false;
+        }
+        offset += count;
+    }
+    return true;
+}
+
+static i32
+pack_archive(const char* output_path, char** inputs, u32 input_count, b32 store_only) {
+    PackFileList list = {0};
+    for(u32 i = 0; i < input_count; ++i) {
+        // data/shaders/ is packed as data/shaders
+        size_t length = strlen(inputs[i]);
+        while(length > 1 && (inputs[i][length - 1] == '/' || inputs[i][length - 1] == '\\')) {
+            inputs[i][--length] = 0;
+        }
+        if(!collect_pack_files(&list, inputs[i])) {
+            return 1;
+        }
+    }
+    if(!list.count) {
+        log_error_message("Nothing to pack\n");
+        return 1;
+    }
+
+    // Names first, the table of contents has to be laid out before any data
+    u64 names_size = 0;
+    for(u32 i = 0; i < list.count; ++i) {
+        PackFile* file = &list.files[i];
+        size_t length = strlen(file->path);
+        file->entry.path_hash   = hash_archive_path(file->path, length);
+        file->entry.name_length = (u32)length;
+        names_size += length;
+    }
+    qsort(list.files, list.count, sizeof(PackFile), compare_pack_files);
+    for(u32 i = 1; i < list.count; ++i) {
+        if(strcmp(list.files[i - 1].path, list.files[i].path) == 0) {
+            log_error_message("%s is in there twice\n", list.files[i].path);
+            return 1;
+        }
+    }
+
+    AssetArchiveHeader header = {0};
+    header.magic       = ASSET_ARCHIVE_MAGIC;
+    header.version     = ASSET_ARCHIVE_VERSION;
+    header.entry_count = list.count;
+    header.slot_count  = 1;
+    while(header.slot_count < list.count * 2) {
+        header.slot_count *= 2;
+    }
+    header.entries_offset = sizeof(AssetArchiveHeader);
+    header.slots_offset   = header.entries_offset + (u64)list.count * sizeof(AssetArchiveEntry);
+    header.names_offset   = header.slots_offset + (u64)header.slot_count * sizeof(u32);
+    header.names_size     = names_size;
+
+    FILE* out = fopen(output_path, "wb");
+    if(!out) {
+        log_error_message("Can't write %s\n", output_path);
+        return 1;
+    }
+
+    // Data goes after the table of contents, which is written last
+    u64 offset = align_archive_offset(header.names_offset + names_size);
+    u64 total_size = 0;
+    u32 deflated_count = 0;
+    b32 result = true;
+    if(fseek(out, (long)offset, SEEK_SET) != 0) {
+        result = false;
+    }
+    for(u32 i = 0; i < list.count && result; ++i) {
+        PackFile* file = &list.files[i];
+        FileContents contents;
+        if(!read_loose_file_contents(file->path, &contents)) {
+            log_error_message("Can't read %s\n", file->path);
+            result = false;
+            break;
+        }
+
+        const char* stored = contents.data;
+        u64 stored_size = contents.size;
+        u8* deflated = 0;
+        if(!store_only && contents.size && contents.size < 0x7fffffff) {
+            i32 deflated_size = 0;
+            deflated = stbi_zlib_compress((u8*)contents.data, (i32)contents.size, &deflated_size, 8);
+            if(deflated && (u64)deflated_size <= contents.size - contents.size / 8) {
+                stored      = (const char*)deflated;
+                stored_size = (u64)deflated_size;
+                file->entry.compression = ASSET_COMPRESSION_DEFLATE;
+                ++deflated_count;
+            }
+        }
+
+        file->entry.content_hash = hash_bytes_64(contents.data, contents.size);
+        file->entry.size         = contents.size;
+        file->entry.stored_size  = stored_size;
+        file->entry.offset       = offset;
+
+        result = write_padding(out, offset) && fwrite(stored, 1, (size_t)stored_size, out) == stored_size;
+        offset = align_archive_offset(offset + stored_size);
+        total_size += contents.size;
+
+        free(deflated);
+        free_file_contents(&contents);
+    }
+
+    // Table of contents
+    u32* slots = calloc(header.slot_count, sizeof(u32));
+    u32 name_offset = 0;
+    for(u32 i = 0; i < list.count; ++i) {
+        AssetArchiveEntry* entry = &list.files[i].entry;
+        entry->name_offset = name_offset;
+        name_offset += entry->name_length;
+
+        u32 mask = header.slot_count - 1;
+        u64 slot = entry->path_hash;
+        while(slots[slot & mask]) {
+            ++slot;
+        }
+        slots[slot & mask] = i + 1;
+    }
+    if(result) {
+        result = fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+    }
+    for(u32 i = 0; i < list.count && result; ++i) {
+        result = fwrite(&list.files[i].entry, sizeof(AssetArchiveEntry), 1, out) == 1;
+    }
+    result = result && fwrite(slots, sizeof(u32), header.slot_count, out) == header.slot_count;
+    for(u32 i = 0; i < list.count && result; ++i) {
+        result = fwrite(list.files[i].path, 1, list.files[i].entry.name_length, out) == list.files[i].entry.name_length;
+    }
+    result = fclose(out) == 0 && result;
+    free(slots);
+
+    if(result) {
+        printf("Packed %u files, %.2f MB, %u deflated, into %s, %.2f MB\n", list.count,
+               (f64)total_size / (1024.0 * 1024.0), deflated_count, output_path,
+               (f64)offset / (1024.0 * 1024.0));
+    } else {
+        log_error_message("Couldn't write %s\n", output_path);
+    }
+    for(u32 i = 0; i < list.count; ++i) {
+        free(list.files[i].path);
+    }
+    free(list.files);
+    return result ? 0 : 1;
+}
+
+static i32
+list_archive(const char* path, b32 verify) {
+    if(!mount_asset_archive(path)) {
+        log_error_message("Can't mount %s\n", path);
+        return 1;
+    }
+    u32 bad_count = 0;
+    for(u32 i = 0; i < asset_archive.header->entry_count; ++i) {
+        const AssetArchiveEntry* entry = &asset_archive.entries[i];
+        const char* state = "";
+        if(verify) {
+            FileContents contents;
+            b32 good = read_archive_entry(entry, &contents) &&
+                       hash_bytes_64(contents.data, contents.size) == entry->content_hash;
+            if(good) {
+                free_file_contents(&contents);
+            } else {
+                ++bad_count;
+            }
+            state = good ? " ok" : " BAD";
+        }
+        printf("%10llu %10llu %s %016llx %.*s%s\n", (unsigned long long)entry->size,
+               (unsigned long long)entry->stored_size,
+               entry->compression == ASSET_COMPRESSION_DEFLATE ? "deflate" : "stored ",
+               (unsigned long long)entry->content_hash, entry->name_length,
+               asset_archive.names + entry->name_offset, state);
+    }
+    if(verify) {
+        printf("%u of %u entries bad\n", bad_count, asset_archive.header->entry_count);
+    }
+    unmount_asset_archive();
+    return bad_count ? 1 : 0;
+}
+
+int
+main(int argc, char** argv) {
+    if(argc >= 4 && strcmp(argv[1], "pack") == 0) {
+        b32 store_only = strcmp(argv[2], "-store") == 0;
+        i32 first = store_only ? 3 : 2;
+        if(argc - first >= 2) {
+            return pack_archive(argv[first], argv + first + 1, argc - first - 1, store_only);
+        }
+    } else if(argc == 3 && strcmp(argv[1], "list") == 0) {
+        return list_archive(argv[2], false);
+    } else if(argc == 3 && strcmp(argv[1], "verify") == 0) {
+        return list_archive(argv[2], true);
+    }
+    printf("usage: %s pack [-store] output.pack file_or_directory...\n"
+           "       %s list archive.pack\n"
+           "       %s verify archive.pack\n", argv[0], argv[0], argv[0]);
+    return 1;
+}
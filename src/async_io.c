@@ -0,0 +1,881 @@
+/*
+  Asynchronous asset reads.
+
+  request_async_read queues a file read and hands back a handle right away.
+  The game loop checks it with async_read_status, which never blocks, and
+  takes the result with take_async_read_result once it is done. Nothing on
+  the main thread waits for the disk.
+
+  Requests have a priority and are read highest priority first, in request
+  order within a priority. cancel_async_read drops a request in any state:
+  queued reads never start, reads in flight are cancelled in the kernel
+  where possible and thrown away otherwise, and decoded results are freed.
+
+  Every request can come with a decode function, which runs on a worker
+  thread with the file's bytes, so the main thread only ever sees the
+  decoded result, like the pixels of an image. Without one the result is
+  the FileContents itself, freed with free_async_read_contents. A decode
+  with work that splits, like a large mip chain, can hand it to the idle
+  workers as well with share_async_work.
+
+  On Linux the reads go through io_uring, driven with the raw syscalls
+  since liburing isn't a dependency. One I/O thread owns the ring. It keeps
+  up to ASYNC_IO_QUEUE_DEPTH reads and about ASYNC_IO_MAX_BYTES_IN_FLIGHT
+  bytes in flight and submits every batch with one io_uring_enter, which
+  also waits for completions. A poll on an eventfd stays in the ring so new
+  requests and cancellations can wake it up.
+
+  Without io_uring, on other platforms, old kernels or sandboxes that block
+  it, there is no I/O thread and the workers read the files themselves with
+  read_file_contents, still in priority order. Readiness polling like epoll
+  doesn't help here, regular files always poll as ready and the read blocks
+  anyway, so a pool of blocking readers is the fallback.
+*/
+
+#define MAX_ASYNC_READS 256
+#define MAX_ASYNC_READ_PATH_LENGTH 256
+#define MAX_ASYNC_IO_WORKERS 4
+#define ASYNC_IO_QUEUE_DEPTH 32
+#define ASYNC_IO_MAX_BYTES_IN_FLIGHT (64 * 1024 * 1024)
+
+#ifdef __linux__
+#define ASYNC_IO_URING 1
+#else
+#define ASYNC_IO_URING 0
+#endif
+
+// 0 is never a valid handle
+typedef u32 AsyncReadHandle;
+
+typedef enum {
+    ASYNC_READ_PRIORITY_HIGH,
+    ASYNC_READ_PRIORITY_NORMAL,
+    ASYNC_READ_PRIORITY_LOW,
+    ASYNC_READ_PRIORITY_COUNT,
+} AsyncReadPriority;
+
+typedef enum {
+    // Handle is 0, cancelled or already taken
+    ASYNC_READ_INVALID,
+    ASYNC_READ_QUEUED,
+    ASYNC_READ_READING,
+    ASYNC_READ_DECODING,
+    ASYNC_READ_DONE,
+    ASYNC_READ_FAILED,
+} AsyncReadStatus;
+
+// Runs on a worker thread. Returns the decoded result, 0 if it failed. The
+// file contents are freed after it returns.
+typedef void* AsyncDecodeFunction(const char* data, size_t size, void* user_data);
+typedef void AsyncFreeFunction(void* result);
+// Takes pieces of the work until there are none left, from any number of
+// workers at once, see share_async_work
+typedef void AsyncSharedWork(void* data);
+
+typedef struct {
+    // Generation in the high bits and AsyncReadStatus in the low byte, so
+    // async_read_status can check both without the lock
+    SDL_atomic_t state;
+    u32 generation;
+    b32 in_use;
+    b32 cancelled;
+
+    char path[MAX_ASYNC_READ_PATH_LENGTH];
+    AsyncReadPriority priority;
+    AsyncDecodeFunction* decode;
+    AsyncFreeFunction* free_result;
+    void* user_data;
+    u64 request_counter;
+
+    // Next read in the same queue, index + 1
+    u32 next;
+
+    FileContents contents;
+    void* result;
+
+#if ASYNC_IO_URING
+    // Only touched by the I/O thread while the read is in flight
+    i32 fd;
+    struct iovec iovec;
+    size_t bytes_done;
+    b32 cancel_submitted;
+#endif
+} AsyncRead;
+
+// Index + 1 of the first and last read, 0 when empty
+typedef struct {
+    u32 head;
+    u32 tail;
+} AsyncReadQueue;
+
+typedef struct {
+    // Current
+    u32 queued;
+    u32 in_flight;
+    u64 bytes_in_flight;
+    u32 decoding;
+
+    u32 peak_queued;
+    u32 peak_in_flight;
+    u64 peak_bytes_in_flight;
+
+    // Totals
+    u32 completed;
+    u32 failed;
+    u32 cancelled;
+    u64 bytes_read;
+    // io_uring_enter calls that submitted something, and what they submitted
+    u32 submit_calls;
+    u32 reads_submitted;
+    // From request to decoded, over every completed read
+    f64 latency_ms;
+} AsyncIOStats;
+
+#if ASYNC_IO_URING
+typedef struct {
+    i32 fd;
+    u32 entries;
+
+    u32* sq_head;
+    u32* sq_tail;
+    u32 sq_mask;
+    u32* sq_array;
+    struct io_uring_sqe* sqes;
+    // Prepared SQEs end here, the kernel's tail catches up on submit
+    u32 sq_local_tail;
+
+    u32* cq_head;
+    u32* cq_tail;
+    u32 cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} IoUring;
+
+// user_data of the completions that aren't reads
+#define ASYNC_IO_WAKE_TAG 0xffffffffffffffffull
+#define ASYNC_IO_CANCEL_TAG 0xfffffffffffffffeull
+#endif
+
+typedef struct {
+    AsyncRead reads[MAX_ASYNC_READS];
+    AsyncReadQueue pending[ASYNC_READ_PRIORITY_COUNT];
+    AsyncReadQueue decode_queue;
+
+    SDL_mutex* mutex;
+    // Signalled when there is something for the workers
+    SDL_cond* work_ready;
+    SDL_Thread* workers[MAX_ASYNC_IO_WORKERS];
+    u32 worker_count;
+    b32 shutting_down;
+
+    // What a decode shares with idle workers, 0 when nothing is. The id
+    // tells workers apart what they already helped with.
+    AsyncSharedWork* shared_work;
+    void* shared_work_data;
+    u32 shared_work_id;
+    u32 shared_work_helpers;
+    SDL_cond* shared_work_done;
+
+    b32 uring;
+#if ASYNC_IO_URING
+    IoUring ring;
+    SDL_Thread* io_thread;
+    i32 wake_fd;
+    u64 wake_value;
+#endif
+
+    AsyncIOStats stats;
+} AsyncIO;
+
+static AsyncIO async_io;
+
+static inline void
+set_async_read_status(AsyncRead* read, AsyncReadStatus status) {
+    SDL_AtomicSet(&read->state, (i32)((read->generation << 8) | status));
+}
+
+static inline AsyncRead*
+find_async_read(AsyncReadHandle handle) {
+    u32 index = (handle & 0xffff) - 1;
+    if(!handle || index >= MAX_ASYNC_READS) {
+        return 0;
+    }
+    AsyncRead* read = &async_io.reads[index];
+    return read->in_use && read->generation == (handle >> 16) ? read : 0;
+}
+
+static void
+push_async_read(AsyncReadQueue* queue, AsyncRead* read) {
+    u32 index = (u32)(read - async_io.reads) + 1;
+    read->next = 0;
+    if(queue->tail) {
+        async_io.reads[queue->tail - 1].next = index;
+    } else {
+        queue->head = index;
+    }
+    queue->tail = index;
+}
+
+static AsyncRead*
+pop_async_read(AsyncReadQueue* queue) {
+    if(!queue->head) {
+        return 0;
+    }
+    AsyncRead* read = &async_io.reads[queue->head - 1];
+    queue->head = read->next;
+    if(!queue->head) {
+        queue->tail = 0;
+    }
+    read->next = 0;
+    return read;
+}
+
+static void
+remove_async_read(AsyncReadQueue* queue, AsyncRead* read) {
+    u32 index = (u32)(read - async_io.reads) + 1;
+    u32 previous = 0;
+    for(u32 at = queue->head; at; at = async_io.reads[at - 1].next) {
+        if(at == index) {
+            if(previous) {
+                async_io.reads[previous - 1].next = read->next;
+            } else {
+                queue->head = read->next;
+            }
+            if(queue->tail == index) {
+                queue->tail = previous;
+            }
+            read->next = 0;
+            return;
+        }
+        previous = at;
+    }
+}
+
+// Highest priority first. Expects the lock.
+static AsyncRead*
+pop_pending_async_read(void) {
+    for(u32 priority = 0; priority < ASYNC_READ_PRIORITY_COUNT; ++priority) {
+        AsyncRead* read = pop_async_read(&async_io.pending[priority]);
+        if(read) {
+            --async_io.stats.queued;
+            return read;
+        }
+    }
+    return 0;
+}
+
+static void
+free_async_read_contents(void* result) {
+    FileContents* contents = result;
+    free_file_contents(contents);
+    free(contents);
+}
+
+// Frees whatever the read still holds and makes the slot reusable. Expects
+// the lock.
+static void
+release_async_read(AsyncRead* read) {
+    free_file_contents(&read->contents);
+    if(read->result) {
+        read->free_result(read->result);
+    }
+    read->in_use = false;
+    read->result = 0;
+    ++read->generation;
+    set_async_read_status(read, ASYNC_READ_INVALID);
+}
+
+// The read is through with the disk. Expects the lock.
+static void
+finish_reading(AsyncRead* read, b32 succeeded) {
+    --async_io.stats.in_flight;
+    if(read->cancelled) {
+        release_async_read(read);
+        ++async_io.stats.cancelled;
+    } else if(!succeeded) {
+        log_error_message("Couldn't read %s\n", read->path);
+        free_file_contents(&read->contents);
+        set_async_read_status(read, ASYNC_READ_FAILED);
+        ++async_io.stats.failed;
+    } else {
+        async_io.stats.bytes_read += read->contents.size;
+        set_async_read_status(read, ASYNC_READ_DECODING);
+        ++async_io.stats.decoding;
+    }
+}
+
+#if ASYNC_IO_URING
+
+static b32
+init_io_uring(IoUring* ring, u32 entries) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    i32 fd = (i32)syscall(__NR_io_uring_setup, entries, &params);
+    if(fd < 0) {
+        return false;
+    }
+
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    b32 single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(single_mmap) {
+        ring->sq_ring_size = ring->cq_ring_size = max(ring->sq_ring_size, ring->cq_ring_size);
+    }
+
+    ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = single_mmap ? ring->sq_ring :
+                    mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if(ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    u8* sq = ring->sq_ring;
+    ring->sq_head  = (u32*)(sq + params.sq_off.head);
+    ring->sq_tail  = (u32*)(sq + params.sq_off.tail);
+    ring->sq_mask  = *(u32*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (u32*)(sq + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    u8* cq = ring->cq_ring;
+    ring->cq_head = (u32*)(cq + params.cq_off.head);
+    ring->cq_tail = (u32*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(u32*)(cq + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+static void
+free_io_uring(IoUring* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// 0 when the submission queue is full, which the queue depth keeps from
+// happening
+static struct io_uring_sqe*
+get_io_uring_sqe(IoUring* ring, u64 user_data) {
+    u32 head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if(ring->sq_local_tail - head == ring->entries) {
+        return 0;
+    }
+    u32 index = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ++ring->sq_local_tail;
+    return sqe;
+}
+
+// Submits everything prepared and waits for at least one completion
+static void
+submit_io_uring(IoUring* ring) {
+    u32 to_submit = ring->sq_local_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    if(to_submit) {
+        ++async_io.stats.submit_calls;
+    }
+    for(;;) {
+        i32 result = (i32)syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, 0, 0);
+        if(result >= 0 || errno != EINTR) {
+            if(result < 0) {
+                log_error_message("io_uring_enter failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+    }
+}
+
+static void
+arm_async_io_wake(void) {
+    struct io_uring_sqe* sqe = get_io_uring_sqe(&async_io.ring, ASYNC_IO_WAKE_TAG);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = async_io.wake_fd;
+    sqe->poll_events = POLLIN;
+}
+
+static inline void
+wake_async_io_thread(void) {
+    u64 one = 1;
+    if(write(async_io.wake_fd, &one, sizeof(one)) < 0) {
+        log_error_message("Couldn't wake the I/O thread\n");
+    }
+}
+
+// Queues the rest of the file. Expects the lock.
+static void
+submit_uring_read(AsyncRead* read) {
+    read->iovec.iov_base = (char*)read->contents.data + read->bytes_done;
+    read->iovec.iov_len  = read->contents.size - read->bytes_done;
+    struct io_uring_sqe* sqe = get_io_uring_sqe(&async_io.ring, (u64)(read - async_io.reads));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd     = read->fd;
+    sqe->addr   = (u64)(size_t)&read->iovec;
+    sqe->len    = 1;
+    sqe->off    = read->bytes_done;
+    ++async_io.stats.reads_submitted;
+}
+
+// Opens the file and queues the read of all of it
+static void
+start_uring_read(AsyncRead* read) {
+    // Files in the archive are already mapped, see asset_archive.c
+    b32 packed = find_archive_entry(read->path) != 0;
+    read->fd = packed ? -1 : open(read->path, O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    b32 opened = packed || (read->fd >= 0 && fstat(read->fd, &file_stat) == 0);
+    size_t size = !packed && opened && S_ISREG(file_stat.st_mode) ? (size_t)file_stat.st_size : 0;
+
+    if(!size) {
+        // Packed files, empty files and pipes go through the same path as
+        // the fallback
+        if(read->fd >= 0) {
+            close(read->fd);
+        }
+        read->fd = -1;
+        FileContents contents = {0};
+        b32 succeeded = opened && read_file_contents(read->path, &contents);
+
+        SDL_LockMutex(async_io.mutex);
+        read->contents = contents;
+        finish_reading(read, succeeded);
+        if(succeeded && !read->cancelled) {
+            push_async_read(&async_io.decode_queue, read);
+            SDL_CondSignal(async_io.work_ready);
+        }
+        SDL_UnlockMutex(async_io.mutex);
+        return;
+    }
+
+    SDL_LockMutex(async_io.mutex);
+    read->contents.data    = malloc(size);
+    read->contents.size    = size;
+    read->contents.backing = FILE_BACKING_HEAP;
+    read->bytes_done       = 0;
+    read->cancel_submitted = false;
+    async_io.stats.bytes_in_flight += size;
+    async_io.stats.peak_bytes_in_flight = max(async_io.stats.peak_bytes_in_flight, async_io.stats.bytes_in_flight);
+    submit_uring_read(read);
+    SDL_UnlockMutex(async_io.mutex);
+}
+
+// Expects the lock
+static void
+complete_uring_read(AsyncRead* read, i32 result) {
+    if(result > 0) {
+        read->bytes_done += result;
+        if(read->bytes_done < read->contents.size && !read->cancelled) {
+            // Short read, go again for the rest
+            submit_uring_read(read);
+            return;
+        }
+    }
+
+    close(read->fd);
+    read->fd = -1;
+    async_io.stats.bytes_in_flight -= read->contents.size;
+    // A file that shrank while we read it ends early
+    read->contents.size = read->bytes_done;
+
+    finish_reading(read, result >= 0);
+    if(result >= 0 && !read->cancelled) {
+        push_async_read(&async_io.decode_queue, read);
+        SDL_CondSignal(async_io.work_ready);
+    }
+}
+
+static int
+async_io_thread(void* data) {
+    IoUring* ring = &async_io.ring;
+    arm_async_io_wake();
+
+    for(;;) {
+        AsyncRead* batch[ASYNC_IO_QUEUE_DEPTH];
+        u32 batch_count = 0;
+
+        SDL_LockMutex(async_io.mutex);
+        // Reads still in flight have to land before their buffers go
+        b32 shutting_down = async_io.shutting_down;
+        if(shutting_down && !async_io.stats.in_flight) {
+            SDL_UnlockMutex(async_io.mutex);
+            break;
+        }
+        // One read is always let through, however big
+        while(!shutting_down && async_io.stats.in_flight < ASYNC_IO_QUEUE_DEPTH &&
+              (async_io.stats.bytes_in_flight < ASYNC_IO_MAX_BYTES_IN_FLIGHT || !async_io.stats.in_flight)) {
+            AsyncRead* read = pop_pending_async_read();
+            if(!read) {
+                break;
+            }
+            set_async_read_status(read, ASYNC_READ_READING);
+            ++async_io.stats.in_flight;
+            async_io.stats.peak_in_flight = max(async_io.stats.peak_in_flight, async_io.stats.in_flight);
+            batch[batch_count++] = read;
+        }
+
+        // Reads in flight that nobody wants anymore
+        for(u32 i = 0; i < MAX_ASYNC_READS; ++i) {
+            AsyncRead* read = &async_io.reads[i];
+            if(read->in_use && read->cancelled && read->fd >= 0 && !read->cancel_submitted) {
+                struct io_uring_sqe* sqe = get_io_uring_sqe(ring, ASYNC_IO_CANCEL_TAG);
+                if(sqe) {
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->addr = i;
+                    read->cancel_submitted = true;
+                }
+            }
+        }
+        SDL_UnlockMutex(async_io.mutex);
+
+        for(u32 i = 0; i < batch_count; ++i) {
+            start_uring_read(batch[i]);
+        }
+        submit_io_uring(ring);
+
+        SDL_LockMutex(async_io.mutex);
+        u32 head = *ring->cq_head;
+        u32 tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; ++head) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+            if(cqe->user_data == ASYNC_IO_WAKE_TAG) {
+                if(read(async_io.wake_fd, &async_io.wake_value, sizeof(async_io.wake_value)) < 0) {
+                    log_error_message("Couldn't reset the I/O thread's eventfd\n");
+                }
+                arm_async_io_wake();
+            } else if(cqe->user_data != ASYNC_IO_CANCEL_TAG) {
+                complete_uring_read(&async_io.reads[cqe->user_data], cqe->res);
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        SDL_UnlockMutex(async_io.mutex);
+    }
+    return 0;
+}
+
+#endif
+
+// Decodes reads that are done with the disk, and without io_uring reads
+// the files too
+static int
+async_io_worker(void* data) {
+    u32 helped_work_id = 0;
+    SDL_LockMutex(async_io.mutex);
+    for(;;) {
+        AsyncRead* read = pop_async_read(&async_io.decode_queue);
+        if(!read && !async_io.uring && !async_io.shutting_down) {
+            read = pop_pending_async_read();
+            if(read) {
+                set_async_read_status(read, ASYNC_READ_READING);
+                ++async_io.stats.in_flight;
+                async_io.stats.peak_in_flight = max(async_io.stats.peak_in_flight, async_io.stats.in_flight);
+                SDL_UnlockMutex(async_io.mutex);
+
+                FileContents contents;
+                b32 succeeded = read_file_contents(read->path, &contents);
+
+                SDL_LockMutex(async_io.mutex);
+                read->contents = contents;
+                finish_reading(read, succeeded);
+                if(!succeeded || read->cancelled) {
+                    continue;
+                }
+            }
+        }
+        if(!read && async_io.shared_work && async_io.shared_work_id != helped_work_id) {
+            AsyncSharedWork* work = async_io.shared_work;
+            void* work_data = async_io.shared_work_data;
+            helped_work_id = async_io.shared_work_id;
+            ++async_io.shared_work_helpers;
+            SDL_UnlockMutex(async_io.mutex);
+
+            work(work_data);
+
+            SDL_LockMutex(async_io.mutex);
+            if(--async_io.shared_work_helpers == 0) {
+                SDL_CondSignal(async_io.shared_work_done);
+            }
+            continue;
+        }
+        if(!read) {
+            if(async_io.shutting_down) {
+                break;
+            }
+            SDL_CondWait(async_io.work_ready, async_io.mutex);
+            continue;
+        }
+        if(read->cancelled) {
+            --async_io.stats.decoding;
+            release_async_read(read);
+            ++async_io.stats.cancelled;
+            continue;
+        }
+        SDL_UnlockMutex(async_io.mutex);
+
+        void* result;
+        if(read->decode) {
+            result = read->decode(read->contents.data, read->contents.size, read->user_data);
+            free_file_contents(&read->contents);
+        } else {
+            FileContents* contents = malloc(sizeof(FileContents));
+            *contents = read->contents;
+            memset(&read->contents, 0, sizeof(read->contents));
+            result = contents;
+        }
+
+        SDL_LockMutex(async_io.mutex);
+        --async_io.stats.decoding;
+        read->result = result;
+        if(read->cancelled) {
+            release_async_read(read);
+            ++async_io.stats.cancelled;
+        } else if(!result) {
+            log_error_message("Couldn't decode %s\n", read->path);
+            set_async_read_status(read, ASYNC_READ_FAILED);
+            ++async_io.stats.failed;
+        } else {
+            u64 elapsed = SDL_GetPerformanceCounter() - read->request_counter;
+            async_io.stats.latency_ms += 1000.0 * (f64)elapsed / (f64)SDL_GetPerformanceFrequency();
+            set_async_read_status(read, ASYNC_READ_DONE);
+            ++async_io.stats.completed;
+        }
+    }
+    SDL_UnlockMutex(async_io.mutex);
+    return 0;
+}
+
+static void
+init_async_io(void) {
+    memset(&async_io, 0, sizeof(async_io));
+    async_io.mutex = SDL_CreateMutex();
+    async_io.work_ready = SDL_CreateCond();
+    async_io.shared_work_done = SDL_CreateCond();
+
+#if ASYNC_IO_URING
+    async_io.wake_fd = eventfd(0, EFD_CLOEXEC);
+    // Room for a full batch of reads, a cancel for each and the wake up poll
+    if(async_io.wake_fd >= 0 && init_io_uring(&async_io.ring, ASYNC_IO_QUEUE_DEPTH * 4)) {
+        async_io.uring = true;
+        async_io.io_thread = SDL_CreateThread(async_io_thread, "async io", 0);
+    } else if(async_io.wake_fd >= 0) {
+        close(async_io.wake_fd);
+    }
+#endif
+
+    // The main thread has plenty to do already
+    i32 worker_count = SDL_GetCPUCount() - 1;
+    async_io.worker_count = (u32)min(max(worker_count, 1), MAX_ASYNC_IO_WORKERS);
+    for(u32 i = 0; i < async_io.worker_count; ++i) {
+        async_io.workers[i] = SDL_CreateThread(async_io_worker, "async io worker", 0);
+    }
+    log_debug_message("Async I/O with %s and %u workers\n",
+                      async_io.uring ? "io_uring" : "blocking reads", async_io.worker_count);
+}
+
+// Call from a decode function. Runs work on this worker, and on every
+// worker that is idle or becomes idle before it's done. Returns once all of
+// them have. One decode shares at a time, work runs alone on this worker
+// while another one is.
+static void
+share_async_work(AsyncSharedWork* work, void* data) {
+    SDL_LockMutex(async_io.mutex);
+    b32 shared = !async_io.shared_work;
+    if(shared) {
+        async_io.shared_work      = work;
+        async_io.shared_work_data = data;
+        ++async_io.shared_work_id;
+        SDL_CondBroadcast(async_io.work_ready);
+    }
+    SDL_UnlockMutex(async_io.mutex);
+
+    work(data);
+
+    if(shared) {
+        SDL_LockMutex(async_io.mutex);
+        async_io.shared_work = 0;
+        while(async_io.shared_work_helpers) {
+            SDL_CondWait(async_io.shared_work_done, async_io.mutex);
+        }
+        SDL_UnlockMutex(async_io.mutex);
+    }
+}
+
+static AsyncReadHandle
+request_async_read(const char* path, AsyncReadPriority priority,
+                   AsyncDecodeFunction* decode, AsyncFreeFunction* free_result, void* user_data) {
+    if(strlen(path) >= MAX_ASYNC_READ_PATH_LENGTH) {
+        log_error_message("Path too long to read: %s\n", path);
+        return 0;
+    }
+
+    SDL_LockMutex(async_io.mutex);
+    AsyncRead* read = 0;
+    for(u32 i = 0; i < MAX_ASYNC_READS && !read; ++i) {
+        if(!async_io.reads[i].in_use) {
+            read = &async_io.reads[i];
+        }
+    }
+    if(!read) {
+        SDL_UnlockMutex(async_io.mutex);
+        log_error_message("Too many async reads, can't read %s\n", path);
+        return 0;
+    }
+
+    read->in_use          = true;
+    read->cancelled       = false;
+    read->priority        = priority;
+    read->decode          = decode;
+    read->free_result     = decode ? free_result : free_async_read_contents;
+    read->user_data       = user_data;
+    read->request_counter = SDL_GetPerformanceCounter();
+    read->result          = 0;
+    memset(&read->contents, 0, sizeof(read->contents));
+#if ASYNC_IO_URING
+    read->fd = -1;
+#endif
+    strcpy(read->path, path);
+    // The generation stays in 16 bits of the handle
+    read->generation &= 0xffff;
+    set_async_read_status(read, ASYNC_READ_QUEUED);
+    push_async_read(&async_io.pending[priority], read);
+
+    ++async_io.stats.queued;
+    async_io.stats.peak_queued = max(async_io.stats.peak_queued, async_io.stats.queued);
+    AsyncReadHandle handle = (read->generation << 16) | (u32)(read - async_io.reads + 1);
+    if(!async_io.uring) {
+        SDL_CondSignal(async_io.work_ready);
+    }
+    SDL_UnlockMutex(async_io.mutex);
+
+#if ASYNC_IO_URING
+    if(async_io.uring) {
+        wake_async_io_thread();
+    }
+#endif
+    return handle;
+}
+
+// Never blocks
+static AsyncReadStatus
+async_read_status(AsyncReadHandle handle) {
+    u32 index = (handle & 0xffff) - 1;
+    if(!handle || index >= MAX_ASYNC_READS) {
+        return ASYNC_READ_INVALID;
+    }
+    u32 state = (u32)SDL_AtomicGet(&async_io.reads[index].state);
+    if((state >> 8) != (handle >> 16)) {
+        return ASYNC_READ_INVALID;
+    }
+    return (AsyncReadStatus)(state & 0xff);
+}
+
+// The decoded result of a read that is done, which the caller now owns. The
+// handle is no good after this.
+static void*
+take_async_read_result(AsyncReadHandle handle) {
+    void* result = 0;
+    SDL_LockMutex(async_io.mutex);
+    AsyncRead* read = find_async_read(handle);
+    if(read && (SDL_AtomicGet(&read->state) & 0xff) == ASYNC_READ_DONE) {
+        result = read->result;
+        read->result = 0;
+        release_async_read(read);
+    }
+    SDL_UnlockMutex(async_io.mutex);
+    return result;
+}
+
+// Drops the read whatever state it's in, and frees its result. The handle
+// is no good after this. Also how failed reads are let go of.
+static void
+cancel_async_read(AsyncReadHandle handle) {
+    SDL_LockMutex(async_io.mutex);
+    AsyncRead* read = find_async_read(handle);
+    AsyncReadStatus status = read ? (AsyncReadStatus)(SDL_AtomicGet(&read->state) & 0xff) : ASYNC_READ_INVALID;
+    switch(status) {
+        case ASYNC_READ_QUEUED: {
+            remove_async_read(&async_io.pending[read->priority], read);
+            --async_io.stats.queued;
+            release_async_read(read);
+            ++async_io.stats.cancelled;
+        } break;
+
+        case ASYNC_READ_READING:
+        case ASYNC_READ_DECODING: {
+            // Whoever has it lets go of it
+            read->cancelled = true;
+        } break;
+
+        case ASYNC_READ_DONE:
+        case ASYNC_READ_FAILED: {
+            release_async_read(read);
+        } break;
+
+        case ASYNC_READ_INVALID: break;
+    }
+    SDL_UnlockMutex(async_io.mutex);
+
+#if ASYNC_IO_URING
+    if(async_io.uring && status == ASYNC_READ_READING) {
+        wake_async_io_thread();
+    }
+#endif
+}
+
+static AsyncIOStats
+get_async_io_stats(void) {
+    SDL_LockMutex(async_io.mutex);
+    AsyncIOStats stats = async_io.stats;
+    SDL_UnlockMutex(async_io.mutex);
+    return stats;
+}
+
+// Stops the threads, anything still queued or in flight is dropped
+static void
+shutdown_async_io(void) {
+    SDL_LockMutex(async_io.mutex);
+    async_io.shutting_down = true;
+    for(u32 i = 0; i < MAX_ASYNC_READS; ++i) {
+        async_io.reads[i].cancelled = true;
+    }
+    SDL_CondBroadcast(async_io.work_ready);
+    SDL_UnlockMutex(async_io.mutex);
+
+#if ASYNC_IO_URING
+    if(async_io.uring) {
+        wake_async_io_thread();
+        SDL_WaitThread(async_io.io_thread, 0);
+        free_io_uring(&async_io.ring);
+        close(async_io.wake_fd);
+    }
+#endif
+    for(u32 i = 0; i < async_io.worker_count; ++i) {
+        SDL_WaitThread(async_io.workers[i], 0);
+    }
+
+    for(u32 i = 0; i < MAX_ASYNC_READS; ++i) {
+        if(async_io.reads[i].in_use) {
+            release_async_read(&async_io.reads[i]);
+        }
+    }
+    SDL_DestroyCond(async_io.shared_work_done);
+    SDL_DestroyCond(async_io.work_ready);
+    SDL_DestroyMutex(async_io.mutex);
+}
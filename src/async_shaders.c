@@ -0,0 +1,370 @@
+/*
+  Asynchronous shader programs.
+
+  Programs are submitted up front and handed out as ShaderHandles straight
+  away. All compiles and links are queued before anything asks the driver
+  for a status, so with ARB_parallel_shader_compile (the ARB twin of
+  KHR_parallel_shader_compile, which our GLEW doesn't know about) they run
+  on the driver's compiler threads while we keep rendering.
+  poll_shader_programs checks GL_COMPLETION_STATUS_ARB once a frame and
+  only finishes the programs that are done, so nothing ever blocks.
+
+  Without the extension asking for a status waits on the compile, so the
+  poll finishes at most one program per frame. That bounds the hitch to a
+  single link instead of the whole startup.
+
+  Until a program is ready, or for good if it failed to build, the handle
+  resolves to a flat shaded fallback program that understands the same
+  vertex layout and frame uniforms as everything else.
+
+  Programs found in the binary cache are ready as soon as they are
+  submitted, and programs built from source are stored there when they
+  finish.
+
+  When program pipelines are on, see program_pipelines.c, programs built
+  from source are pipelines instead, and their stage programs are what
+  goes in the binary cache. A handle then resolves to a pipeline
+  and no program, and uniforms are set on whichever stage program has
+  them, see shader_program_with_uniform.
+
+  A handle can be rebuilt from new sources, see hot_reload.c. The new
+  build is pending next to the program the handle already has, which keeps
+  drawing until the poll swaps the new one in, or for good if the new one
+  fails to build.
+*/
+
+// 0 is never a valid handle
+typedef u32 ShaderHandle;
+
+typedef struct {
+    // Linked and ready to draw with, 0 until then
+    u32 program;
+    // Submitted link waiting to be finished
+    u32 pending_program;
+    // Same for program pipelines, used instead of the two above
+    u32 pipeline;
+    u32 pending_pipeline;
+    u64 binary_key;
+    b32 failed;
+    // When the change that started a rebuild was seen, 0 for the first build
+    u64 reload_counter;
+} AsyncShader;
+
+typedef struct {
+    u32 submitted;
+    u32 ready;
+    u32 failed;
+    u64 first_submit_counter;
+    u32 reloads;
+    u32 reload_failures;
+} AsyncShaderStats;
+
+static AsyncShader async_shaders[MAX_SHADER_PROGRAMS];
+static u32 async_shader_count;
+static u32 fallback_program;
+static AsyncShaderStats async_shader_stats;
+
+static const char fallback_vertex_source[] =
+    "#version 330 core\n"
+    "layout(location = 0) in vec3 in_vertex_position;\n"
+    "layout(location = 2) in mat4 in_model;\n"
+    "layout(location = 6) in vec3 in_position_scale;\n"
+    "layout(std140) uniform FrameUniforms {\n"
+    "    mat4 view;\n"
+    "    mat4 projection;\n"
+    "    vec4 view_pos;\n"
+    "    vec4 light_pos;\n"
+    "    vec4 light_color;\n"
+    "};\n"
+    "void main() {\n"
+    "    vec3 position = in_vertex_position * in_position_scale;\n"
+    "    gl_Position = projection * view * in_model * vec4(position, 1.0);\n"
+    "}\n";
+
+static const char fallback_fragment_source[] =
+    "#version 330 core\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "    color = vec4(0.5, 0.5, 0.5, 1.0);\n"
+    "}\n";
+
+// Builds the fallback program, the one program we wait for
+static b32
+init_async_shaders(GLState* gl_state) {
+    memset(async_shaders, 0, sizeof(async_shaders));
+    memset(&async_shader_stats, 0, sizeof(async_shader_stats));
+    async_shader_count = 0;
+
+    if(GLEW_ARB_parallel_shader_compile) {
+        // Let the driver pick how many threads to use
+        glMaxShaderCompilerThreadsARB(0xffffffff);
+    }
+
+    i32 stages[2];
+    stages[0] = acquire_shader_stage(GL_VERTEX_SHADER, "fallback vertex",
+                                     fallback_vertex_source, sizeof(fallback_vertex_source) - 1);
+    stages[1] = acquire_shader_stage(GL_FRAGMENT_SHADER, "fallback fragment",
+                                     fallback_fragment_source, sizeof(fallback_fragment_source) - 1);
+    fallback_program = link_shader_program(gl_state, stages, array_count(stages));
+    log_debug_message("Parallel shader compile %s\n",
+                      GLEW_ARB_parallel_shader_compile ? "available" : "not available");
+    return fallback_program != 0;
+}
+
+static ShaderHandle
+add_async_shader(u32 program, u32 pending_program, u32 pending_pipeline, u64 binary_key) {
+    if(async_shader_count == MAX_SHADER_PROGRAMS) {
+        log_error_message("Too many shader programs\n");
+        return 0;
+    }
+    if(!async_shader_stats.submitted) {
+        async_shader_stats.first_submit_counter = SDL_GetPerformanceCounter();
+    }
+    ++async_shader_stats.submitted;
+
+    AsyncShader* shader = &async_shaders[async_shader_count++];
+    shader->program         = program;
+    shader->pending_program  = pending_program;
+    shader->pending_pipeline = pending_pipeline;
+    shader->binary_key       = binary_key;
+    if(program) {
+        ++async_shader_stats.ready;
+    }
+    return async_shader_count;
+}
+
+// For a program that is already linked, like one from the binary cache
+static inline ShaderHandle
+add_ready_shader_program(u32 program) {
+    return add_async_shader(program, 0, 0, 0);
+}
+
+// Submits the link, or the pipeline, without waiting for it. The program
+// takes over the stage references, see begin_link_shader_program. Returns
+// false if it couldn't be submitted.
+static b32
+begin_shader_program(const i32* stages, u32 stage_count, u32* pending_program, u32* pending_pipeline) {
+    *pending_program  = 0;
+    *pending_pipeline = 0;
+    if(program_pipelines_enabled) {
+        *pending_pipeline = begin_program_pipeline(stages, stage_count);
+    } else {
+        *pending_program = begin_link_shader_program(stages, stage_count);
+    }
+    return *pending_program || *pending_pipeline;
+}
+
+static ShaderHandle
+submit_shader_program(const i32* stages, u32 stage_count, u64 binary_key) {
+    u32 pending_program;
+    u32 pending_pipeline;
+    if(!begin_shader_program(stages, stage_count, &pending_program, &pending_pipeline)) {
+        ++async_shader_stats.failed;
+        return 0;
+    }
+    // Pipelines store their stage programs instead, see program_pipelines.c
+    return add_async_shader(0, pending_program, pending_pipeline, pending_program ? binary_key : 0);
+}
+
+// Puts a new program or pipeline in place of the handle's current one,
+// which is deleted
+static void
+swap_async_shader(GLState* gl_state, AsyncShader* shader, u32 program, u32 pipeline) {
+    u32 old_program  = shader->program;
+    u32 old_pipeline = shader->pipeline;
+    shader->program  = program;
+    shader->pipeline = pipeline;
+    shader->failed   = false;
+    if(old_program) {
+        delete_shader_program(gl_state, old_program);
+    }
+    if(old_pipeline) {
+        delete_program_pipeline_entry(gl_state, old_pipeline);
+    }
+}
+
+// Drops a build that hasn't finished, for a handle that is rebuilt again
+// before the last rebuild was done
+static void
+drop_pending_async_shader(GLState* gl_state, AsyncShader* shader) {
+    if(shader->pending_program) {
+        delete_shader_program(gl_state, shader->pending_program);
+    }
+    if(shader->pending_pipeline) {
+        delete_program_pipeline_entry(gl_state, shader->pending_pipeline);
+    }
+    shader->pending_program  = 0;
+    shader->pending_pipeline = 0;
+}
+
+static void
+log_shader_reload(AsyncShader* shader) {
+    ++async_shader_stats.reloads;
+    log_debug_message("Reloaded shader program %u %.2f ms after the change\n",
+                      (u32)(shader - async_shaders) + 1, elapsed_ms(shader->reload_counter));
+    shader->reload_counter = 0;
+}
+
+// Rebuilds the handle from new stages, which it takes over. change_counter
+// is when the change was seen, for the log.
+static void
+resubmit_shader_program(GLState* gl_state, ShaderHandle handle, const i32* stages, u32 stage_count,
+                        u64 binary_key, u64 change_counter) {
+    AsyncShader* shader = &async_shaders[handle - 1];
+    drop_pending_async_shader(gl_state, shader);
+    u32 pending_program;
+    u32 pending_pipeline;
+    if(!begin_shader_program(stages, stage_count, &pending_program, &pending_pipeline)) {
+        ++async_shader_stats.reload_failures;
+        log_error_message("Shader program %u can't be rebuilt, keeping the previous one\n", handle);
+        return;
+    }
+    shader->pending_program  = pending_program;
+    shader->pending_pipeline = pending_pipeline;
+    shader->binary_key       = pending_program ? binary_key : 0;
+    shader->reload_counter   = change_counter;
+}
+
+// Same for a rebuild found in the binary cache, which swaps right away
+static void
+reload_ready_shader_program(GLState* gl_state, ShaderHandle handle, u32 program, u64 change_counter) {
+    AsyncShader* shader = &async_shaders[handle - 1];
+    drop_pending_async_shader(gl_state, shader);
+    swap_async_shader(gl_state, shader, program, 0);
+    shader->reload_counter = change_counter;
+    log_shader_reload(shader);
+}
+
+static void
+finish_async_shader(GLState* gl_state, AsyncShader* shader) {
+    b32 built;
+    if(shader->pending_pipeline) {
+        u32 pipeline = shader->pending_pipeline;
+        shader->pending_pipeline = 0;
+        built = finish_program_pipeline(gl_state, pipeline);
+        if(built) {
+            swap_async_shader(gl_state, shader, 0, pipeline);
+        }
+    } else {
+        u32 program = shader->pending_program;
+        shader->pending_program = 0;
+        built = finish_link_shader_program(gl_state, program);
+        if(built) {
+            swap_async_shader(gl_state, shader, program, 0);
+            store_program_binary(shader->binary_key, program);
+        }
+    }
+
+    if(shader->reload_counter) {
+        if(built) {
+            log_shader_reload(shader);
+        } else {
+            // Whatever drew before keeps drawing
+            ++async_shader_stats.reload_failures;
+            shader->reload_counter = 0;
+            log_error_message("Shader program %u failed to rebuild, keeping the previous one\n",
+                              (u32)(shader - async_shaders) + 1);
+        }
+        return;
+    }
+
+    if(built) {
+        ++async_shader_stats.ready;
+    } else {
+        // Keeps drawing with the fallback
+        shader->failed = true;
+        ++async_shader_stats.failed;
+        log_error_message("Shader program %u failed to build\n", (u32)(shader - async_shaders) + 1);
+    }
+
+    if(async_shader_stats.ready + async_shader_stats.failed == async_shader_stats.submitted) {
+        log_debug_message("All %u shader programs done %.2f ms after the first submit, %u failed\n",
+                          async_shader_stats.submitted, elapsed_ms(async_shader_stats.first_submit_counter),
+                          async_shader_stats.failed);
+    }
+}
+
+// Call once a frame. Finishes every program whose link is done, or a single
+// one when the driver can't tell us without blocking.
+static void
+poll_shader_programs(GLState* gl_state) {
+    for(u32 i = 0; i < async_shader_count; ++i) {
+        AsyncShader* shader = &async_shaders[i];
+        if(!shader->pending_program && !shader->pending_pipeline) {
+            continue;
+        }
+
+        if(GLEW_ARB_parallel_shader_compile) {
+            i32 completed = 0;
+            if(shader->pending_pipeline) {
+                completed = program_pipeline_completed(shader->pending_pipeline);
+            } else {
+                glGetProgramiv(shader->pending_program, GL_COMPLETION_STATUS_ARB, &completed);
+            }
+            if(completed) {
+                finish_async_shader(gl_state, shader);
+            }
+        } else {
+            finish_async_shader(gl_state, shader);
+            break;
+        }
+    }
+}
+
+static inline b32
+shader_program_ready(ShaderHandle handle) {
+    return handle && (async_shaders[handle - 1].program || async_shaders[handle - 1].pipeline);
+}
+
+// The pipeline to draw with this frame, 0 means use shader_program_for_drawing
+static inline u32
+shader_pipeline_for_drawing(ShaderHandle handle) {
+    return handle ? async_shaders[handle - 1].pipeline : 0;
+}
+
+// The program to draw with this frame
+static inline u32
+shader_program_for_drawing(ShaderHandle handle) {
+    if(!handle) {
+        return fallback_program;
+    }
+    u32 program = async_shaders[handle - 1].program;
+    return program ? program : fallback_program;
+}
+
+// The program to set the uniform on: the program itself, or for a pipeline
+// the stage program that has the uniform. 0 when it isn't ready.
+static u32
+shader_program_with_uniform(ShaderHandle handle, UniformName name) {
+    if(!shader_program_ready(handle)) {
+        return 0;
+    }
+    AsyncShader* shader = &async_shaders[handle - 1];
+    if(shader->pipeline) {
+        return pipeline_program_with_uniform(shader->pipeline, name);
+    }
+    return shader->program;
+}
+
+static void
+free_async_shaders(GLState* gl_state) {
+    for(u32 i = 0; i < async_shader_count; ++i) {
+        AsyncShader* shader = &async_shaders[i];
+        if(shader->program) {
+            delete_shader_program(gl_state, shader->program);
+        }
+        if(shader->pending_program) {
+            delete_shader_program(gl_state, shader->pending_program);
+        }
+        if(shader->pipeline) {
+            delete_program_pipeline_entry(gl_state, shader->pipeline);
+        }
+        if(shader->pending_pipeline) {
+            delete_program_pipeline_entry(gl_state, shader->pending_pipeline);
+        }
+    }
+    delete_shader_program(gl_state, fallback_program);
+    memset(async_shaders, 0, sizeof(async_shaders));
+    async_shader_count = 0;
+    fallback_program = 0;
+}
@@ -0,0 +1,180 @@
+/*
+  Cooked textures.
+
+  The format texture_cooker.c writes and textures.c loads: a DDS file
+  holding a block compressed image with its whole mip chain, level 0
+  first, each level right after the one before. Only the legacy FourCC
+  header is used, which every DDS reader understands:
+
+    BC1 (DXT1)  RGB, 8 bytes per 4x4 block
+    BC3 (DXT5)  RGBA, 16 bytes per block
+    BC4 (ATI1)  one channel, 8 bytes per block
+    BC5 (ATI2)  two channels, 16 bytes per block
+
+  Rows are stored bottom up, the way GL wants them, same as decode_image
+  with flipping on.
+
+  A cooked texture sits next to its source with the extension swapped,
+  data/textures/container.jpg cooks to data/textures/container.dds.
+*/
+
+#define DDS_MAGIC 0x20534444 // "DDS "
+#define DDS_FOURCC(a, b, c, d) ((u32)(a) | ((u32)(b) << 8) | ((u32)(c) << 16) | ((u32)(d) << 24))
+
+#define DDSD_CAPS 0x1
+#define DDSD_HEIGHT 0x2
+#define DDSD_WIDTH 0x4
+#define DDSD_PIXELFORMAT 0x1000
+#define DDSD_MIPMAPCOUNT 0x20000
+#define DDSD_LINEARSIZE 0x80000
+#define DDPF_FOURCC 0x4
+#define DDSCAPS_COMPLEX 0x8
+#define DDSCAPS_TEXTURE 0x1000
+#define DDSCAPS_MIPMAP 0x400000
+
+// Counted the same way as the mip chains, see mip_level_count
+#define MAX_COOKED_TEXTURE_LEVELS MAX_MIP_LEVELS
+#define MAX_COOKED_TEXTURE_PATH_LENGTH 256
+
+typedef struct {
+    u32 size;
+    u32 flags;
+    u32 four_cc;
+    u32 rgb_bit_count;
+    u32 r_mask;
+    u32 g_mask;
+    u32 b_mask;
+    u32 a_mask;
+} DdsPixelFormat;
+
+typedef struct {
+    u32 magic;
+    // Everything after the magic, 124
+    u32 size;
+    u32 flags;
+    u32 height;
+    u32 width;
+    u32 linear_size;
+    u32 depth;
+    u32 level_count;
+    u32 reserved[11];
+    DdsPixelFormat pixel_format;
+    u32 caps;
+    u32 caps2;
+    u32 caps3;
+    u32 caps4;
+    u32 reserved2;
+} DdsHeader;
+
+typedef enum {
+    COOKED_FORMAT_BC1,
+    COOKED_FORMAT_BC3,
+    COOKED_FORMAT_BC4,
+    COOKED_FORMAT_BC5,
+    COOKED_FORMAT_COUNT,
+} CookedTextureFormat;
+
+static const u32 cooked_format_four_ccs[COOKED_FORMAT_COUNT] = {
+    DDS_FOURCC('D', 'X', 'T', '1'),
+    DDS_FOURCC('D', 'X', 'T', '5'),
+    DDS_FOURCC('A', 'T', 'I', '1'),
+    DDS_FOURCC('A', 'T', 'I', '2'),
+};
+static const u32 cooked_format_block_sizes[COOKED_FORMAT_COUNT] = {8, 16, 8, 16};
+
+typedef struct {
+    u32 width;
+    u32 height;
+    const u8* data;
+    u32 size;
+} CookedTextureLevel;
+
+typedef struct {
+    CookedTextureFormat format;
+    u32 level_count;
+    CookedTextureLevel levels[MAX_COOKED_TEXTURE_LEVELS];
+} CookedTexture;
+
+static inline u32
+cooked_level_size(CookedTextureFormat format, u32 width, u32 height) {
+    return ((width + 3) / 4) * ((height + 3) / 4) * cooked_format_block_sizes[format];
+}
+
+// The .dds next to a source image
+static void
+cooked_texture_path(const char* source_path, char* path, u32 path_size) {
+    const char* dot = strrchr(source_path, '.');
+    const char* slash = strrchr(source_path, '/');
+    u32 length = (dot && (!slash || dot > slash)) ? (u32)(dot - source_path) : (u32)strlen(source_path);
+    snprintf(path, path_size, "%.*s.dds", length, source_path);
+}
+
+static void
+fill_dds_header(DdsHeader* header, CookedTextureFormat format, u32 width, u32 height, u32 level_count) {
+    memset(header, 0, sizeof(*header));
+    header->magic       = DDS_MAGIC;
+    header->size        = sizeof(DdsHeader) - sizeof(header->magic);
+    header->flags       = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT | DDSD_LINEARSIZE;
+    header->height      = height;
+    header->width       = width;
+    header->linear_size = cooked_level_size(format, width, height);
+    header->level_count = level_count;
+    header->pixel_format.size    = sizeof(DdsPixelFormat);
+    header->pixel_format.flags   = DDPF_FOURCC;
+    header->pixel_format.four_cc = cooked_format_four_ccs[format];
+    header->caps = DDSCAPS_TEXTURE | (level_count > 1 ? DDSCAPS_COMPLEX | DDSCAPS_MIPMAP : 0);
+}
+
+// Points the levels into data, which has to outlive the texture. Returns
+// false if it isn't a DDS we wrote.
+static b32
+parse_cooked_texture(const char* data, size_t size, CookedTexture* texture) {
+    memset(texture, 0, sizeof(*texture));
+    const DdsHeader* header = (const DdsHeader*)data;
+    if(size < sizeof(*header) || header->magic != DDS_MAGIC || header->size != sizeof(*header) - sizeof(u32) ||
+       !(header->pixel_format.flags & DDPF_FOURCC) || !header->width || !header->height) {
+        return false;
+    }
+
+    u32 four_cc = header->pixel_format.four_cc;
+    if(four_cc == DDS_FOURCC('B', 'C', '4', 'U')) {
+        four_cc = DDS_FOURCC('A', 'T', 'I', '1');
+    } else if(four_cc == DDS_FOURCC('B', 'C', '5', 'U')) {
+        four_cc = DDS_FOURCC('A', 'T', 'I', '2');
+    }
+    u32 format = 0;
+    while(format < COOKED_FORMAT_COUNT && cooked_format_four_ccs[format] != four_cc) {
+        ++format;
+    }
+    if(format == COOKED_FORMAT_COUNT) {
+        return false;
+    }
+
+    u32 level_count = 1;
+    if(header->flags & DDSD_MIPMAPCOUNT) {
+        level_count = max(header->level_count, 1);
+    }
+    if(level_count > mip_level_count(header->width, header->height)) {
+        return false;
+    }
+
+    texture->format = (CookedTextureFormat)format;
+    texture->level_count = level_count;
+    size_t offset = sizeof(*header);
+    u32 width  = header->width;
+    u32 height = header->height;
+    for(u32 i = 0; i < level_count; ++i) {
+        CookedTextureLevel* level = &texture->levels[i];
+        level->width  = width;
+        level->height = height;
+        level->size   = cooked_level_size(texture->format, width, height);
+        if(offset + level->size > size) {
+            return false;
+        }
+        level->data = (const u8*)data + offset;
+        offset += level->size;
+        width  = max(width / 2, 1);
+        height = max(height / 2, 1);
+    }
+    return true;
+}
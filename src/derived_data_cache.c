@@ -0,0 +1,337 @@
+/*
+  Derived data cache.
+
+  Anything we make from an asset that comes out the same every time, like
+  a decoded and mipped texture or a preprocessed shader, is stored here
+  and loaded back instead of being made again on the next launch. An
+  entry is keyed by what it was made from: a hash of the source's
+  contents, the kind of processing, and its parameters, see
+  derived_data_key. Editing the source or changing how it's processed
+  makes a new key, so nothing is ever invalidated, stale entries just stop
+  being used.
+
+  Entries are files in DERIVED_DATA_DIRECTORY, written under a temporary
+  name and renamed into place, so a reader never sees half of one. Loads
+  are views from read_loose_file_contents, so a big entry is mapped, not
+  copied.
+
+  The cache stays under DERIVED_DATA_BUDGET bytes by deleting the least
+  recently used entries. When each entry was last used is kept in an
+  index file that is written on shutdown. An entry whose file is there but
+  isn't in the index, because the index was lost, is picked up again the
+  first time it's loaded.
+
+  Loads and stores can come from any thread, the index is behind a mutex.
+  Set DERIVED_DATA_CACHE to 0 to compare launches without it.
+*/
+
+#define DERIVED_DATA_CACHE 1
+#define DERIVED_DATA_DIRECTORY "data/derived_cache"
+#define DERIVED_DATA_BUDGET (256ull * 1024 * 1024)
+#define DERIVED_DATA_MAGIC 0x41544444 // "DDTA"
+#define DERIVED_DATA_INDEX_MAGIC 0x58444944 // "DIDX"
+#define MAX_DERIVED_DATA_ENTRIES 1024
+
+typedef struct {
+    u32 magic;
+    u32 reserved;
+    u64 key;
+    u64 size;
+} DerivedDataHeader;
+
+typedef struct {
+    u64 key;
+    // Of the whole file, header included
+    u64 size;
+    // Higher is more recent
+    u64 last_used;
+} DerivedDataEntry;
+
+typedef struct {
+    u32 magic;
+    u32 entry_count;
+    u64 tick;
+} DerivedDataIndexHeader;
+
+typedef struct {
+    u32 hits;
+    u32 misses;
+    u32 stores;
+    u32 evictions;
+    u64 bytes_loaded;
+    u64 bytes_stored;
+} DerivedDataStats;
+
+typedef struct {
+    b32 enabled;
+    SDL_mutex* mutex;
+    u64 total_size;
+    u64 tick;
+    u32 temp_counter;
+    u32 entry_count;
+    DerivedDataEntry entries[MAX_DERIVED_DATA_ENTRIES];
+    DerivedDataStats stats;
+} DerivedDataCache;
+
+// A loaded entry, data points into file
+typedef struct {
+    FileContents file;
+    const char* data;
+    size_t size;
+} DerivedData;
+
+static DerivedDataCache derived_data_cache;
+
+static inline void
+derived_data_path(u64 key, char* path, size_t path_size) {
+    snprintf(path, path_size, "%s/%016llx.dd", DERIVED_DATA_DIRECTORY, (unsigned long long)key);
+}
+
+// kind names the processing and should change with it, like "texture 2".
+// parameters are hashed as bytes, so padding in them has to be zeroed.
+static u64
+derived_data_key(const char* kind, u64 source_hash, const void* parameters, size_t parameters_size) {
+    u64 key = hash_bytes_64(kind, strlen(kind));
+    key = hash_combine_64(key, &source_hash, sizeof(source_hash));
+    key = hash_combine_64(key, parameters, parameters_size);
+    return key;
+}
+
+// Expects the lock
+static DerivedDataEntry*
+find_derived_data_entry(u64 key) {
+    for(u32 i = 0; i < derived_data_cache.entry_count; ++i) {
+        if(derived_data_cache.entries[i].key == key) {
+            return &derived_data_cache.entries[i];
+        }
+    }
+    return 0;
+}
+
+// Expects the lock
+static void
+remove_derived_data_entry(DerivedDataEntry* entry) {
+    derived_data_cache.total_size -= entry->size;
+    *entry = derived_data_cache.entries[--derived_data_cache.entry_count];
+}
+
+// Deletes least recently used entries until the cache fits in the budget
+// and has room for one more. keep is never deleted. Expects the lock.
+static void
+evict_derived_data(u64 keep) {
+    u32 skipped = 0;
+    while((derived_data_cache.total_size > DERIVED_DATA_BUDGET ||
+           derived_data_cache.entry_count == MAX_DERIVED_DATA_ENTRIES) &&
+          skipped < derived_data_cache.entry_count) {
+        DerivedDataEntry* oldest = 0;
+        for(u32 i = 0; i < derived_data_cache.entry_count; ++i) {
+            DerivedDataEntry* entry = &derived_data_cache.entries[i];
+            if(entry->key != keep && (!oldest || entry->last_used < oldest->last_used)) {
+                oldest = entry;
+            }
+        }
+        if(!oldest) {
+            break;
+        }
+        char path[256];
+        derived_data_path(oldest->key, path, sizeof(path));
+        if(remove(path) != 0 && errno != ENOENT) {
+            // Windows won't delete a file someone has mapped, it can go next time
+            oldest->last_used = ++derived_data_cache.tick;
+            ++skipped;
+            continue;
+        }
+        remove_derived_data_entry(oldest);
+        ++derived_data_cache.stats.evictions;
+    }
+}
+
+// Makes room and adds an entry for key, or returns 0 when every entry is
+// still there because their files can't be deleted yet. Expects the lock.
+static DerivedDataEntry*
+add_derived_data_entry(u64 key) {
+    evict_derived_data(0);
+    if(derived_data_cache.entry_count == MAX_DERIVED_DATA_ENTRIES) {
+        return 0;
+    }
+    DerivedDataEntry* entry = &derived_data_cache.entries[derived_data_cache.entry_count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->key = key;
+    return entry;
+}
+
+static void
+init_derived_data_cache(void) {
+    memset(&derived_data_cache, 0, sizeof(derived_data_cache));
+#if DERIVED_DATA_CACHE
+    if(!create_directory(DERIVED_DATA_DIRECTORY)) {
+        log_error_message("Derived data cache off, can't create %s\n", DERIVED_DATA_DIRECTORY);
+        return;
+    }
+    derived_data_cache.mutex = SDL_CreateMutex();
+    derived_data_cache.enabled = true;
+
+    FileContents index;
+    if(read_loose_file_contents(DERIVED_DATA_DIRECTORY "/index.bin", &index)) {
+        const DerivedDataIndexHeader* header = (const DerivedDataIndexHeader*)index.data;
+        if(index.size >= sizeof(*header) && header->magic == DERIVED_DATA_INDEX_MAGIC &&
+           header->entry_count <= MAX_DERIVED_DATA_ENTRIES &&
+           index.size == sizeof(*header) + header->entry_count * sizeof(DerivedDataEntry)) {
+            memcpy(derived_data_cache.entries, header + 1, header->entry_count * sizeof(DerivedDataEntry));
+            derived_data_cache.entry_count = header->entry_count;
+            derived_data_cache.tick = header->tick;
+            for(u32 i = 0; i < derived_data_cache.entry_count; ++i) {
+                derived_data_cache.total_size += derived_data_cache.entries[i].size;
+            }
+        }
+        free_file_contents(&index);
+    }
+    // The budget may have gone down since the last run
+    evict_derived_data(0);
+    log_debug_message("Derived data cache: %u entries, %.2f MB\n", derived_data_cache.entry_count,
+                      (f64)derived_data_cache.total_size / (1024.0 * 1024.0));
+#endif
+}
+
+// Returns false on a miss
+static b32
+load_derived_data(u64 key, DerivedData* derived) {
+    memset(derived, 0, sizeof(*derived));
+    if(!derived_data_cache.enabled) {
+        return false;
+    }
+
+    char path[256];
+    derived_data_path(key, path, sizeof(path));
+    FileContents file;
+    b32 hit = read_loose_file_contents(path, &file);
+    if(hit) {
+        const DerivedDataHeader* header = (const DerivedDataHeader*)file.data;
+        hit = file.size >= sizeof(*header) && header->magic == DERIVED_DATA_MAGIC && header->key == key &&
+              header->size == file.size - sizeof(*header);
+        if(!hit) {
+            log_error_message("Derived data %s is damaged\n", path);
+            free_file_contents(&file);
+        }
+    }
+
+    SDL_LockMutex(derived_data_cache.mutex);
+    if(hit) {
+        DerivedDataEntry* entry = find_derived_data_entry(key);
+        if(!entry) {
+            // Still a hit when the index is full, it just isn't tracked
+            entry = add_derived_data_entry(key);
+            if(entry) {
+                entry->size = file.size;
+                derived_data_cache.total_size += file.size;
+            }
+        }
+        if(entry) {
+            entry->last_used = ++derived_data_cache.tick;
+        }
+        ++derived_data_cache.stats.hits;
+        derived_data_cache.stats.bytes_loaded += file.size;
+    } else {
+        ++derived_data_cache.stats.misses;
+    }
+    SDL_UnlockMutex(derived_data_cache.mutex);
+
+    if(hit) {
+        derived->file = file;
+        derived->data = file.data + sizeof(DerivedDataHeader);
+        derived->size = file.size - sizeof(DerivedDataHeader);
+    }
+    return hit;
+}
+
+static void
+free_derived_data(DerivedData* derived) {
+    free_file_contents(&derived->file);
+    memset(derived, 0, sizeof(*derived));
+}
+
+static void
+store_derived_data(u64 key, const void* data, size_t size) {
+    if(!derived_data_cache.enabled) {
+        return;
+    }
+
+    SDL_LockMutex(derived_data_cache.mutex);
+    u32 temp_number = derived_data_cache.temp_counter++;
+    SDL_UnlockMutex(derived_data_cache.mutex);
+
+    char temp_path[256];
+    char path[256];
+    snprintf(temp_path, sizeof(temp_path), "%s/%016llx.%u.tmp", DERIVED_DATA_DIRECTORY,
+             (unsigned long long)key, temp_number);
+    derived_data_path(key, path, sizeof(path));
+
+    DerivedDataHeader header = {0};
+    header.magic = DERIVED_DATA_MAGIC;
+    header.key   = key;
+    header.size  = size;
+    FILE* file = fopen(temp_path, "wb");
+    b32 written = file && fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(data, 1, size, file) == size;
+    written = file && fclose(file) == 0 && written;
+    if(!written || !replace_file(temp_path, path)) {
+        log_error_message("Couldn't write derived data %s\n", path);
+        remove(temp_path);
+        return;
+    }
+
+    SDL_LockMutex(derived_data_cache.mutex);
+    u64 file_size = sizeof(header) + size;
+    DerivedDataEntry* entry = find_derived_data_entry(key);
+    if(entry) {
+        derived_data_cache.total_size -= entry->size;
+    } else {
+        entry = add_derived_data_entry(key);
+    }
+    if(!entry) {
+        // An untracked file would never be evicted
+        remove(path);
+        SDL_UnlockMutex(derived_data_cache.mutex);
+        log_error_message("Derived data cache index full, not keeping %s\n", path);
+        return;
+    }
+    entry->size      = file_size;
+    entry->last_used = ++derived_data_cache.tick;
+    derived_data_cache.total_size += file_size;
+    ++derived_data_cache.stats.stores;
+    derived_data_cache.stats.bytes_stored += file_size;
+    evict_derived_data(key);
+    SDL_UnlockMutex(derived_data_cache.mutex);
+}
+
+static DerivedDataStats
+get_derived_data_stats(void) {
+    SDL_LockMutex(derived_data_cache.mutex);
+    DerivedDataStats stats = derived_data_cache.stats;
+    SDL_UnlockMutex(derived_data_cache.mutex);
+    return stats;
+}
+
+// Writes the index. Nothing may load or store any more.
+static void
+shutdown_derived_data_cache(void) {
+    if(!derived_data_cache.enabled) {
+        return;
+    }
+    DerivedDataIndexHeader header = {0};
+    header.magic       = DERIVED_DATA_INDEX_MAGIC;
+    header.entry_count = derived_data_cache.entry_count;
+    header.tick        = derived_data_cache.tick;
+
+    const char* temp_path = DERIVED_DATA_DIRECTORY "/index.tmp";
+    FILE* file = fopen(temp_path, "wb");
+    b32 written = file && fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  fwrite(derived_data_cache.entries, sizeof(DerivedDataEntry), header.entry_count, file) ==
+                      header.entry_count;
+    written = file && fclose(file) == 0 && written;
+    if(!written || !replace_file(temp_path, DERIVED_DATA_DIRECTORY "/index.bin")) {
+        log_error_message("Couldn't write the derived data index\n");
+        remove(temp_path);
+    }
+    SDL_DestroyMutex(derived_data_cache.mutex);
+    memset(&derived_data_cache, 0, sizeof(derived_data_cache));
+}
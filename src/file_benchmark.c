@@ -0,0 +1,322 @@
+/*
+  File loading benchmark.
+
+  Loads every file on the command line over and over, four ways:
+    malloc+copy  what read_file_contents used to do, a fresh buffer the
+                 size of the file with the file read into it
+    read         read() into one buffer reused for every file, the
+                 cheapest a copying loader can get
+    mmap         map_file_contents from platform_files.c for every file,
+                 however small
+    platform     read_loose_file_contents from platform_files.c, which
+                 only maps files from FILE_MAP_MIN_SIZE up
+
+  Files on both sides of FILE_MAP_MIN_SIZE show where mapping starts to
+  beat reading.
+
+  Every byte is summed, so each method really touches the data, and a
+  pass over all files runs before the timing starts so the page cache is
+  warm for all three.
+
+    file_benchmark 50 data/textures/container.jpg data/textures/wall.jpg
+
+  With -startup it times what loading does at startup instead, reading
+  every file once from loose files and once through an archive made with
+  asset_packer.c, mount and unmount included. Cold runs drop the files and
+  the archive from the page cache before every iteration, warm runs leave
+  them there.
+
+    file_benchmark -startup data.pack 20 data/shaders/basic_vertex.glsl ...
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
+
+// For inflating archive entries
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#include "stb_image.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define array_count(x) ((sizeof(x) / sizeof(0 [x])) / ((size_t)(!(sizeof(x) % sizeof(0 [x])))))
+
+#define HANDMADE_MATH_IMPLEMENTATION
+#include "HandmadeMath.h"
+
+#include "types.c"
+#include "math.c"
+#include "hash.c"
+
+static void
+log_debug_message(const char* format, ...) {
+}
+
+static void
+log_error_message(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+#include "platform_files.c"
+#include "asset_archive.c"
+
+typedef u64 LoadFunction(const char* path, char** buffer, size_t* buffer_size);
+
+static inline u64
+sum_bytes(const char* data, size_t size) {
+    u64 sum = 0;
+    for(size_t i = 0; i < size; ++i) {
+        sum += (u8)data[i];
+    }
+    return sum;
+}
+
+static f64
+seconds_now(void) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (f64)now.tv_sec + (f64)now.tv_nsec * 1e-9;
+}
+
+static u64
+load_malloc_copy(const char* path, char** buffer, size_t* buffer_size) {
+    FILE* file = fopen(path, "rb");
+    if(!file) {
+        return 0;
+    }
+    fseek(file, 0, SEEK_END);
+    size_t size = (size_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char* contents = malloc(size);
+    u64 sum = 0;
+    if(fread(contents, 1, size, file) == size) {
+        sum = sum_bytes(contents, size);
+    }
+    free(contents);
+    fclose(file);
+    return sum;
+}
+
+static u64
+load_read(const char* path, char** buffer, size_t* buffer_size) {
+    FILE* file = fopen(path, "rb");
+    if(!file) {
+        return 0;
+    }
+    // Unbuffered, so every fread is a single read() into our buffer
+    setvbuf(file, 0, _IONBF, 0);
+
+    u64 sum = 0;
+    for(;;) {
+        size_t bytes_read = fread(*buffer, 1, *buffer_size, file);
+        sum += sum_bytes(*buffer, bytes_read);
+        if(bytes_read < *buffer_size) {
+            break;
+        }
+    }
+    fclose(file);
+    return sum;
+}
+
+static u64
+load_mapped(const char* path, char** buffer, size_t* buffer_size) {
+    FileContents file;
+    memset(&file, 0, sizeof(file));
+#ifdef _WIN32
+    HANDLE file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+                                     FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if(file_handle == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    LARGE_INTEGER file_size;
+    b32 mapped = GetFileSizeEx(file_handle, &file_size) && file_size.QuadPart > 0 &&
+                 map_file_contents(file_handle, (size_t)file_size.QuadPart, &file);
+    CloseHandle(file_handle);
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return 0;
+    }
+    struct stat file_stat;
+    b32 mapped = fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0 &&
+                 map_file_contents(fd, (size_t)file_stat.st_size, true, &file);
+    close(fd);
+#endif
+    if(!mapped) {
+        return 0;
+    }
+    u64 sum = sum_bytes(file.data, file.size);
+    free_file_contents(&file);
+    return sum;
+}
+
+static u64
+load_platform(const char* path, char** buffer, size_t* buffer_size) {
+    FileContents file;
+    if(!read_loose_file_contents(path, &file)) {
+        return 0;
+    }
+    u64 sum = sum_bytes(file.data, file.size);
+    free_file_contents(&file);
+    return sum;
+}
+
+// Drops the file's pages from the page cache, so the next read goes to
+// the disk
+static void
+evict_file_cache(const char* path) {
+#ifdef _WIN32
+    // Opening unbuffered throws away what the cache has of the file
+    HANDLE file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+                                     FILE_FLAG_NO_BUFFERING, 0);
+    if(file_handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(file_handle);
+    }
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+#endif
+}
+
+// Reads every file the way the game does at startup, returns the sum of
+// their bytes
+static u64
+load_startup_files(const char* archive_path, char** paths, u32 path_count) {
+    if(archive_path && !mount_asset_archive(archive_path)) {
+        return 0;
+    }
+    u64 sum = 0;
+    for(u32 i = 0; i < path_count; ++i) {
+        FileContents file;
+        if(read_file_contents(paths[i], &file)) {
+            sum += sum_bytes(file.data, file.size);
+            free_file_contents(&file);
+        }
+    }
+    if(archive_path) {
+        unmount_asset_archive();
+    }
+    return sum;
+}
+
+static i32
+startup_benchmark(const char* archive_path, u32 iterations, char** paths, u32 path_count) {
+    if(!mount_asset_archive(archive_path)) {
+        printf("Can't mount %s\n", archive_path);
+        return 1;
+    }
+    for(u32 i = 0; i < path_count; ++i) {
+        if(!find_archive_entry(paths[i])) {
+            printf("%s isn't in %s\n", paths[i], archive_path);
+            return 1;
+        }
+    }
+    unmount_asset_archive();
+
+    u64 expected_sum = load_startup_files(0, paths, path_count);
+    printf("%u files, %u iterations\n", path_count, iterations);
+
+    for(u32 cold = 0; cold < 2; ++cold) {
+        for(u32 packed = 0; packed < 2; ++packed) {
+            const char* archive = packed ? archive_path : 0;
+            f64 seconds = 0.0;
+            b32 sums_match = true;
+            for(u32 iteration = 0; iteration < iterations; ++iteration) {
+                if(cold) {
+                    evict_file_cache(archive_path);
+                    for(u32 i = 0; i < path_count; ++i) {
+                        evict_file_cache(paths[i]);
+                    }
+                }
+                f64 start = seconds_now();
+                u64 sum = load_startup_files(archive, paths, path_count);
+                seconds += seconds_now() - start;
+                sums_match = sums_match && sum == expected_sum;
+            }
+            printf("%s %-7s %8.3f ms per startup%s\n", cold ? "cold" : "warm", packed ? "archive" : "loose",
+                   seconds * 1e3 / iterations, sums_match ? "" : " (wrong sum)");
+        }
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv) {
+    if(argc >= 5 && strcmp(argv[1], "-startup") == 0) {
+        return startup_benchmark(argv[2], (u32)atoi(argv[3]), argv + 4, argc - 4);
+    }
+    if(argc < 3) {
+        printf("usage: %s iterations file...\n"
+               "       %s -startup archive iterations file...\n", argv[0], argv[0]);
+        return 1;
+    }
+    u32 iterations = (u32)atoi(argv[1]);
+    char** paths = argv + 2;
+    u32 path_count = argc - 2;
+
+    size_t buffer_size = 1024 * 1024;
+    char* buffer = malloc(buffer_size);
+
+    struct {
+        const char* name;
+        LoadFunction* load;
+    } methods[] = {
+        {"malloc+copy", load_malloc_copy},
+        {"read", load_read},
+        {"mmap", load_mapped},
+        {"platform", load_platform},
+    };
+
+    u64 total_bytes = 0;
+    u64 expected_sum = 0;
+    for(u32 i = 0; i < path_count; ++i) {
+        FileContents file;
+        if(!read_loose_file_contents(paths[i], &file)) {
+            printf("Can't read %s\n", paths[i]);
+            return 1;
+        }
+        total_bytes += file.size;
+        expected_sum += sum_bytes(file.data, file.size);
+        free_file_contents(&file);
+    }
+    printf("%u files, %.2f MB, %u iterations\n", path_count, (f64)total_bytes / (1024.0 * 1024.0), iterations);
+
+    for(u32 m = 0; m < array_count(methods); ++m) {
+        u64 sum = 0;
+        f64 start = seconds_now();
+        for(u32 iteration = 0; iteration < iterations; ++iteration) {
+            for(u32 i = 0; i < path_count; ++i) {
+                sum += methods[m].load(paths[i], &buffer, &buffer_size);
+            }
+        }
+        f64 seconds = seconds_now() - start;
+
+        f64 loads = (f64)iterations * path_count;
+        f64 megabytes = (f64)iterations * total_bytes / (1024.0 * 1024.0);
+        printf("%-12s %8.2f us per file %10.1f MB/s%s\n", methods[m].name, seconds * 1e6 / loads,
+               megabytes / seconds, sum == expected_sum * iterations ? "" : " (wrong sum)");
+    }
+
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,329 @@
+/*
+  Shadow copy of the GL binding and fixed function state.
+
+  Every bind and state change goes through these functions, which only call
+  into the driver when the value actually changes. Returns true when the
+  call was issued and false when it was elided.
+
+  Anything that binds behind our back makes the shadow drift. Flip
+  VALIDATE_GL_STATE on to cross-check the shadow against glGet* after every
+  elided call and once a frame. It stalls the pipeline, so keep it for
+  debugging.
+
+  GL_ELEMENT_ARRAY_BUFFER is vertex array state, so it is not shadowed here.
+*/
+
+#define VALIDATE_GL_STATE 0
+
+#define MAX_SHADOWED_TEXTURE_UNITS 16
+
+typedef struct {
+    u32 calls;
+    u32 calls_elided;
+} GLStateStats;
+
+typedef struct {
+    u32 program;
+    u32 program_pipeline;
+    u32 vertex_array;
+    u32 array_buffer;
+    u32 uniform_buffer;
+    u32 draw_indirect_buffer;
+    u32 pixel_unpack_buffer;
+
+    u32 active_texture_unit;
+    u32 textures_2d[MAX_SHADOWED_TEXTURE_UNITS];
+
+    b32 depth_test;
+    GLenum depth_func;
+
+    b32 blend;
+    GLenum blend_src;
+    GLenum blend_dst;
+
+    GLenum polygon_mode;
+
+    GLStateStats stats;
+} GLState;
+
+static void validate_gl_state(GLState* state, const char* where);
+
+// Matches the defaults of a freshly created context
+static void
+init_gl_state(GLState* state) {
+    memset(state, 0, sizeof(*state));
+    state->depth_func   = GL_LESS;
+    state->blend_src    = GL_ONE;
+    state->blend_dst    = GL_ZERO;
+    state->polygon_mode = GL_FILL;
+}
+
+static inline b32
+gl_state_changed(GLState* state, b32 changed, const char* where) {
+    if(changed) {
+        ++state->stats.calls;
+    } else {
+        ++state->stats.calls_elided;
+#if VALIDATE_GL_STATE
+        validate_gl_state(state, where);
+#endif
+    }
+    return changed;
+}
+
+static b32
+use_program(GLState* state, u32 program) {
+    if(!gl_state_changed(state, state->program != program, "use_program")) {
+        return false;
+    }
+    glUseProgram(program);
+    state->program = program;
+    return true;
+}
+
+// Only takes effect while no program is current, glUseProgram wins
+static b32
+bind_program_pipeline(GLState* state, u32 pipeline) {
+    if(!gl_state_changed(state, state->program_pipeline != pipeline, "bind_program_pipeline")) {
+        return false;
+    }
+    glBindProgramPipeline(pipeline);
+    state->program_pipeline = pipeline;
+    return true;
+}
+
+static b32
+bind_vertex_array(GLState* state, u32 vertex_array) {
+    if(!gl_state_changed(state, state->vertex_array != vertex_array, "bind_vertex_array")) {
+        return false;
+    }
+    glBindVertexArray(vertex_array);
+    state->vertex_array = vertex_array;
+    return true;
+}
+
+static u32*
+shadowed_buffer_binding(GLState* state, GLenum target) {
+    switch(target) {
+        case GL_ARRAY_BUFFER: return &state->array_buffer;
+        case GL_UNIFORM_BUFFER: return &state->uniform_buffer;
+        case GL_DRAW_INDIRECT_BUFFER: return &state->draw_indirect_buffer;
+        case GL_PIXEL_UNPACK_BUFFER: return &state->pixel_unpack_buffer;
+    }
+    return 0;
+}
+
+static b32
+bind_buffer(GLState* state, GLenum target, u32 buffer) {
+    u32* binding = shadowed_buffer_binding(state, target);
+    if(!binding) {
+        glBindBuffer(target, buffer);
+        return true;
+    }
+    if(!gl_state_changed(state, *binding != buffer, "bind_buffer")) {
+        return false;
+    }
+    glBindBuffer(target, buffer);
+    *binding = buffer;
+    return true;
+}
+
+// Indexed bindings are not shadowed, but binding one also replaces the
+// generic binding for the target. Same goes for bind_buffer_range.
+static void
+bind_buffer_base(GLState* state, GLenum target, u32 index, u32 buffer) {
+    glBindBufferBase(target, index, buffer);
+    ++state->stats.calls;
+    u32* binding = shadowed_buffer_binding(state, target);
+    if(binding) {
+        *binding = buffer;
+    }
+}
+
+static void
+bind_buffer_range(GLState* state, GLenum target, u32 index, u32 buffer, u32 offset, u32 size) {
+    glBindBufferRange(target, index, buffer, offset, size);
+    ++state->stats.calls;
+    u32* binding = shadowed_buffer_binding(state, target);
+    if(binding) {
+        *binding = buffer;
+    }
+}
+
+static b32
+bind_texture_2d(GLState* state, u32 unit, u32 texture) {
+    assert(unit < MAX_SHADOWED_TEXTURE_UNITS);
+    if(!gl_state_changed(state, state->textures_2d[unit] != texture, "bind_texture_2d")) {
+        return false;
+    }
+    if(state->active_texture_unit != unit) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        state->active_texture_unit = unit;
+        ++state->stats.calls;
+    }
+    glBindTexture(GL_TEXTURE_2D, texture);
+    state->textures_2d[unit] = texture;
+    return true;
+}
+
+static b32
+set_depth_test(GLState* state, b32 enabled) {
+    enabled = !!enabled;
+    if(!gl_state_changed(state, state->depth_test != enabled, "set_depth_test")) {
+        return false;
+    }
+    if(enabled) {
+        glEnable(GL_DEPTH_TEST);
+    } else {
+        glDisable(GL_DEPTH_TEST);
+    }
+    state->depth_test = enabled;
+    return true;
+}
+
+static b32
+set_depth_func(GLState* state, GLenum func) {
+    if(!gl_state_changed(state, state->depth_func != func, "set_depth_func")) {
+        return false;
+    }
+    glDepthFunc(func);
+    state->depth_func = func;
+    return true;
+}
+
+static b32
+set_blend(GLState* state, b32 enabled) {
+    enabled = !!enabled;
+    if(!gl_state_changed(state, state->blend != enabled, "set_blend")) {
+        return false;
+    }
+    if(enabled) {
+        glEnable(GL_BLEND);
+    } else {
+        glDisable(GL_BLEND);
+    }
+    state->blend = enabled;
+    return true;
+}
+
+static b32
+set_blend_func(GLState* state, GLenum src, GLenum dst) {
+    b32 changed = state->blend_src != src || state->blend_dst != dst;
+    if(!gl_state_changed(state, changed, "set_blend_func")) {
+        return false;
+    }
+    glBlendFunc(src, dst);
+    state->blend_src = src;
+    state->blend_dst = dst;
+    return true;
+}
+
+static b32
+set_polygon_mode(GLState* state, GLenum mode) {
+    if(!gl_state_changed(state, state->polygon_mode != mode, "set_polygon_mode")) {
+        return false;
+    }
+    glPolygonMode(GL_FRONT_AND_BACK, mode);
+    state->polygon_mode = mode;
+    return true;
+}
+
+// Deleting a bound object resets the binding to zero in GL,
+// so the shadow has to follow.
+static void
+delete_buffer(GLState* state, u32 buffer) {
+    glDeleteBuffers(1, &buffer);
+    if(state->array_buffer == buffer) {
+        state->array_buffer = 0;
+    }
+    if(state->uniform_buffer == buffer) {
+        state->uniform_buffer = 0;
+    }
+    if(state->draw_indirect_buffer == buffer) {
+        state->draw_indirect_buffer = 0;
+    }
+    if(state->pixel_unpack_buffer == buffer) {
+        state->pixel_unpack_buffer = 0;
+    }
+}
+
+static void
+delete_program_pipeline(GLState* state, u32 pipeline) {
+    glDeleteProgramPipelines(1, &pipeline);
+    if(state->program_pipeline == pipeline) {
+        state->program_pipeline = 0;
+    }
+}
+
+static void
+delete_vertex_array(GLState* state, u32 vertex_array) {
+    glDeleteVertexArrays(1, &vertex_array);
+    if(state->vertex_array == vertex_array) {
+        state->vertex_array = 0;
+    }
+}
+
+static void
+delete_texture(GLState* state, u32 texture) {
+    glDeleteTextures(1, &texture);
+    for(u32 unit = 0; unit < MAX_SHADOWED_TEXTURE_UNITS; ++unit) {
+        if(state->textures_2d[unit] == texture) {
+            state->textures_2d[unit] = 0;
+        }
+    }
+}
+
+static inline void
+check_gl_state_value(const char* where, const char* name, i32 shadow, i32 actual) {
+    if(shadow != actual) {
+        log_error_message("GL state drift (%s): %s is %d, shadow has %d\n", where, name, actual, shadow);
+    }
+}
+
+static void
+validate_gl_state(GLState* state, const char* where) {
+    i32 value;
+
+    glGetIntegerv(GL_CURRENT_PROGRAM, &value);
+    check_gl_state_value(where, "GL_CURRENT_PROGRAM", state->program, value);
+    if(GLEW_ARB_separate_shader_objects) {
+        glGetIntegerv(GL_PROGRAM_PIPELINE_BINDING, &value);
+        check_gl_state_value(where, "GL_PROGRAM_PIPELINE_BINDING", state->program_pipeline, value);
+    }
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &value);
+    check_gl_state_value(where, "GL_VERTEX_ARRAY_BINDING", state->vertex_array, value);
+    glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &value);
+    check_gl_state_value(where, "GL_ARRAY_BUFFER_BINDING", state->array_buffer, value);
+    glGetIntegerv(GL_UNIFORM_BUFFER_BINDING, &value);
+    check_gl_state_value(where, "GL_UNIFORM_BUFFER_BINDING", state->uniform_buffer, value);
+    if(GLEW_VERSION_4_0 || GLEW_ARB_draw_indirect) {
+        glGetIntegerv(GL_DRAW_INDIRECT_BUFFER_BINDING, &value);
+        check_gl_state_value(where, "GL_DRAW_INDIRECT_BUFFER_BINDING", state->draw_indirect_buffer, value);
+    }
+    glGetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &value);
+    check_gl_state_value(where, "GL_PIXEL_UNPACK_BUFFER_BINDING", state->pixel_unpack_buffer, value);
+
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &value);
+    check_gl_state_value(where, "GL_ACTIVE_TEXTURE", GL_TEXTURE0 + state->active_texture_unit, value);
+    for(u32 unit = 0; unit < MAX_SHADOWED_TEXTURE_UNITS; ++unit) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glGetIntegerv(GL_TEXTURE_BINDING_2D, &value);
+        check_gl_state_value(where, "GL_TEXTURE_BINDING_2D", state->textures_2d[unit], value);
+    }
+    glActiveTexture(GL_TEXTURE0 + state->active_texture_unit);
+
+    check_gl_state_value(where, "GL_DEPTH_TEST", state->depth_test, glIsEnabled(GL_DEPTH_TEST));
+    glGetIntegerv(GL_DEPTH_FUNC, &value);
+    check_gl_state_value(where, "GL_DEPTH_FUNC", state->depth_func, value);
+
+    check_gl_state_value(where, "GL_BLEND", state->blend, glIsEnabled(GL_BLEND));
+    glGetIntegerv(GL_BLEND_SRC_RGB, &value);
+    check_gl_state_value(where, "GL_BLEND_SRC_RGB", state->blend_src, value);
+    glGetIntegerv(GL_BLEND_DST_RGB, &value);
+    check_gl_state_value(where, "GL_BLEND_DST_RGB", state->blend_dst, value);
+
+    // Some drivers return front and back separately
+    i32 polygon_mode[2];
+    glGetIntegerv(GL_POLYGON_MODE, polygon_mode);
+    check_gl_state_value(where, "GL_POLYGON_MODE", state->polygon_mode, polygon_mode[0]);
+}
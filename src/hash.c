@@ -0,0 +1,44 @@
+// FNV-1a, good enough for names and file contents. Not meant to be secure.
+
+static inline u32
+hash_bytes_32(const void* data, size_t size) {
+    const u8* bytes = (const u8*)data;
+    u32 hash = 2166136261u;
+    for(size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Continues a 64-bit hash with more bytes, for keys made of several parts
+static inline u64
+hash_combine_64(u64 hash, const void* data, size_t size) {
+    const u8* bytes = (const u8*)data;
+    for(size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static inline u64
+hash_bytes_64(const void* data, size_t size) {
+    return hash_combine_64(14695981039346656037ull, data, size);
+}
+
+static inline u32
+hash_string_32(const char* string) {
+    return hash_bytes_32(string, strlen(string));
+}
+
+static inline u32
+hash_u32(u32 value) {
+    // Finalizer from MurmurHash3, spreads small handles over the whole range
+    value ^= value >> 16;
+    value *= 0x85ebca6b;
+    value ^= value >> 13;
+    value *= 0xc2b2ae35;
+    value ^= value >> 16;
+    return value;
+}
@@ -0,0 +1,383 @@
+/*
+  Hot reload.
+
+  A watcher thread listens for files under data/ being written, with
+  inotify on Linux and ReadDirectoryChangesW on Windows, and notes when it
+  first and last heard about each path. take_hot_reload_change hands the
+  main loop a path once nothing has happened to it for
+  HOT_RELOAD_DEBOUNCE_MS, so an editor saving in several writes, or
+  through a temporary file and a rename, makes one reload and not a burst
+  of them reading half written files.
+
+  What gets reloaded is up to the caller. Shaders go through
+  update_shader_source_file and reload_shader_template, textures are read
+  again through the async reads, and both swap at the top of a frame. The
+  time the first event came in is kept with the change, so the reload can
+  log how long it took from the save to the swap.
+
+  The archive doesn't change under us, so there's nothing to watch when
+  files are read from one, see asset_archive.c.
+*/
+
+#define MAX_HOT_RELOAD_CHANGES 64
+#define MAX_HOT_RELOAD_WATCHES 64
+#define MAX_HOT_RELOAD_PATH_LENGTH 256
+#define HOT_RELOAD_DEBOUNCE_MS 20
+
+typedef struct {
+    char path[MAX_HOT_RELOAD_PATH_LENGTH];
+    // When the first and the latest event for the path came in
+    u64 first_counter;
+    u64 last_counter;
+} HotReloadChange;
+
+typedef struct {
+    int wd;
+    char path[MAX_HOT_RELOAD_PATH_LENGTH];
+} HotReloadWatch;
+
+typedef struct {
+    b32 running;
+    SDL_Thread* thread;
+
+    // Guards the changes, everything else belongs to the watcher thread
+    SDL_mutex* mutex;
+    u32 change_count;
+    HotReloadChange changes[MAX_HOT_RELOAD_CHANGES];
+
+#if defined(__linux__)
+    int inotify_fd;
+    int wake_fd;
+    u32 watch_count;
+    HotReloadWatch watches[MAX_HOT_RELOAD_WATCHES];
+#elif defined(_WIN32)
+    HANDLE directory;
+    HANDLE stop_event;
+    char root[MAX_HOT_RELOAD_PATH_LENGTH];
+#endif
+} HotReload;
+
+static HotReload hot_reload;
+
+// Called from the watcher thread
+static void
+record_hot_reload_change(const char* path, u64 counter) {
+    SDL_LockMutex(hot_reload.mutex);
+    HotReloadChange* change = 0;
+    for(u32 i = 0; i < hot_reload.change_count && !change; ++i) {
+        if(strcmp(hot_reload.changes[i].path, path) == 0) {
+            change = &hot_reload.changes[i];
+        }
+    }
+    if(!change && hot_reload.change_count < MAX_HOT_RELOAD_CHANGES) {
+        change = &hot_reload.changes[hot_reload.change_count++];
+        strncpy(change->path, path, MAX_HOT_RELOAD_PATH_LENGTH - 1);
+        change->path[MAX_HOT_RELOAD_PATH_LENGTH - 1] = 0;
+        change->first_counter = counter;
+    }
+    if(change) {
+        change->last_counter = counter;
+    } else {
+        log_error_message("Too many changed files, %s isn't reloaded\n", path);
+    }
+    SDL_UnlockMutex(hot_reload.mutex);
+}
+
+// Puts directory/name in path, a path that doesn't fit would be watched or
+// reloaded under the wrong name so it's left out instead
+static b32
+join_hot_reload_path(char* path, const char* directory, const char* name) {
+    i32 length = snprintf(path, MAX_HOT_RELOAD_PATH_LENGTH, "%s/%s", directory, name);
+    if(length < 0 || length >= MAX_HOT_RELOAD_PATH_LENGTH) {
+        log_error_message("Path too long to watch, %s/%s isn't\n", directory, name);
+        return false;
+    }
+    return true;
+}
+
+#if defined(__linux__)
+
+// Watches the directory and every directory under it. For a directory
+// that was just created, created_counter is when, and files already in it
+// count as changed, they may have been written before the watch was there.
+static void
+add_hot_reload_watch(const char* path, u64 created_counter) {
+    if(hot_reload.watch_count == MAX_HOT_RELOAD_WATCHES) {
+        log_error_message("Too many directories to watch, %s isn't\n", path);
+        return;
+    }
+    int wd = inotify_add_watch(hot_reload.inotify_fd, path,
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+    if(wd < 0) {
+        log_error_message("Can't watch %s\n", path);
+        return;
+    }
+    HotReloadWatch* watch = &hot_reload.watches[hot_reload.watch_count++];
+    watch->wd = wd;
+    strncpy(watch->path, path, MAX_HOT_RELOAD_PATH_LENGTH - 1);
+
+    DIR* directory = opendir(path);
+    if(!directory) {
+        return;
+    }
+    struct dirent* entry;
+    while((entry = readdir(directory))) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char child[MAX_HOT_RELOAD_PATH_LENGTH];
+        struct stat child_stat;
+        if(!join_hot_reload_path(child, path, entry->d_name) || stat(child, &child_stat) != 0) {
+            continue;
+        }
+        if(S_ISDIR(child_stat.st_mode)) {
+            add_hot_reload_watch(child, created_counter);
+        } else if(created_counter) {
+            record_hot_reload_change(child, created_counter);
+        }
+    }
+    closedir(directory);
+}
+
+static const char*
+hot_reload_watch_path(int wd) {
+    for(u32 i = 0; i < hot_reload.watch_count; ++i) {
+        if(hot_reload.watches[i].wd == wd) {
+            return hot_reload.watches[i].path;
+        }
+    }
+    return 0;
+}
+
+static int
+hot_reload_thread(void* data) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for(;;) {
+        struct pollfd fds[2] = {
+            {.fd = hot_reload.inotify_fd, .events = POLLIN},
+            {.fd = hot_reload.wake_fd, .events = POLLIN},
+        };
+        if(poll(fds, array_count(fds), -1) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            log_error_message("Hot reload stopped, poll failed\n");
+            break;
+        }
+        if(fds[1].revents) {
+            break;
+        }
+
+        ssize_t length = read(hot_reload.inotify_fd, buffer, sizeof(buffer));
+        if(length <= 0) {
+            continue;
+        }
+        u64 counter = SDL_GetPerformanceCounter();
+        const struct inotify_event* event;
+        for(char* at = buffer; at < buffer + length; at += sizeof(*event) + event->len) {
+            event = (const struct inotify_event*)at;
+            if(event->mask & IN_Q_OVERFLOW) {
+                log_error_message("Hot reload missed some changes\n");
+            }
+            const char* directory = hot_reload_watch_path(event->wd);
+            if(!directory || !event->len) {
+                continue;
+            }
+            char path[MAX_HOT_RELOAD_PATH_LENGTH];
+            if(!join_hot_reload_path(path, directory, event->name)) {
+                continue;
+            }
+            if(event->mask & IN_ISDIR) {
+                add_hot_reload_watch(path, counter);
+            } else if(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                record_hot_reload_change(path, counter);
+            }
+        }
+    }
+    return 0;
+}
+
+static b32
+start_hot_reload_watcher(const char* root) {
+    hot_reload.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    hot_reload.wake_fd = eventfd(0, EFD_CLOEXEC);
+    if(hot_reload.inotify_fd < 0 || hot_reload.wake_fd < 0) {
+        return false;
+    }
+    add_hot_reload_watch(root, 0);
+    return hot_reload.watch_count > 0;
+}
+
+static void
+stop_hot_reload_watcher(void) {
+    if(hot_reload.thread) {
+        u64 one = 1;
+        if(write(hot_reload.wake_fd, &one, sizeof(one)) < 0) {
+            log_error_message("Couldn't stop the hot reload thread\n");
+        }
+        SDL_WaitThread(hot_reload.thread, 0);
+    }
+    if(hot_reload.inotify_fd >= 0) {
+        close(hot_reload.inotify_fd);
+    }
+    if(hot_reload.wake_fd >= 0) {
+        close(hot_reload.wake_fd);
+    }
+}
+
+#elif defined(_WIN32)
+
+static int
+hot_reload_thread(void* data) {
+    // FILE_NOTIFY_INFORMATION has to be DWORD aligned
+    DWORD buffer[4096];
+    OVERLAPPED overlapped = {0};
+    overlapped.hEvent = CreateEventA(0, TRUE, FALSE, 0);
+    for(;;) {
+        ResetEvent(overlapped.hEvent);
+        if(!ReadDirectoryChangesW(hot_reload.directory, buffer, sizeof(buffer), TRUE,
+                                  FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME, 0, &overlapped, 0)) {
+            log_error_message("Hot reload stopped, can't watch %s\n", hot_reload.root);
+            break;
+        }
+        HANDLE events[2] = {overlapped.hEvent, hot_reload.stop_event};
+        DWORD bytes = 0;
+        if(WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0) {
+            CancelIo(hot_reload.directory);
+            GetOverlappedResult(hot_reload.directory, &overlapped, &bytes, TRUE);
+            break;
+        }
+        if(!GetOverlappedResult(hot_reload.directory, &overlapped, &bytes, FALSE) || !bytes) {
+            // Nothing, or more than fit in the buffer
+            continue;
+        }
+
+        u64 counter = SDL_GetPerformanceCounter();
+        const u8* at = (const u8*)buffer;
+        for(;;) {
+            const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*)at;
+            if(info->Action == FILE_ACTION_MODIFIED || info->Action == FILE_ACTION_ADDED ||
+               info->Action == FILE_ACTION_RENAMED_NEW_NAME) {
+                char name[MAX_HOT_RELOAD_PATH_LENGTH];
+                i32 length = WideCharToMultiByte(CP_UTF8, 0, info->FileName, info->FileNameLength / sizeof(WCHAR),
+                                                 name, sizeof(name) - 1, 0, 0);
+                name[length] = 0;
+                // Paths are asked for with forward slashes
+                for(char* c = name; *c; ++c) {
+                    if(*c == '\\') {
+                        *c = '/';
+                    }
+                }
+                char path[MAX_HOT_RELOAD_PATH_LENGTH];
+                if(join_hot_reload_path(path, hot_reload.root, name)) {
+                    record_hot_reload_change(path, counter);
+                }
+            }
+            if(!info->NextEntryOffset) {
+                break;
+            }
+            at += info->NextEntryOffset;
+        }
+    }
+    CloseHandle(overlapped.hEvent);
+    return 0;
+}
+
+static b32
+start_hot_reload_watcher(const char* root) {
+    strncpy(hot_reload.root, root, MAX_HOT_RELOAD_PATH_LENGTH - 1);
+    hot_reload.directory = CreateFileA(root, FILE_LIST_DIRECTORY,
+                                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+                                       OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, 0);
+    hot_reload.stop_event = CreateEventA(0, TRUE, FALSE, 0);
+    return hot_reload.directory != INVALID_HANDLE_VALUE && hot_reload.stop_event;
+}
+
+static void
+stop_hot_reload_watcher(void) {
+    if(hot_reload.thread) {
+        SetEvent(hot_reload.stop_event);
+        SDL_WaitThread(hot_reload.thread, 0);
+    }
+    if(hot_reload.directory != INVALID_HANDLE_VALUE) {
+        CloseHandle(hot_reload.directory);
+    }
+    if(hot_reload.stop_event) {
+        CloseHandle(hot_reload.stop_event);
+    }
+}
+
+#else
+
+static int
+hot_reload_thread(void* data) {
+    return 0;
+}
+
+static b32
+start_hot_reload_watcher(const char* root) {
+    return false;
+}
+
+static void
+stop_hot_reload_watcher(void) {
+}
+
+#endif
+
+// Starts watching everything under root. Returns false if this platform or
+// this root can't be watched, which only means nothing gets reloaded.
+static b32
+init_hot_reload(const char* root) {
+    memset(&hot_reload, 0, sizeof(hot_reload));
+#if defined(__linux__)
+    hot_reload.inotify_fd = -1;
+    hot_reload.wake_fd = -1;
+#elif defined(_WIN32)
+    hot_reload.directory = INVALID_HANDLE_VALUE;
+#endif
+    hot_reload.mutex = SDL_CreateMutex();
+    if(!start_hot_reload_watcher(root)) {
+        log_debug_message("Hot reload off, can't watch %s\n", root);
+        stop_hot_reload_watcher();
+        SDL_DestroyMutex(hot_reload.mutex);
+        hot_reload.mutex = 0;
+        return false;
+    }
+    hot_reload.running = true;
+    hot_reload.thread = SDL_CreateThread(hot_reload_thread, "hot reload", 0);
+    log_debug_message("Hot reload watching %s\n", root);
+    return true;
+}
+
+// Takes the next change that has settled. Call it until it returns false
+// once a frame.
+static b32
+take_hot_reload_change(HotReloadChange* change) {
+    if(!hot_reload.running) {
+        return false;
+    }
+    b32 result = false;
+    u64 now = SDL_GetPerformanceCounter();
+    u64 debounce = HOT_RELOAD_DEBOUNCE_MS * SDL_GetPerformanceFrequency() / 1000;
+    SDL_LockMutex(hot_reload.mutex);
+    for(u32 i = 0; i < hot_reload.change_count && !result; ++i) {
+        if(now - hot_reload.changes[i].last_counter >= debounce) {
+            *change = hot_reload.changes[i];
+            hot_reload.changes[i] = hot_reload.changes[--hot_reload.change_count];
+            result = true;
+        }
+    }
+    SDL_UnlockMutex(hot_reload.mutex);
+    return result;
+}
+
+static void
+shutdown_hot_reload(void) {
+    if(!hot_reload.running) {
+        return;
+    }
+    stop_hot_reload_watcher();
+    SDL_DestroyMutex(hot_reload.mutex);
+    memset(&hot_reload, 0, sizeof(hot_reload));
+}
@@ -3,6 +3,8 @@
 #include <time.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wmacro-redefined"
@@ -13,8 +15,30 @@
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#include "stb_image_resize.h"
+#define STB_RECT_PACK_IMPLEMENTATION
+#include "stb_rect_pack.h"
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
 
 #define array_count(x) ((sizeof(x) / sizeof(0 [x])) / ((size_t)(!(sizeof(x) % sizeof(0 [x])))))
 
@@ -23,18 +47,12 @@
 
 #include "types.c"
 #include "math.c"
+#include "hash.c"
 
 #include "objects.h"
 
 #include <assert.h>
 
-typedef struct {
-    SDL_Window* window;
-    SDL_GLContext gl_context;
-    u32 width;
-    u32 height;
-} RenderContext;
-
 //TODO: Figure out how I want to do logging.
 // Not too sure about this current style of logging.
 
@@ -47,7 +65,7 @@ log_debug_message(const char* format, ...) {
     char buffer[buffer_size];
     va_list args;
     va_start(args, format);
-    vsprintf_s(buffer, buffer_size, format, args);
+    vsnprintf(buffer, buffer_size, format, args);
     SDL_Log(buffer);
     va_end(args);
 #endif
@@ -58,193 +76,55 @@ log_error_message(const char* format, ...) {
     char buffer[buffer_size];
     va_list args;
     va_start(args, format);
-    vsprintf_s(buffer, buffer_size, format, args);
+    vsnprintf(buffer, buffer_size, format, args);
     SDL_Log(buffer);
     va_end(args);
 }
 #undef buffer_size
 
-static u32
-compile_shader(const char* vertex_shader_code, const char* fragment_shader_code) {
-    u32 vertex_shader_id   = glCreateShader(GL_VERTEX_SHADER);
-    u32 fragment_shader_id = glCreateShader(GL_FRAGMENT_SHADER);
-
-    i32 result = 0;
-    i32 info_log_length;
-
-    // Compile Vertex Shader
-    glShaderSource(vertex_shader_id, 1, &vertex_shader_code, NULL);
-    glCompileShader(vertex_shader_id);
-
-    // Check Vertex Shader
-    glGetShaderiv(vertex_shader_id, GL_COMPILE_STATUS, &result);
-    glGetShaderiv(vertex_shader_id, GL_INFO_LOG_LENGTH, &info_log_length);
-    if(info_log_length > 0) {
-        char error_message_buffer[info_log_length];
-        glGetShaderInfoLog(vertex_shader_id, info_log_length, NULL, error_message_buffer);
-        log_error_message("%s\n", error_message_buffer);
-    }
-
-    // Compile Fragment Shader
-    glShaderSource(fragment_shader_id, 1, &fragment_shader_code, NULL);
-    glCompileShader(fragment_shader_id);
-
-    // Check Fragment Shader
-    glGetShaderiv(fragment_shader_id, GL_COMPILE_STATUS, &result);
-    glGetShaderiv(fragment_shader_id, GL_INFO_LOG_LENGTH, &info_log_length);
-    if(info_log_length > 0) {
-        char error_message_buffer[info_log_length];
-        glGetShaderInfoLog(fragment_shader_id, info_log_length, NULL, error_message_buffer);
-        log_error_message("%s\n", error_message_buffer);
-    }
-
-    // Link the program
-    u32 program_id = glCreateProgram();
-    glAttachShader(program_id, vertex_shader_id);
-    glAttachShader(program_id, fragment_shader_id);
-    glLinkProgram(program_id);
-
-    // Check the program
-    glGetProgramiv(program_id, GL_LINK_STATUS, &result);
-    glGetProgramiv(program_id, GL_INFO_LOG_LENGTH, &info_log_length);
-    if(info_log_length > 0) {
-        char error_message_buffer[info_log_length];
-        glGetProgramInfoLog(program_id, info_log_length, NULL, error_message_buffer);
-        log_error_message("%s\n", error_message_buffer);
-    }
-
-    glDetachShader(program_id, vertex_shader_id);
-    glDetachShader(program_id, fragment_shader_id);
-
-    glDeleteShader(vertex_shader_id);
-    glDeleteShader(fragment_shader_id);
-
-    return program_id;
-}
-
-static u32
-read_file_contents(const char* filename, char** file_contents) {
-    u32 number_of_bytes_read = 0;
-    HANDLE file_handle = CreateFileA(filename,
-                                     GENERIC_READ,
-                                     0, 0,
-                                     OPEN_EXISTING,
-                                     FILE_ATTRIBUTE_NORMAL,
-                                     0);
-
-    if(file_handle == INVALID_HANDLE_VALUE) {
-        return 0;
-    }
-
-    LARGE_INTEGER large_integer;
-    if(!GetFileSizeEx(file_handle, &large_integer)) {
-        return 0;
-    }
-
-    u32 number_of_bytes = (u32)large_integer.QuadPart;
-
-    char* buffer = malloc(number_of_bytes);
-    if(!ReadFile(file_handle, buffer, number_of_bytes, (LPDWORD)&number_of_bytes_read, 0)) {
-        return 0;
-    }
-
-    *file_contents = buffer;
-
-    CloseHandle(file_handle);
-
-    return number_of_bytes;
-}
-
-static inline void
-free_file_contents(char* file_contents) {
-    free(file_contents);
-}
-
-static u32
-load_and_compile_shader(const char* vertex_shader_path, const char* fragment_shader_path) {
-    u32 program = 0;
-
-    char* vertex_shader_source;
-    char* fragment_shader_source;
-    if(!read_file_contents(vertex_shader_path, &vertex_shader_source)) {
-        return 0;
-    }
-    if(!read_file_contents(fragment_shader_path, &fragment_shader_source)) {
-        return 0;
-    }
-
-    program = compile_shader(vertex_shader_source, fragment_shader_source);
-
-    free_file_contents(vertex_shader_source);
-    free_file_contents(fragment_shader_source);
-
-    return program;
-}
-
-static u32
-load_texture(const char* filename, b32 flip_vertically_on_load, GLint internal_format, GLenum format) {
-    u32 texture;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    i32 width, height, nr_channels;
-    stbi_set_flip_vertically_on_load(flip_vertically_on_load);
-    u8* data = stbi_load(filename, &width, &height, &nr_channels, 0);
-    if(data) {
-        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    } else {
-        log_error_message("Failed to load texture\n");
-        return 0;
-    }
-    stbi_image_free(data);
-    return texture;
-}
-
-static inline u32
-load_texture_rgb(const char* filename, b32 flip_vertically_on_load) {
-    u32 texture = load_texture(filename, flip_vertically_on_load, GL_RGB, GL_RGB);
-    return texture;
-}
+#include "platform_files.c"
+#include "asset_archive.c"
+#include "derived_data_cache.c"
+#include "async_io.c"
+#include "hot_reload.c"
 
-static inline u32
-load_texture_rgba(const char* filename, b32 flip_vertically_on_load) {
-    u32 texture = load_texture(filename, flip_vertically_on_load, GL_RGBA, GL_RGBA);
-    return texture;
-}
+#include "gl_state.c"
+#include "ring_buffer.c"
 
-static inline void
-set_uniform_mat4(const char* name, Mat4 matrix) {
-    i32 shader;
-    glGetIntegerv(GL_CURRENT_PROGRAM, &shader);
+typedef struct {
+    SDL_Window* window;
+    SDL_GLContext gl_context;
+    u32 width;
+    u32 height;
 
-    u32 handle = glGetUniformLocation(shader, name);
-    glUniformMatrix4fv(handle, 1, GL_FALSE, &matrix.Elements[0][0]);
-}
+    // All binds and state changes go through this, see gl_state.c
+    GLState gl_state;
 
-static inline void
-set_uniform_3f(const char* name, f32 f1, f32 f2, f32 f3) {
-    i32 shader;
-    glGetIntegerv(GL_CURRENT_PROGRAM, &shader);
+    // Per-frame dynamic data, see ring_buffer.c
+    RingBuffer stream_buffer;
+    u32 uniform_buffer_alignment;
 
-    u32 handle = glGetUniformLocation(shader, name);
-    glUniform3f(handle, f1, f2, f3);
-}
+    u32 draw_calls;
+} RenderContext;
 
-static inline void
-set_uniform_vec3(const char* name, Vec3 v) {
-    set_uniform_3f(name, v.x, v.y, v.z);
-}
+#include "uniforms.c"
+#include "shader_cache.c"
+#include "shader_preprocessor.c"
+#include "program_binary_cache.c"
+#include "program_pipelines.c"
+#include "async_shaders.c"
+#include "shader_permutations.c"
+#include "render_commands.c"
+#include "mesh_builder.c"
+#include "vertex_layout.c"
+#include "mesh_pool.c"
+#include "mip_chain.c"
+#include "cooked_texture.c"
+#include "texture_uploads.c"
+#include "texture_residency.c"
+#include "texture_atlas.c"
+#include "textures.c"
 
-static inline void
-set_unfirorm_1i(const char* name, i32 val) {
-    i32 shader;
-    glGetIntegerv(GL_CURRENT_PROGRAM, &shader);
-    glUniform1i(glGetUniformLocation(shader, name), val);
-}
 
 static inline void
 resize_view(RenderContext* render_context, u32 width, u32 height) {
@@ -254,13 +134,15 @@ resize_view(RenderContext* render_context, u32 width, u32 height) {
 }
 
 i32
-main() {
+main(i32 argc, char** argv) {
     // Init SDL stuff
     if(SDL_Init(SDL_INIT_VIDEO) < 0) {
         log_error_message("SDL_Error: %s\n", SDL_GetError());
         return -1;
     }
     atexit(SDL_Quit);
+    // Launch time runs from here to the first frame with everything loaded
+    u64 launch_start = SDL_GetPerformanceCounter();
 
     RenderContext render_context;
     render_context.width = 512;
@@ -300,33 +182,94 @@ main() {
     glewInit();
 #endif
 
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LESS);
+    GLState* gl_state = &render_context.gl_state;
+    init_gl_state(gl_state);
 
-    // Load shaders
-    u32 basic_shader = load_and_compile_shader("data\\shaders\\basic_vertex.glsl",
-                                               "data\\shaders\\basic_fragment.glsl");
-    u32 light_shader = load_and_compile_shader("data\\shaders\\basic_vertex.glsl",
-                                               "data\\shaders\\light_fragment.glsl");
-    if(!basic_shader ||
-       !light_shader) {
-        log_error_message("Error loading shaders.\n");
+    set_depth_test(gl_state, true);
+    set_depth_func(gl_state, GL_LESS);
+
+    i32 uniform_buffer_alignment;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniform_buffer_alignment);
+    render_context.uniform_buffer_alignment = uniform_buffer_alignment;
+
+    // Packed assets are read from the archive when there is one, loose
+    // files otherwise
+    if(!mount_asset_archive("data.pack")) {
+        log_debug_message("No asset archive, reading loose files\n");
+    }
+    // Decoded textures and preprocessed shaders from earlier launches
+    init_derived_data_cache();
+
+    // Load shaders. They finish in the background, meshes draw with the
+    // fallback program until theirs is ready.
+    init_program_binary_cache();
+    init_program_pipelines();
+    if(!init_async_shaders(gl_state)) {
+        log_error_message("Error building the fallback shader.\n");
         return -1;
     }
-
-//Load textures
-#define USE_TEXTURES 0
-#if USE_TEXTURES
-    u32 texture0 = load_texture_rgb("data/textures/container.jpg", true);
-    u32 texture1 = load_texture_rgba("data/textures/awesomeface.png", true);
-    if(!texture0 ||
-       !texture1) {
-        debugLog("Error loading textures.\n");
+    // Fixed for the whole run, baked into the shaders
+    Vec3 light_color = vec3(1.0f, 1.0f, 1.0f);
+    set_shader_constant_vec3("LIGHT_COLOR", light_color);
+
+    u64 shader_load_start = SDL_GetPerformanceCounter();
+    ShaderTemplate basic_template;
+    ShaderTemplate light_template;
+    if(!load_shader_template(&basic_template, "data/shaders/basic_vertex.glsl",
+                             "data/shaders/basic_fragment.glsl") ||
+       !load_shader_template(&light_template, "data/shaders/basic_vertex.glsl",
+                             "data/shaders/light_fragment.glsl")) {
+        log_error_message("Error loading shaders.\n");
         return -1;
     }
-#endif
+    u32 textured_feature = shader_keyword(&basic_template, "TEXTURED");
+    ShaderHandle basic_shader = get_shader_permutation(&basic_template, 0);
+    ShaderHandle light_shader = get_shader_permutation(&light_template, 0);
+    log_debug_message("Shaders submitted in %.2f ms, %u programs and %u stage programs from the program "
+                      "binary cache\n",
+                      elapsed_ms(shader_load_start), program_binary_cache.stats.hits,
+                      program_binary_cache.stage_stats.hits);
+
+    init_async_io();
+
+    // Edited shaders and textures are picked up while running, unless
+    // everything comes from the archive
+    if(!asset_archive.header) {
+        init_hot_reload("data");
+    }
 
-    Vec3 cube_positions[] = {
+    // Textures are read and decoded in the background, cubes can be
+    // switched to the TEXTURED permutation once they're all there
+    const char* cube_texture_paths[] = {
+        "data/textures/container.jpg",
+        "data/textures/wall.jpg",
+        "data/textures/awesomeface.png",
+    };
+    // Cubes alternate between these, the textures of each by index above
+    u32 cube_materials[][MAX_PACKET_TEXTURES] = {
+        {0, 2},
+        {1, 2},
+    };
+    TextureBinding cube_textures[array_count(cube_materials)][MAX_PACKET_TEXTURES];
+    // Decoded textures share atlas pages, so both materials bind the same
+    // page and the cubes still draw as one. Turn it off to compare binds.
+    TextureAtlas texture_atlas;
+    init_texture_atlas(&texture_atlas);
+    TextureAtlas* cube_atlas = USE_TEXTURE_ATLAS ? &texture_atlas : 0;
+    // The workers copy decoded pixels straight into the upload buffer
+    init_texture_uploads(gl_state);
+    Texture cube_texture_loads[array_count(cube_texture_paths)];
+    for(u32 i = 0; i < array_count(cube_texture_paths); ++i) {
+        load_texture(&cube_texture_loads[i], cube_texture_paths[i], cube_atlas != 0);
+    }
+    u64 frame_texture_binds = 0;
+    u64 frame_draw_calls = 0;
+    u64 frames_drawn = 0;
+    b32 textures_loaded = false;
+    b32 launch_logged = false;
+    u32 cube_features = 0;
+
+    Vec3 initial_cube_positions[] = {
         vec3( 0.0f,  0.0f,  0.0f),
         vec3( 2.0f,  5.0f, -15.0f),
         vec3(-1.5f, -2.2f, -2.5f),
@@ -338,7 +281,7 @@ main() {
         vec3( 1.5f,  0.2f, -1.5f),
         vec3(-1.3f,  1.0f, -1.5f),
     };
-    Rotation cube_rotations[] = {
+    Rotation initial_cube_rotations[] = {
         { .axis = vec3(0, 1, 0), .angle = 30 },
         { .axis = vec3(1, 1, 1), .angle = 24 },
         { .axis = vec3(0, 1, 1), .angle = 30 },
@@ -351,82 +294,119 @@ main() {
         { .axis = vec3(1, 0, 1), .angle = 10 },
     };
 
-    i32 cube_count = array_count(cube_positions);
-    Mesh cube_mesh_array[array_count(cube_positions)];
-
-    u32 cube_vertex_array;
-    glGenVertexArrays(1, &cube_vertex_array);
-
-    u32 cube_vertex_buffer;
-    glGenBuffers(1, &cube_vertex_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, cube_vertex_buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(cube_vertex_positions), cube_vertex_positions, GL_STATIC_DRAW);
-
-    u32 cube_normal_buffer;
-    glGenBuffers(1, &cube_normal_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, cube_normal_buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(cube_normals), cube_normals, GL_STATIC_DRAW);
-
-    // u32 cube_color_buffer;
-    // glGenBuffers(1, &cube_color_buffer);
-    // u32 cubeTexCoordBuffer;
-    // glGenBuffers(1, &cubeTexCoordBuffer);
-
-    //Make cube vertex array
-    glBindVertexArray(cube_vertex_array);
-
-    glBindBuffer(GL_ARRAY_BUFFER, cube_vertex_buffer);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
-
-    glBindBuffer(GL_ARRAY_BUFFER, cube_normal_buffer);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(1);
-
-    // glBindBuffer(GL_ARRAY_BUFFER, cube_color_buffer);
-    // glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    // glBufferData(GL_ARRAY_BUFFER, sizeof(cubeVertexColors), cubeVertexColors, GL_STATIC_DRAW);
-    // glEnableVertexAttribArray(1);
+    // The cube count can be given on the command line, cubes past the
+    // hand placed ones get scattered around in front of the camera.
+    i32 cube_count = array_count(initial_cube_positions);
+    if(argc > 1) {
+        cube_count = max(atoi(argv[1]), 1);
+    }
+    // Then the texture memory budget in MB, textures stream their finer
+    // levels in and out to stay under it
+    u64 texture_memory_budget = DEFAULT_TEXTURE_MEMORY_BUDGET;
+    if(argc > 2) {
+        texture_memory_budget = (u64)max(atoi(argv[2]), 1) * 1024 * 1024;
+    }
+    init_texture_residency(texture_memory_budget);
 
-    // glBindBuffer(GL_ARRAY_BUFFER, cubeTexCoordBuffer);
-    // glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, 0);
-    // glBufferData(GL_ARRAY_BUFFER, sizeof(cubeTexCoords), cubeTexCoords, GL_STATIC_DRAW);
-    // glEnableVertexAttribArray(2);
+    Vec3* cube_positions     = malloc(cube_count * sizeof(Vec3));
+    Rotation* cube_rotations = malloc(cube_count * sizeof(Rotation));
+    Mesh* cube_mesh_array    = malloc(cube_count * sizeof(Mesh));
 
-    //Make light vertex array
-    u32 light_vertex_array;
-    glGenVertexArrays(1, &light_vertex_array);
+    f32 scatter_extent = 4.0f * cbrtf((f32)cube_count);
+    srand((u32)time(0));
+    for(i32 i = 0; i < cube_count; ++i) {
+        if(i < (i32)array_count(initial_cube_positions)) {
+            cube_positions[i] = initial_cube_positions[i];
+            cube_rotations[i] = initial_cube_rotations[i];
+        } else {
+            f32 rx = (f32)rand() / (f32)RAND_MAX;
+            f32 ry = (f32)rand() / (f32)RAND_MAX;
+            f32 rz = (f32)rand() / (f32)RAND_MAX;
+            cube_positions[i] = vec3((rx - 0.5f) * scatter_extent,
+                                     (ry - 0.5f) * scatter_extent,
+                                     -rz * scatter_extent);
+            cube_rotations[i].axis  = noz_vec3(vec3(rx + 0.1f, ry, rz));
+            cube_rotations[i].angle = 360.0f * rx;
+        }
+    }
 
-    glBindVertexArray(light_vertex_array);
-    glBindBuffer(GL_ARRAY_BUFFER, cube_vertex_buffer);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
+    // Both meshes come from the same unindexed cube data, the light only
+    // needs positions so it welds down to the 8 corners.
+    VertexStream cube_streams[] = {
+        { .component_count = 3, .location = 0, .data = cube_vertex_positions },
+        { .component_count = 3, .location = 1, .data = cube_normals },
+        { .component_count = 2, .location = 8, .data = cube_tex_coords },
+        // { .component_count = 3, .location = 7, .data = cube_vertex_colors },
+    };
+    u32 cube_vertex_count = array_count(cube_vertex_positions) / 3;
 
-    //Cube transform data;
-    const int cube_triangle_count = array_count(cube_vertex_positions) / 3;
+    MeshData cube_mesh_data;
+    MeshData light_mesh_data;
+    if(!build_indexed_mesh("cube", cube_streams, array_count(cube_streams), cube_vertex_count, &cube_mesh_data) ||
+       !build_indexed_mesh("light", cube_streams, 1, cube_vertex_count, &light_mesh_data)) {
+        return -1;
+    }
+    // Positions quantized to 16 bits, normals packed into 2_10_10_10 and
+    // half float UVs, the other layouts are only here for the size table.
+    VertexLayout cube_layouts[3] = {
+        { .name = "float interleaved" },
+        { .name = "float positions, packed normals" },
+        { .name = "snorm16 positions, packed normals" },
+    };
+    add_vertex_attribute(&cube_layouts[0], 0, 3, VERTEX_FORMAT_F32);
+    add_vertex_attribute(&cube_layouts[0], 1, 3, VERTEX_FORMAT_F32);
+    add_vertex_attribute(&cube_layouts[1], 0, 3, VERTEX_FORMAT_F32);
+    add_vertex_attribute(&cube_layouts[1], 1, 3, VERTEX_FORMAT_INT_2_10_10_10);
+    add_vertex_attribute(&cube_layouts[2], 0, 3, VERTEX_FORMAT_SNORM16);
+    add_vertex_attribute(&cube_layouts[2], 1, 3, VERTEX_FORMAT_INT_2_10_10_10);
+    for(u32 i = 0; i < array_count(cube_layouts); ++i) {
+        add_vertex_attribute(&cube_layouts[i], 8, 2, i == 0 ? VERTEX_FORMAT_F32 : VERTEX_FORMAT_F16);
+    }
+    VertexLayout* cube_layout = &cube_layouts[2];
+
+    VertexLayout light_layout = { .name = "snorm16 positions" };
+    add_vertex_attribute(&light_layout, 0, 3, VERTEX_FORMAT_SNORM16);
+
+    log_vertex_layout_sizes("cube", &cube_mesh_data, cube_layouts, array_count(cube_layouts));
+    log_vertex_layout_sizes("light", &light_mesh_data, &light_layout, 1);
+
+    // Room for every cube's instance data and indirect command plus the
+    // frame globals, with headroom for anything else that streams data.
+    // The pool's instance attributes point into it, so it comes first.
+    u32 stream_frame_size = (cube_count + 1) * (sizeof(InstanceData) + sizeof(DrawElementsIndirectCommand)) +
+                            64 * 1024;
+    init_ring_buffer(gl_state, &render_context.stream_buffer, stream_frame_size);
+
+    // Both meshes share one set of buffers in the cube layout so their draws
+    // can go out together, the light just gets zero normals.
+    MeshPool mesh_pool;
+    init_mesh_pool(&render_context, &mesh_pool, cube_layout,
+                   cube_mesh_data.vertex_count + light_mesh_data.vertex_count,
+                   cube_mesh_data.index_count + light_mesh_data.index_count, GL_UNSIGNED_SHORT);
+    Mesh cube_mesh  = add_mesh_to_pool(&render_context, &mesh_pool, &cube_mesh_data, basic_shader);
+    Mesh light_mesh = add_mesh_to_pool(&render_context, &mesh_pool, &light_mesh_data, light_shader);
+    free_mesh_data(&cube_mesh_data);
+    free_mesh_data(&light_mesh_data);
+
+    RenderCommandBuffer render_commands;
+    init_render_commands(&render_commands);
 
     for(i32 i = 0; i < cube_count; ++i) {
-        cube_mesh_array[i].vao           = cube_vertex_array;
-        cube_mesh_array[i].count         = cube_triangle_count;
-        cube_mesh_array[i].shader_program = basic_shader;
+        cube_mesh_array[i] = cube_mesh;
     }
 
-#if USE_TEXTURES
-    glUseProgram(basic_shader);
-    set_unfirorm1i("in_texture_0", 0);
-    set_unfirorm1i("in_texture_1", 1);
-    // glUniform1i(glGetUniformLocation(basic_shader, "in_texture0"), 0);
-    // glUniform1i(glGetUniformLocation(basic_shader, "in_texture1"), 1);
-#endif
+    UniformName object_color_name = intern_uniform_name("object_color");
+
+    UniformName texture_0_name = intern_uniform_name("in_texture_0");
+    UniformName texture_1_name = intern_uniform_name("in_texture_1");
 
     Vec3 light_pos = { .x = 1.2f, .y = 1.0f, .z = 2.0f};
     Vec3 view_pos  = { .x = 0.0f, .y = 2.0f, .z = 3.0f};
 
-    glUseProgram(basic_shader);
-    set_uniform_3f("object_color", 1.0f, 0.5f, 0.31f);
-    set_uniform_3f("light_color", 1.0f, 1.0f, 1.0f);
-    set_uniform_vec3("light_pos", light_pos);
-    set_uniform_vec3("view_pos", view_pos);
+    FrameUniforms frame_uniforms;
+    frame_uniforms.view_pos    = vec4(view_pos.x, view_pos.y, view_pos.z, 1.0f);
+    frame_uniforms.light_pos   = vec4(light_pos.x, light_pos.y, light_pos.z, 1.0f);
+    frame_uniforms.light_color = vec4(light_color.x, light_color.y, light_color.z, 1.0f);
 
     b32 running = true;
     f64 current_time = (f32)SDL_GetPerformanceCounter() /
@@ -443,13 +423,20 @@ main() {
         delta_time = (f64)(current_time - last_time);
 
         // Count frames for every second and print it as the title of the window
+        // along with the draw calls issued during the last frame
         ++frame_counter;
         if(current_time >= (last_fps_time + 1.f)) {
             last_fps_time    = current_time;
             i32 delta_frames = frame_counter - last_frame_count;
             last_frame_count = frame_counter;
-            char title[64];
-            sprintf(title, "FPS: %d", delta_frames);
+            char title[192];
+            sprintf(title, "FPS: %d | Draw calls: %u | State changes avoided: %u | Cubes: %d | %s%s | "
+                    "Textures: %.1f MB",
+                    delta_frames, render_context.draw_calls,
+                    state_changes_avoided(&render_commands.stats), cube_count,
+                    render_commands.merge_instances ? "Instanced" : "Per cube",
+                    render_commands.multi_draw ? " | Multi-draw" : "",
+                    (f64)resident_texture_bytes() / (1024.0 * 1024.0));
             SDL_SetWindowTitle(window, title);
         }
 
@@ -475,11 +462,28 @@ main() {
                         } break;
 
                         case '1': {
-                            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+                            set_polygon_mode(gl_state, GL_FILL);
                         } break;
 
                         case '2': {
-                            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+                            set_polygon_mode(gl_state, GL_LINE);
+                        } break;
+
+                        case '3': {
+                            render_commands.merge_instances = !render_commands.merge_instances;
+                            log_debug_message("Instancing %s\n", render_commands.merge_instances ? "on" : "off");
+                        } break;
+
+                        case '4': {
+                            render_commands.multi_draw = !render_commands.multi_draw;
+                            log_debug_message("Multi-draw indirect %s\n", render_commands.multi_draw ? "on" : "off");
+                        } break;
+
+                        case '5': {
+                            if(textures_loaded) {
+                                cube_features ^= textured_feature;
+                                log_debug_message("Textured cubes %s\n", (cube_features & textured_feature) ? "on" : "off");
+                            }
                         } break;
                     }
                 } break;
@@ -490,7 +494,8 @@ main() {
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        Mat4 projection = HMM_Perspective(90.f, (f32)render_context.width / (f32)render_context.height, 0.1f, 1000.f);
+        f32 far_plane = 1000.f;
+        Mat4 projection = HMM_Perspective(90.f, (f32)render_context.width / (f32)render_context.height, 0.1f, far_plane);
 
         Mat4 view = HMM_LookAt(
             view_pos,
@@ -506,6 +511,72 @@ main() {
         }
 #endif
 
+        // Files saved since the last frame, once they've settled. Shader
+        // programs swap in poll_shader_programs when they're built,
+        // textures below when they're decoded, so a frame never sees half
+        // a reload.
+        HotReloadChange change;
+        while(take_hot_reload_change(&change)) {
+            if(update_shader_source_file(change.path)) {
+                reload_shader_template(gl_state, &basic_template, change.first_counter);
+                reload_shader_template(gl_state, &light_template, change.first_counter);
+            }
+            for(u32 i = 0; i < array_count(cube_texture_loads); ++i) {
+                reload_texture(&cube_texture_loads[i], change.path, change.first_counter);
+            }
+        }
+
+        poll_shader_programs(gl_state);
+
+        // Only textures that are already read and decoded get uploaded
+        for(u32 i = 0; i < array_count(cube_texture_loads); ++i) {
+            poll_texture(&render_context, cube_atlas, &cube_texture_loads[i]);
+        }
+        // A few MB a frame at most, big textures take a few frames
+        process_texture_uploads(gl_state, TEXTURE_UPLOAD_FRAME_BUDGET);
+        textures_loaded = true;
+        for(u32 i = 0; i < array_count(cube_texture_loads); ++i) {
+            textures_loaded = textures_loaded && texture_ready(cube_atlas, &cube_texture_loads[i]);
+        }
+        // Looked up every frame, repacking the atlas moves textures around
+        for(u32 i = 0; i < array_count(cube_materials); ++i) {
+            for(u32 unit = 0; unit < MAX_PACKET_TEXTURES; ++unit) {
+                cube_textures[i][unit] = texture_binding(cube_atlas, &cube_texture_loads[cube_materials[i][unit]]);
+            }
+        }
+
+        if(!launch_logged && textures_loaded && shader_program_ready(basic_shader) &&
+           shader_program_ready(light_shader)) {
+            DerivedDataStats derived_data_stats = get_derived_data_stats();
+            log_debug_message("Launched in %.2f ms, derived data cache: %u hits, %u misses\n",
+                              elapsed_ms(launch_start), derived_data_stats.hits, derived_data_stats.misses);
+            launch_logged = true;
+        }
+
+        // Compiled the first time it's asked for, the fallback draws until then
+        basic_shader = get_shader_permutation(&basic_template, cube_features);
+
+        // The program may have become ready this frame. Once it has its
+        // values the uniform cache skips these. With program pipelines
+        // each uniform lives in one of the stage programs.
+        if(shader_program_ready(basic_shader)) {
+            set_uniform_3f(&render_context, shader_program_with_uniform(basic_shader, object_color_name),
+                           object_color_name, 1.0f, 0.5f, 0.31f);
+            set_uniform_1i(&render_context, shader_program_with_uniform(basic_shader, texture_0_name),
+                           texture_0_name, 0);
+            set_uniform_1i(&render_context, shader_program_with_uniform(basic_shader, texture_1_name),
+                           texture_1_name, 1);
+        }
+
+        begin_ring_buffer_frame(&render_context.stream_buffer);
+
+        frame_uniforms.view       = view;
+        frame_uniforms.projection = projection;
+        update_frame_uniforms(&render_context, &frame_uniforms);
+
+        render_context.draw_calls = 0;
+        begin_render_commands(&render_commands);
+
 // Draw light source
 #if 1
         {
@@ -513,14 +584,8 @@ main() {
             model = HMM_MultiplyMat4(model, HMM_Translate(light_pos));
             model = HMM_MultiplyMat4(model, HMM_Scale(vec3(0.3f, 0.3f, 0.3f)));
 
-            glUseProgram(light_shader);
-
-            set_uniform_mat4("model", model);
-            set_uniform_mat4("view", view);
-            set_uniform_mat4("projection", projection);
-
-            glBindVertexArray(light_vertex_array);
-            glDrawArrays(GL_TRIANGLES, 0, cube_triangle_count);
+            f32 depth = HMM_LengthVec3(HMM_SubtractVec3(light_pos, view_pos)) / far_plane;
+            push_draw_command(&render_commands, RENDER_PASS_OPAQUE, light_mesh, 0, depth, model);
         }
 #endif
 
@@ -531,6 +596,7 @@ main() {
             Vec3 scale = vec3(1.0f, 1.0f, 1.0f);
             Vec3 position = cube_positions[i];
             Mesh mesh = cube_mesh_array[i];
+            mesh.shader_program = basic_shader;
             Rotation rotation = cube_rotations[i];
 
             Mat4 model = HMM_Mat4d(1.0f);
@@ -539,26 +605,118 @@ main() {
             model = HMM_MultiplyMat4(model, HMM_Scale(scale));
             // Mat4 mvp = projection * view * model;
 
-            glUseProgram(mesh.shader_program);
+            f32 distance = HMM_LengthVec3(HMM_SubtractVec3(position, view_pos));
+            const TextureBinding* textures = 0;
+            if(cube_features & textured_feature) {
+                u32 material = i % array_count(cube_materials);
+                textures = cube_textures[material];
+                // Each face maps the whole texture onto one unit
+                f32 pixels_per_unit = projection.Elements[1][1] * 0.5f * render_context.height / distance;
+                for(u32 unit = 0; unit < MAX_PACKET_TEXTURES; ++unit) {
+                    require_texture_detail(cube_atlas, &cube_texture_loads[cube_materials[material][unit]],
+                                           1.0f, pixels_per_unit);
+                }
+            }
+            f32 depth = distance / far_plane;
+            push_draw_command(&render_commands, RENDER_PASS_OPAQUE, mesh, textures, depth, model);
+        }
+#endif
 
-            set_uniform_mat4("model", model);
-            set_uniform_mat4("view", view);
-            set_uniform_mat4("projection", projection);
+        submit_render_commands(&render_context, &render_commands);
+        if(cube_features & textured_feature) {
+            frame_texture_binds += render_commands.stats.texture_binds;
+            frame_draw_calls    += render_context.draw_calls;
+            ++frames_drawn;
+        }
 
-            // glActiveTexture(GL_TEXTURE0);
-            // glBindTexture(GL_TEXTURE_2D, texture0);
-            // glActiveTexture(GL_TEXTURE1);
-            // glBindTexture(GL_TEXTURE_2D, texture1);
-            glBindVertexArray(mesh.vao);
-            glDrawArrays(GL_TRIANGLES, 0, mesh.count);
+        // Levels for what was drawn, they stream in over the next frames
+        update_texture_residency();
+        for(u32 i = 0; i < array_count(cube_texture_loads); ++i) {
+            apply_texture_residency(gl_state, &cube_texture_loads[i]);
+        }
+        if(cube_atlas) {
+            apply_atlas_residency(gl_state, cube_atlas);
         }
-#endif
 
-        glBindVertexArray(0);
+        end_ring_buffer_frame(gl_state, &render_context.stream_buffer);
+
+#if VALIDATE_GL_STATE
+        validate_gl_state(gl_state, "end of frame");
+#endif
 
         SDL_GL_SwapWindow(window);
     }
 
+    log_debug_message("Uniform uploads: %u, redundant uploads skipped: %u\n",
+                      uniform_stats.uploads, uniform_stats.redundant_uploads_skipped);
+    log_debug_message("GL state calls: %u, redundant calls elided: %u\n",
+                      gl_state->stats.calls, gl_state->stats.calls_elided);
+    log_debug_message("Ring buffer peak: %u bytes per frame, fence waits: %u\n",
+                      render_context.stream_buffer.stats.peak_frame_bytes,
+                      render_context.stream_buffer.stats.fence_waits);
+    log_debug_message("Shaders: %u compiles (%.2f ms), %u reused, %u links (%.2f ms)\n",
+                      shader_cache_stats.compiles, shader_cache_stats.compile_ms,
+                      shader_cache_stats.compile_hits,
+                      shader_cache_stats.links, shader_cache_stats.link_ms);
+    log_debug_message("Program binary cache: %u hits, %u misses, %u stored, stage programs: %u hits, "
+                      "%u misses, %u stored\n",
+                      program_binary_cache.stats.hits, program_binary_cache.stats.misses,
+                      program_binary_cache.stats.stores, program_binary_cache.stage_stats.hits,
+                      program_binary_cache.stage_stats.misses, program_binary_cache.stage_stats.stores);
+    log_debug_message("Program pipelines: %u assembled from %u separable stage links (%.2f ms)\n",
+                      program_pipeline_stats.pipelines, program_pipeline_stats.separable_links,
+                      program_pipeline_stats.separable_link_ms);
+    log_debug_message("Shader reloads: %u, failed: %u\n", async_shader_stats.reloads,
+                      async_shader_stats.reload_failures);
+
+    shutdown_hot_reload();
+    log_debug_message("Textures: %u cooked (%.2f MB), %u decoded (%.2f MB), %u into the atlas, %u staged, "
+                      "%u streamed\n",
+                      texture_stats.cooked, (f64)texture_stats.cooked_bytes / (1024.0 * 1024.0),
+                      texture_stats.decoded, (f64)texture_stats.decoded_bytes / (1024.0 * 1024.0),
+                      texture_stats.atlased, texture_stats.staged, texture_stats.streamed);
+    log_texture_residency();
+    TextureUploadStats* upload_stats = &texture_uploads.stats;
+    log_debug_message("Texture uploads: %.2f MB in %u uploads over %u frames, %.1f KB per frame, "
+                      "%.1f KB peak, %u slices staged, %u didn't fit\n",
+                      (f64)upload_stats->bytes / (1024.0 * 1024.0), upload_stats->uploads, upload_stats->frames,
+                      (f64)upload_stats->bytes / 1024.0 / (f64)(max(upload_stats->frames, 1)),
+                      (f64)upload_stats->peak_frame_bytes / 1024.0, upload_stats->staged,
+                      upload_stats->staging_failures);
+    if(cube_atlas) {
+        log_texture_atlas_stats(cube_atlas);
+    }
+    log_debug_message("Textured frames: %.2f texture binds, %.2f draw calls per frame, atlas %s\n",
+                      (f64)frame_texture_binds / (f64)(max(frames_drawn, 1)),
+                      (f64)frame_draw_calls / (f64)(max(frames_drawn, 1)), cube_atlas ? "on" : "off");
+    for(u32 i = 0; i < array_count(cube_texture_loads); ++i) {
+        free_texture(gl_state, cube_atlas, &cube_texture_loads[i]);
+    }
+    free_texture_atlas(gl_state, &texture_atlas);
+    AsyncIOStats async_io_stats = get_async_io_stats();
+    log_debug_message("Async reads: %u completed (%.2f ms average), %u failed, %u cancelled, "
+                      "%u reads in %u submits, peak %u in flight\n",
+                      async_io_stats.completed, async_io_stats.latency_ms / (max(async_io_stats.completed, 1)),
+                      async_io_stats.failed, async_io_stats.cancelled, async_io_stats.reads_submitted,
+                      async_io_stats.submit_calls, async_io_stats.peak_in_flight);
+    shutdown_async_io();
+    shutdown_texture_uploads(gl_state);
+    DerivedDataStats derived_data_stats = get_derived_data_stats();
+    log_debug_message("Derived data cache: %u hits, %u misses, %u stored (%.2f MB), %u evicted\n",
+                      derived_data_stats.hits, derived_data_stats.misses, derived_data_stats.stores,
+                      (f64)derived_data_stats.bytes_stored / (1024.0 * 1024.0), derived_data_stats.evictions);
+    shutdown_derived_data_cache();
+    unmount_asset_archive();
+
+    free(cube_positions);
+    free(cube_rotations);
+    free(cube_mesh_array);
+    free_render_commands(&render_commands);
+    free_ring_buffer(gl_state, &render_context.stream_buffer);
+    free_async_shaders(gl_state);
+    free_shader_template(&basic_template);
+    free_shader_template(&light_template);
+
     SDL_GL_DeleteContext(gl_context);
     SDL_DestroyWindow(window);
     return 0;
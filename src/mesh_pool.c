@@ -0,0 +1,105 @@
+/*
+  Mesh pool.
+
+  Static meshes that share a vertex layout live in one vertex buffer and one
+  index buffer behind a single vertex array. Each mesh remembers where its
+  indices start and which vertex its indices are relative to, so draws of
+  different meshes only differ in their draw parameters. That is what lets
+  the command buffer submit them together with glMultiDrawElementsIndirect.
+
+  Pools have a fixed capacity given up front. Indices are relative to the
+  mesh's base vertex, so 16-bit indices work as long as every single mesh
+  has fewer than 65536 vertices.
+*/
+
+typedef struct {
+    VertexLayout layout;
+    u32 index_type;
+
+    u32 vao;
+    u32 vertex_buffer;
+    u32 index_buffer;
+
+    u32 vertex_capacity;
+    u32 vertex_count;
+    u32 index_capacity;
+    u32 index_count;
+} MeshPool;
+
+static void
+init_mesh_pool(RenderContext* render_context, MeshPool* pool, VertexLayout* layout,
+               u32 vertex_capacity, u32 index_capacity, u32 index_type) {
+    GLState* gl_state = &render_context->gl_state;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->layout          = *layout;
+    pool->index_type      = index_type;
+    pool->vertex_capacity = vertex_capacity;
+    pool->index_capacity  = index_capacity;
+
+    glGenVertexArrays(1, &pool->vao);
+    bind_vertex_array(gl_state, pool->vao);
+
+    glGenBuffers(1, &pool->vertex_buffer);
+    bind_buffer(gl_state, GL_ARRAY_BUFFER, pool->vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, vertex_capacity * layout->stride, 0, GL_STATIC_DRAW);
+    for(u32 a = 0; a < layout->attribute_count; ++a) {
+        set_vertex_attribute_pointer(&pool->layout, &pool->layout.attributes[a]);
+    }
+
+    // The element array binding is part of the vertex array
+    glGenBuffers(1, &pool->index_buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool->index_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_capacity * index_size(index_type), 0, GL_STATIC_DRAW);
+
+    setup_instance_attributes(render_context, pool->vao);
+}
+
+// Appends the mesh to the pool's buffers. Returns a mesh with a zero vao
+// when it doesn't fit.
+static Mesh
+add_mesh_to_pool(RenderContext* render_context, MeshPool* pool, MeshData* mesh_data, u32 shader_program) {
+    GLState* gl_state = &render_context->gl_state;
+    Mesh mesh = {0};
+
+    b32 fits = pool->vertex_count + mesh_data->vertex_count <= pool->vertex_capacity &&
+               pool->index_count + mesh_data->index_count <= pool->index_capacity;
+    if(!fits || (pool->index_type == GL_UNSIGNED_SHORT && mesh_data->vertex_count > 0xffff)) {
+        log_error_message("Mesh with %u vertices doesn't fit in the pool\n", mesh_data->vertex_count);
+        return mesh;
+    }
+
+    u32 stride = pool->layout.stride;
+    u8* vertices = malloc(mesh_data->vertex_count * stride);
+    mesh.position_scale = pack_vertices(&pool->layout, mesh_data, vertices);
+    bind_buffer(gl_state, GL_ARRAY_BUFFER, pool->vertex_buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, pool->vertex_count * stride, mesh_data->vertex_count * stride, vertices);
+    free(vertices);
+
+    u32 index_bytes = index_size(pool->index_type);
+    void* indices = mesh_data->indices;
+    if(pool->index_type == GL_UNSIGNED_SHORT) {
+        u16* short_indices = malloc(mesh_data->index_count * sizeof(u16));
+        for(u32 i = 0; i < mesh_data->index_count; ++i) {
+            short_indices[i] = (u16)mesh_data->indices[i];
+        }
+        indices = short_indices;
+    }
+    bind_vertex_array(gl_state, pool->vao);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, pool->index_count * index_bytes,
+                    mesh_data->index_count * index_bytes, indices);
+    if(indices != mesh_data->indices) {
+        free(indices);
+    }
+
+    mesh.vao            = pool->vao;
+    mesh.count          = mesh_data->index_count;
+    mesh.shader_program = shader_program;
+    mesh.index_type     = pool->index_type;
+    mesh.first_index    = pool->index_count;
+    mesh.base_vertex    = pool->vertex_count;
+
+    pool->vertex_count += mesh_data->vertex_count;
+    pool->index_count  += mesh_data->index_count;
+    return mesh;
+}
@@ -0,0 +1,221 @@
+/*
+  Mip chains.
+
+  Builds every level of a texture on the CPU with stb_image_resize, in
+  one contiguous buffer, level 0 first, ready to upload or compress. Each
+  level is filtered from the one above it:
+    - Colours are filtered in linear light and written back as sRGB, so
+      mips don't darken the way a box filter on the raw bytes does.
+      Alpha is filtered linearly and weights the colours.
+    - One and two channel images are data, like masks or normals, and are
+      filtered as they are.
+    - The edge mode should match how the texture is sampled, wrap for
+      GL_REPEAT, so the filter sees across the seam the sampler does.
+
+  choose_mip_settings picks the kernel per texture, see there.
+
+  Large levels are split into bands of MIP_BAND_ROWS output rows, which
+  stbir_resize_region filters independently, so any number of threads can
+  work on one chain through run_mip_job, the cooker's threads offline and
+  the idle I/O workers at runtime, see textures.c. A band waits for the
+  whole level above it, bands are handed out in order so that's never
+  long.
+*/
+
+#define MAX_MIP_LEVELS 16
+#define MIP_BAND_ROWS 64
+
+typedef struct {
+    stbir_filter filter;
+    stbir_edge edge;
+    b32 srgb;
+} MipSettings;
+
+typedef struct {
+    u32 width;
+    u32 height;
+    u32 channels;
+    u32 level_count;
+    size_t level_offsets[MAX_MIP_LEVELS];
+    size_t size;
+    u8* pixels;
+} MipChain;
+
+typedef struct {
+    MipChain* chain;
+    MipSettings settings;
+    // Level i is made of bands first_bands[i] up to first_bands[i + 1],
+    // level 0 is the source and has none
+    u32 band_count;
+    u32 first_bands[MAX_MIP_LEVELS + 1];
+    volatile i32 next_band;
+    volatile i32 finished_bands[MAX_MIP_LEVELS];
+    volatile i32 failed;
+} MipJob;
+
+static inline i32
+atomic_add_mip_counter(volatile i32* counter, i32 value) {
+#ifdef _WIN32
+    return InterlockedExchangeAdd((volatile LONG*)counter, value);
+#else
+    return __atomic_fetch_add(counter, value, __ATOMIC_ACQ_REL);
+#endif
+}
+
+static inline i32
+load_mip_counter(volatile i32* counter) {
+#ifdef _WIN32
+    return InterlockedCompareExchange((volatile LONG*)counter, 0, 0);
+#else
+    return __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline u32
+mip_dimension(u32 width, u32 level) {
+    return max(width >> level, 1);
+}
+
+// Down to 1x1
+static inline u32
+mip_level_count(u32 width, u32 height) {
+    u32 count = 1;
+    while(((width | height) >> count) && count < MAX_MIP_LEVELS) {
+        ++count;
+    }
+    return count;
+}
+
+// Where every level goes in a contiguous chain, returns the total size
+static size_t
+mip_chain_offsets(u32 width, u32 height, u32 channels, u32 level_count, size_t* offsets) {
+    size_t size = 0;
+    for(u32 i = 0; i < level_count; ++i) {
+        offsets[i] = size;
+        size += (size_t)mip_dimension(width, i) * mip_dimension(height, i) * channels;
+    }
+    return size;
+}
+
+// Box for data and for cutout alpha, where a sharper kernel rings into
+// halos around the edges. Mitchell for colour, it keeps more detail than
+// a box without Catmull-Rom's overshoot.
+static MipSettings
+choose_mip_settings(const u8* pixels, u32 width, u32 height, u32 channels, b32 wrap) {
+    MipSettings settings;
+    settings.edge = wrap ? STBIR_EDGE_WRAP : STBIR_EDGE_CLAMP;
+    settings.srgb = channels >= 3;
+    settings.filter = settings.srgb ? STBIR_FILTER_MITCHELL : STBIR_FILTER_BOX;
+    if(channels == 4) {
+        u32 pixel_count = width * height;
+        u32 transparent = 0;
+        u32 partial = 0;
+        for(u32 i = 0; i < pixel_count; ++i) {
+            u8 alpha = pixels[i * 4 + 3];
+            transparent += alpha == 0;
+            partial += alpha != 0 && alpha != 255;
+        }
+        // Mostly fully in or fully out
+        if(transparent && partial < pixel_count / 16) {
+            settings.filter = STBIR_FILTER_BOX;
+        }
+    }
+    return settings;
+}
+
+// Allocates the chain and copies the source in as level 0
+static void
+init_mip_chain(MipChain* chain, const u8* pixels, u32 width, u32 height, u32 channels) {
+    memset(chain, 0, sizeof(*chain));
+    chain->width       = width;
+    chain->height      = height;
+    chain->channels    = channels;
+    chain->level_count = mip_level_count(width, height);
+    chain->size = mip_chain_offsets(width, height, channels, chain->level_count, chain->level_offsets);
+    chain->pixels = malloc(chain->size);
+    memcpy(chain->pixels, pixels, (size_t)width * height * channels);
+}
+
+static void
+free_mip_chain(MipChain* chain) {
+    free(chain->pixels);
+    memset(chain, 0, sizeof(*chain));
+}
+
+static void
+init_mip_job(MipJob* job, MipChain* chain, MipSettings settings) {
+    memset(job, 0, sizeof(*job));
+    job->chain = chain;
+    job->settings = settings;
+    for(u32 i = 1; i < chain->level_count; ++i) {
+        job->first_bands[i] = job->band_count;
+        u32 rows = mip_dimension(chain->height, i);
+        job->band_count += (rows + MIP_BAND_ROWS - 1) / MIP_BAND_ROWS;
+    }
+    job->first_bands[chain->level_count] = job->band_count;
+}
+
+static inline u32
+mip_level_band_count(MipJob* job, u32 level) {
+    return job->first_bands[level + 1] - job->first_bands[level];
+}
+
+static b32
+resize_mip_band(MipJob* job, u32 level, u32 band) {
+    MipChain* chain = job->chain;
+    u32 input_width   = mip_dimension(chain->width, level - 1);
+    u32 input_height  = mip_dimension(chain->height, level - 1);
+    u32 output_width  = mip_dimension(chain->width, level);
+    u32 output_height = mip_dimension(chain->height, level);
+    u32 first_row = band * MIP_BAND_ROWS;
+    u32 rows = min(MIP_BAND_ROWS, output_height - first_row);
+
+    const u8* input = chain->pixels + chain->level_offsets[level - 1];
+    u8* output = chain->pixels + chain->level_offsets[level] + (size_t)first_row * output_width * chain->channels;
+    i32 alpha_channel = chain->channels == 4 ? 3 : STBIR_ALPHA_CHANNEL_NONE;
+    stbir_colorspace colorspace = job->settings.srgb ? STBIR_COLORSPACE_SRGB : STBIR_COLORSPACE_LINEAR;
+    f32 t0 = (f32)first_row / output_height;
+    f32 t1 = (f32)(first_row + rows) / output_height;
+    return stbir_resize_region(input, input_width, input_height, 0, output, output_width, rows, 0,
+                               STBIR_TYPE_UINT8, chain->channels, alpha_channel, 0,
+                               job->settings.edge, job->settings.edge, job->settings.filter, job->settings.filter,
+                               colorspace, 0, 0.0f, t0, 1.0f, t1);
+}
+
+// Works on the job until every band is taken, from as many threads as
+// there are. The chain is done once all of them return.
+static void
+run_mip_job(MipJob* job) {
+    u32 level = 1;
+    for(;;) {
+        u32 band = (u32)atomic_add_mip_counter(&job->next_band, 1);
+        if(band >= job->band_count) {
+            return;
+        }
+        while(band >= job->first_bands[level + 1]) {
+            ++level;
+        }
+        // The level above has to be finished, it's this band's input
+        while(level > 1 && (u32)load_mip_counter(&job->finished_bands[level - 1]) <
+                               mip_level_band_count(job, level - 1)) {
+#ifdef _WIN32
+            SwitchToThread();
+#else
+            sched_yield();
+#endif
+        }
+        if(!resize_mip_band(job, level, band - job->first_bands[level])) {
+            atomic_add_mip_counter(&job->failed, 1);
+        }
+        atomic_add_mip_counter(&job->finished_bands[level], 1);
+    }
+}
+
+// All of it on this thread
+static b32
+build_mip_chain(MipChain* chain, MipSettings settings) {
+    MipJob job;
+    init_mip_job(&job, chain, settings);
+    run_mip_job(&job);
+    return !job.failed;
+}
@@ -1,5 +1,5 @@
 //Cube
-//TODO: Indices
+//Unindexed, build_indexed_mesh welds and indexes it at load time
 const f32 cube_vertex_positions[] = {
     -0.5f, -0.5f, -0.5f,
     0.5f, -0.5f, -0.5f,
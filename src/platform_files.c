@@ -0,0 +1,291 @@
+/*
+  Platform file layer.
+
+  read_loose_file_contents hands out a read-only view of a whole file on
+  disk. Everything else calls read_file_contents in asset_archive.c, which
+  looks in the packed archive first and comes here for loose files. Large
+  regular files are memory mapped, so the view points straight at the page
+  cache and loading them makes no copy at all. Almost every asset is
+  parsed front to back right after it is opened, so the mapping is
+  populated up front where the kernel can do that (MAP_POPULATE), read
+  ahead otherwise, and hinted as sequential either way.
+
+  Mapping has a fixed cost, the mmap, the page table setup and the munmap,
+  that copying a few pages doesn't. Below FILE_MAP_MIN_SIZE a plain read
+  into the heap wins, see file_benchmark.c. Anything that can't be mapped,
+  like a pipe, or a file the mapping fails for, is streamed into the heap
+  too. Views are not null terminated either way, and free_file_contents
+  unmaps or frees them.
+
+  map_whole_file maps a file without faulting any of it in, for big files
+  that are read a piece at a time, like the archive.
+
+  Paths use forward slashes, which Windows accepts too.
+
+  file_benchmark.c compares the mapped path against read() and the old
+  malloc and copy loader.
+*/
+
+// Streamed reads grow their buffer in steps of at least this much
+#define FILE_STREAM_CHUNK_SIZE (64 * 1024)
+// Smaller files are read rather than mapped
+#define FILE_MAP_MIN_SIZE (128 * 1024)
+
+typedef enum {
+    FILE_BACKING_NONE,
+    FILE_BACKING_MAPPED,
+    FILE_BACKING_HEAP,
+    // Points into the mounted archive, which owns it
+    FILE_BACKING_ARCHIVE,
+} FileBacking;
+
+typedef struct {
+    const char* data;
+    size_t size;
+    FileBacking backing;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+} FileContents;
+
+static b32
+create_directory(const char* path) {
+#ifdef _WIN32
+    return CreateDirectoryA(path, 0) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// Moves from over to, replacing whatever was there in one step, so nobody
+// ever opens a half written to
+static b32
+replace_file(const char* from, const char* to) {
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING);
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+static b32
+loose_file_exists(const char* path) {
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesA(path);
+    return attributes != INVALID_FILE_ATTRIBUTES && !(attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat file_stat;
+    return stat(path, &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+#endif
+}
+
+#ifdef _WIN32
+
+// Reads until the end of the handle into a growing heap buffer
+static b32
+stream_file_contents(HANDLE file_handle, size_t size_hint, FileContents* file) {
+    size_t capacity = max(size_hint + 1, FILE_STREAM_CHUNK_SIZE);
+    size_t size = 0;
+    char* buffer = malloc(capacity);
+    for(;;) {
+        if(size == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+        DWORD to_read = (DWORD)min(capacity - size, 0x40000000);
+        DWORD bytes_read = 0;
+        if(!ReadFile(file_handle, buffer + size, to_read, &bytes_read, 0)) {
+            // A pipe whose writer went away is just the end of it
+            if(GetLastError() == ERROR_BROKEN_PIPE) {
+                break;
+            }
+            free(buffer);
+            return false;
+        }
+        if(!bytes_read) {
+            break;
+        }
+        size += bytes_read;
+    }
+    file->data    = buffer;
+    file->size    = size;
+    file->backing = FILE_BACKING_HEAP;
+    return true;
+}
+
+static b32
+map_file_contents(HANDLE file_handle, size_t size, FileContents* file) {
+    HANDLE mapping = CreateFileMappingA(file_handle, 0, PAGE_READONLY, 0, 0, 0);
+    if(!mapping) {
+        return false;
+    }
+    const char* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if(!view) {
+        CloseHandle(mapping);
+        return false;
+    }
+    file->data    = view;
+    file->size    = size;
+    file->backing = FILE_BACKING_MAPPED;
+    file->mapping = mapping;
+    return true;
+}
+
+static b32
+read_loose_file_contents(const char* path, FileContents* file) {
+    memset(file, 0, sizeof(*file));
+    HANDLE file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+                                     FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if(file_handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    b32 result = false;
+    LARGE_INTEGER file_size;
+    if(GetFileType(file_handle) == FILE_TYPE_DISK && GetFileSizeEx(file_handle, &file_size)) {
+        size_t size = (size_t)file_size.QuadPart;
+        result = size >= FILE_MAP_MIN_SIZE && map_file_contents(file_handle, size, file);
+        if(!result) {
+            result = stream_file_contents(file_handle, size, file);
+        }
+    } else {
+        result = stream_file_contents(file_handle, 0, file);
+    }
+    CloseHandle(file_handle);
+    return result;
+}
+
+static b32
+map_whole_file(const char* path, FileContents* file) {
+    memset(file, 0, sizeof(*file));
+    HANDLE file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+                                     FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, 0);
+    if(file_handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    b32 result = GetFileSizeEx(file_handle, &file_size) && file_size.QuadPart > 0 &&
+                 map_file_contents(file_handle, (size_t)file_size.QuadPart, file);
+    CloseHandle(file_handle);
+    return result;
+}
+
+static void
+free_file_contents(FileContents* file) {
+    if(file->backing == FILE_BACKING_MAPPED) {
+        UnmapViewOfFile(file->data);
+        CloseHandle(file->mapping);
+    } else if(file->backing == FILE_BACKING_HEAP) {
+        free((void*)file->data);
+    }
+    memset(file, 0, sizeof(*file));
+}
+
+#else
+
+// Reads until the end of the descriptor into a growing heap buffer
+static b32
+stream_file_contents(int fd, size_t size_hint, FileContents* file) {
+    size_t capacity = max(size_hint + 1, FILE_STREAM_CHUNK_SIZE);
+    size_t size = 0;
+    char* buffer = malloc(capacity);
+    for(;;) {
+        if(size == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+        ssize_t bytes_read = read(fd, buffer + size, capacity - size);
+        if(bytes_read < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            free(buffer);
+            return false;
+        }
+        if(!bytes_read) {
+            break;
+        }
+        size += bytes_read;
+    }
+    file->data    = buffer;
+    file->size    = size;
+    file->backing = FILE_BACKING_HEAP;
+    return true;
+}
+
+static b32
+map_file_contents(int fd, size_t size, b32 populate, FileContents* file) {
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    // Faulting everything in with one call beats a fault per page
+    if(populate) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+    void* view = mmap(0, size, PROT_READ, flags, fd, 0);
+    if(view == MAP_FAILED) {
+        return false;
+    }
+    // Only hints, the view works the same if they're ignored
+    if(populate) {
+        madvise(view, size, MADV_SEQUENTIAL);
+#ifndef MAP_POPULATE
+        madvise(view, size, MADV_WILLNEED);
+#endif
+    }
+
+    file->data    = view;
+    file->size    = size;
+    file->backing = FILE_BACKING_MAPPED;
+    return true;
+}
+
+static b32
+read_loose_file_contents(const char* path, FileContents* file) {
+    memset(file, 0, sizeof(*file));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+
+    b32 result = false;
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+        size_t size = (size_t)file_stat.st_size;
+        result = size >= FILE_MAP_MIN_SIZE && map_file_contents(fd, size, true, file);
+        if(!result) {
+            result = stream_file_contents(fd, size, file);
+        }
+    } else {
+        result = stream_file_contents(fd, 0, file);
+    }
+    // The mapping keeps its own reference to the file
+    close(fd);
+    return result;
+}
+
+static b32
+map_whole_file(const char* path, FileContents* file) {
+    memset(file, 0, sizeof(*file));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    b32 result = fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0 &&
+                 map_file_contents(fd, (size_t)file_stat.st_size, false, file);
+    close(fd);
+    return result;
+}
+
+static void
+free_file_contents(FileContents* file) {
+    if(file->backing == FILE_BACKING_MAPPED) {
+        munmap((void*)file->data, file->size);
+    } else if(file->backing == FILE_BACKING_HEAP) {
+        free((void*)file->data);
+    }
+    memset(file, 0, sizeof(*file));
+}
+
+#endif
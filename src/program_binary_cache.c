@@ -0,0 +1,221 @@
+/*
+  On-disk program binary cache.
+
+  Linked programs are saved with glGetProgramBinary and loaded back with
+  glProgramBinary on the next launch, skipping compiling and linking
+  entirely. A binary is only valid for the exact sources and driver it
+  came from, so the cache key hashes both source hashes together with the
+  GL vendor, renderer and version strings and the binary formats the
+  driver supports. The file header repeats the key and the format, and a
+  binary the driver refuses anyway (glProgramBinary leaves the program
+  unlinked) counts as a miss and gets overwritten after the normal
+  compile.
+
+  The separable stage programs of program pipelines are cached the same
+  way, keyed by the stage type and source hash, and counted apart from
+  full programs.
+
+  Needs GL 4.1 or ARB_get_program_binary, otherwise every lookup misses.
+  Set PROGRAM_BINARY_CACHE to 0 to compare startup times without it.
+*/
+
+#define PROGRAM_BINARY_CACHE 1
+#define PROGRAM_BINARY_CACHE_DIRECTORY "data/shader_cache"
+#define PROGRAM_BINARY_MAGIC 0x4e494250 // "PBIN"
+
+typedef struct {
+    u32 magic;
+    u32 format;
+    u64 key;
+    u32 length;
+    u32 reserved;
+} ProgramBinaryHeader;
+
+typedef struct {
+    u32 hits;
+    u32 misses;
+    u32 stores;
+} ProgramBinaryCacheStats;
+
+typedef struct {
+    b32 enabled;
+    // Everything about the driver that invalidates a binary
+    u64 driver_hash;
+    ProgramBinaryCacheStats stats;
+    // Separable stage programs, see program_pipelines.c
+    ProgramBinaryCacheStats stage_stats;
+} ProgramBinaryCache;
+
+static ProgramBinaryCache program_binary_cache;
+
+static void
+init_program_binary_cache(void) {
+    memset(&program_binary_cache, 0, sizeof(program_binary_cache));
+#if PROGRAM_BINARY_CACHE
+    if(!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary) {
+        log_debug_message("Program binary cache off, no ARB_get_program_binary\n");
+        return;
+    }
+
+    i32 format_count = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+    if(format_count <= 0) {
+        log_debug_message("Program binary cache off, the driver has no binary formats\n");
+        return;
+    }
+    i32* formats = malloc(format_count * sizeof(i32));
+    glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, formats);
+
+    const char* vendor   = (const char*)glGetString(GL_VENDOR);
+    const char* renderer = (const char*)glGetString(GL_RENDERER);
+    const char* version  = (const char*)glGetString(GL_VERSION);
+    u64 hash = hash_bytes_64(vendor, strlen(vendor));
+    hash = hash_combine_64(hash, renderer, strlen(renderer));
+    hash = hash_combine_64(hash, version, strlen(version));
+    hash = hash_combine_64(hash, formats, format_count * sizeof(i32));
+    free(formats);
+
+    create_directory(PROGRAM_BINARY_CACHE_DIRECTORY);
+    program_binary_cache.driver_hash = hash;
+    program_binary_cache.enabled = true;
+#endif
+}
+
+static inline u64
+program_binary_key(u64 vertex_source_hash, u64 fragment_source_hash) {
+    u64 key = program_binary_cache.driver_hash;
+    key = hash_combine_64(key, &vertex_source_hash, sizeof(vertex_source_hash));
+    key = hash_combine_64(key, &fragment_source_hash, sizeof(fragment_source_hash));
+    return key;
+}
+
+static inline u64
+stage_program_binary_key(GLenum type, u64 source_hash) {
+    u64 key = program_binary_cache.driver_hash;
+    key = hash_combine_64(key, &type, sizeof(type));
+    key = hash_combine_64(key, &source_hash, sizeof(source_hash));
+    return key;
+}
+
+static inline void
+program_binary_path(u64 key, char* path, size_t path_size) {
+    snprintf(path, path_size, "%s/%016llx.bin", PROGRAM_BINARY_CACHE_DIRECTORY, (unsigned long long)key);
+}
+
+// Returns a linked program, or 0 on a miss. Separable programs have to be
+// marked before glProgramBinary like before a link.
+static u32
+read_program_binary(u64 key, b32 separable, ProgramBinaryCacheStats* stats) {
+    if(!program_binary_cache.enabled) {
+        return 0;
+    }
+
+    char path[256];
+    program_binary_path(key, path, sizeof(path));
+    FILE* file = fopen(path, "rb");
+    if(!file) {
+        ++stats->misses;
+        return 0;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    u32 program = 0;
+    b32 corrupt = false;
+    ProgramBinaryHeader header;
+    if(fread(&header, sizeof(header), 1, file) == 1 &&
+       header.magic == PROGRAM_BINARY_MAGIC && header.key == key) {
+        // The length is only trusted if the file really has that much after the header
+        void* binary = 0;
+        if(file_size >= 0 && header.length == (u64)file_size - sizeof(header)) {
+            binary = malloc(header.length);
+        }
+        corrupt = !binary || fread(binary, 1, header.length, file) != header.length;
+        if(!corrupt) {
+            program = glCreateProgram();
+            if(separable) {
+                glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+            }
+            glProgramBinary(program, header.format, binary, header.length);
+
+            i32 result = 0;
+            glGetProgramiv(program, GL_LINK_STATUS, &result);
+            if(!result) {
+                log_debug_message("Program binary %s was rejected by the driver\n", path);
+                glDeleteProgram(program);
+                program = 0;
+            }
+        }
+        free(binary);
+    }
+    fclose(file);
+    if(corrupt) {
+        log_error_message("Program binary %s is truncated or corrupt, deleting it\n", path);
+        remove(path);
+    }
+
+    if(!program) {
+        ++stats->misses;
+        return 0;
+    }
+    ++stats->hits;
+    reflect_program_uniforms(program);
+    return program;
+}
+
+static inline u32
+load_program_binary(u64 key) {
+    return read_program_binary(key, false, &program_binary_cache.stats);
+}
+
+static inline u32
+load_stage_program_binary(GLenum type, u64 source_hash) {
+    return read_program_binary(stage_program_binary_key(type, source_hash), true, &program_binary_cache.stage_stats);
+}
+
+static void
+write_program_binary(u64 key, u32 program, ProgramBinaryCacheStats* stats) {
+    if(!program_binary_cache.enabled) {
+        return;
+    }
+
+    i32 length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if(length <= 0) {
+        return;
+    }
+
+    ProgramBinaryHeader header = {0};
+    header.magic = PROGRAM_BINARY_MAGIC;
+    header.key   = key;
+    void* binary = malloc(length);
+    glGetProgramBinary(program, length, (GLsizei*)&header.length, &header.format, binary);
+
+    char path[256];
+    program_binary_path(key, path, sizeof(path));
+    FILE* file = fopen(path, "wb");
+    if(file) {
+        b32 written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                      fwrite(binary, 1, header.length, file) == header.length;
+        fclose(file);
+        if(written) {
+            ++stats->stores;
+        } else {
+            log_error_message("Couldn't write program binary %s\n", path);
+            remove(path);
+        }
+    }
+    free(binary);
+}
+
+static inline void
+store_program_binary(u64 key, u32 program) {
+    write_program_binary(key, program, &program_binary_cache.stats);
+}
+
+static inline void
+store_stage_program_binary(GLenum type, u64 source_hash, u32 program) {
+    write_program_binary(stage_program_binary_key(type, source_hash), program, &program_binary_cache.stage_stats);
+}
@@ -0,0 +1,270 @@
+/*
+  Separable program pipelines.
+
+  With ARB_separate_shader_objects every cached stage is also linked on its
+  own as a separable program, once, the first time a pipeline asks for it.
+  A vertex and fragment combination is then a program pipeline object that
+  points at those stage programs with glUseProgramStages, which doesn't
+  link anything. basic and light share their vertex stage, so the second
+  one costs a fragment stage link and no program link at all.
+
+  Uniforms belong to the stage programs. Each one is reflected into its own
+  uniform table and set with glProgramUniform*, so a value set on a shared
+  stage is set for every pipeline using it, and the uniform cache tracks it
+  once. shader_program_with_uniform in async_shaders.c finds the stage
+  program that has a given uniform.
+
+  Pipelines follow the same submit and finish split as linked programs,
+  see shader_cache.c. begin_program_pipeline takes over the stage
+  references, and the stage programs are linked in the background when
+  ARB_parallel_shader_compile is there.
+
+  The stage programs go in the program binary cache, so a stage that was
+  linked on an earlier run is loaded from there and needs no link at all.
+  A full program already in the cache is still used instead of a pipeline.
+
+  Contexts without the extension, or PROGRAM_PIPELINES set to 0, keep
+  linking full programs.
+*/
+
+#define PROGRAM_PIPELINES 1
+#define MAX_PROGRAM_PIPELINES MAX_SHADER_PROGRAMS
+
+typedef struct {
+    // 0 when the slot is free
+    u32 pipeline;
+    u32 stage_count;
+    u32 stages[MAX_PROGRAM_STAGES];
+
+    b32 assembled;
+    u64 submit_counter;
+} ProgramPipelineEntry;
+
+typedef struct {
+    u32 separable_links;
+    f64 separable_link_ms;
+    u32 pipelines;
+} ProgramPipelineStats;
+
+static ProgramPipelineEntry program_pipelines[MAX_PROGRAM_PIPELINES];
+static ProgramPipelineStats program_pipeline_stats;
+static b32 program_pipelines_enabled;
+
+static void
+init_program_pipelines(void) {
+    memset(program_pipelines, 0, sizeof(program_pipelines));
+    memset(&program_pipeline_stats, 0, sizeof(program_pipeline_stats));
+#if PROGRAM_PIPELINES
+    program_pipelines_enabled = GLEW_ARB_separate_shader_objects;
+#endif
+    log_debug_message("Program pipelines %s\n", program_pipelines_enabled ? "on" : "off");
+}
+
+static GLbitfield
+shader_stage_bit(GLenum type) {
+    switch(type) {
+        case GL_VERTEX_SHADER: return GL_VERTEX_SHADER_BIT;
+        case GL_FRAGMENT_SHADER: return GL_FRAGMENT_SHADER_BIT;
+        case GL_GEOMETRY_SHADER: return GL_GEOMETRY_SHADER_BIT;
+    }
+    return 0;
+}
+
+// Submits the link of the stage's separable program unless another
+// pipeline already did
+static void
+begin_separable_stage(i32 index) {
+    ShaderStage* stage = &shader_stages[index];
+    if(stage->separable_program) {
+        return;
+    }
+    u32 program = load_stage_program_binary(stage->type, stage->content_hash);
+    if(program) {
+        stage->separable_program  = program;
+        stage->separable_finished = true;
+        return;
+    }
+    program = glCreateProgram();
+    glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+    if(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    glAttachShader(program, stage->shader);
+    glLinkProgram(program);
+    stage->separable_program = program;
+    stage->separable_submit_counter = SDL_GetPerformanceCounter();
+}
+
+// Only asks, never waits. Needs ARB_parallel_shader_compile.
+static b32
+separable_stage_completed(i32 index) {
+    ShaderStage* stage = &shader_stages[index];
+    if(stage->separable_finished) {
+        return true;
+    }
+    i32 completed = 0;
+    glGetProgramiv(stage->separable_program, GL_COMPLETION_STATUS_ARB, &completed);
+    return completed;
+}
+
+// Checks the link status, waiting for it if it is still going. Returns
+// false if it failed.
+static b32
+finish_separable_stage(i32 index) {
+    ShaderStage* stage = &shader_stages[index];
+    if(stage->separable_finished) {
+        return !stage->separable_failed;
+    }
+
+    u32 program = stage->separable_program;
+    i32 result = 0;
+    i32 info_log_length;
+    glGetProgramiv(program, GL_LINK_STATUS, &result);
+    f64 ms = elapsed_ms(stage->separable_submit_counter);
+
+    finish_shader_stage(index);
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &info_log_length);
+    if(info_log_length > 0) {
+        char error_message_buffer[info_log_length];
+        glGetProgramInfoLog(program, info_log_length, NULL, error_message_buffer);
+        log_error_message("%s: %s\n", stage->path, error_message_buffer);
+    }
+    glDetachShader(program, stage->shader);
+
+    ++program_pipeline_stats.separable_links;
+    program_pipeline_stats.separable_link_ms += ms;
+    log_debug_message("Linked separable %s stage %s in %.2f ms\n", shader_type_name(stage->type),
+                      stage->path, ms);
+
+    stage->separable_finished = true;
+    stage->separable_failed   = !result;
+    if(result) {
+        reflect_program_uniforms(program);
+        store_stage_program_binary(stage->type, stage->content_hash, program);
+    }
+    return result;
+}
+
+static ProgramPipelineEntry*
+find_program_pipeline_entry(u32 pipeline) {
+    for(u32 i = 0; i < MAX_PROGRAM_PIPELINES; ++i) {
+        if(program_pipelines[i].pipeline == pipeline) {
+            return &program_pipelines[i];
+        }
+    }
+    return 0;
+}
+
+// Creates a pipeline for the stages, which takes over the references the
+// caller acquired. Returns 0 and releases them if it can't be created.
+static u32
+begin_program_pipeline(const i32* stages, u32 stage_count) {
+    assert(stage_count <= MAX_PROGRAM_STAGES);
+
+    ProgramPipelineEntry* entry = find_program_pipeline_entry(0);
+    b32 stages_valid = true;
+    for(u32 i = 0; i < stage_count; ++i) {
+        stages_valid = stages_valid && stages[i] >= 0;
+    }
+    if(!entry || !stages_valid) {
+        if(!entry) {
+            log_error_message("Too many program pipelines\n");
+        }
+        for(u32 i = 0; i < stage_count; ++i) {
+            release_shader_stage(stages[i]);
+        }
+        return 0;
+    }
+
+    u32 pipeline = 0;
+    glGenProgramPipelines(1, &pipeline);
+    for(u32 i = 0; i < stage_count; ++i) {
+        begin_separable_stage(stages[i]);
+    }
+
+    entry->pipeline       = pipeline;
+    entry->stage_count    = stage_count;
+    entry->submit_counter = SDL_GetPerformanceCounter();
+    for(u32 i = 0; i < stage_count; ++i) {
+        entry->stages[i] = stages[i];
+    }
+    return pipeline;
+}
+
+// True once every stage program is linked, without waiting
+static b32
+program_pipeline_completed(u32 pipeline) {
+    ProgramPipelineEntry* entry = find_program_pipeline_entry(pipeline);
+    assert(entry);
+    for(u32 i = 0; i < entry->stage_count; ++i) {
+        if(!separable_stage_completed(entry->stages[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void delete_program_pipeline_entry(GLState* gl_state, u32 pipeline);
+
+// Finishes the stage programs and plugs them into the pipeline. Failed
+// pipelines are deleted along with their stage references. Returns false
+// if it failed.
+static b32
+finish_program_pipeline(GLState* gl_state, u32 pipeline) {
+    ProgramPipelineEntry* entry = find_program_pipeline_entry(pipeline);
+    assert(entry);
+    if(entry->assembled) {
+        return true;
+    }
+
+    b32 result = true;
+    for(u32 i = 0; i < entry->stage_count; ++i) {
+        result = finish_separable_stage(entry->stages[i]) && result;
+    }
+    if(!result) {
+        delete_program_pipeline_entry(gl_state, pipeline);
+        return false;
+    }
+
+    for(u32 i = 0; i < entry->stage_count; ++i) {
+        ShaderStage* stage = &shader_stages[entry->stages[i]];
+        glUseProgramStages(pipeline, shader_stage_bit(stage->type), stage->separable_program);
+    }
+    ++program_pipeline_stats.pipelines;
+    log_debug_message("Assembled pipeline %u from %s and %s %.2f ms after submit\n", pipeline,
+                      shader_stages[entry->stages[0]].path,
+                      entry->stage_count > 1 ? shader_stages[entry->stages[1]].path : "nothing",
+                      elapsed_ms(entry->submit_counter));
+
+    entry->assembled = true;
+    return true;
+}
+
+// The first stage program that has the uniform, 0 when none does
+static u32
+pipeline_program_with_uniform(u32 pipeline, UniformName name) {
+    ProgramPipelineEntry* entry = find_program_pipeline_entry(pipeline);
+    if(!entry) {
+        return 0;
+    }
+    for(u32 i = 0; i < entry->stage_count; ++i) {
+        u32 program = shader_stages[entry->stages[i]].separable_program;
+        UniformTable* table = find_uniform_table(program, false);
+        if(table && find_uniform(table, name, false)) {
+            return program;
+        }
+    }
+    return 0;
+}
+
+static void
+delete_program_pipeline_entry(GLState* gl_state, u32 pipeline) {
+    ProgramPipelineEntry* entry = find_program_pipeline_entry(pipeline);
+    if(entry) {
+        for(u32 s = 0; s < entry->stage_count; ++s) {
+            release_shader_stage(entry->stages[s]);
+        }
+        memset(entry, 0, sizeof(*entry));
+    }
+    delete_program_pipeline(gl_state, pipeline);
+}
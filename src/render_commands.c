@@ -0,0 +1,490 @@
+/*
+  Render command buffer.
+
+  Instead of drawing straight away, the frame records draw packets tagged
+  with a 64-bit sort key. On submit the packets are radix sorted by key so
+  that draws sharing a program, vertex array and textures end up next to
+  each other, and binds that would not change anything are skipped.
+
+  Sort key layout, from the most significant bit down:
+    63..60  pass
+    59..50  program
+    49..38  textures
+    37..28  vertex array
+    27..16  mesh within the vertex array
+    15..0   depth, front to back for opaque and back to front for transparent
+
+  Only the low bits of the GL handles end up in the key. A collision just
+  makes the grouping worse, the actual state is compared when submitting.
+  Program pipelines, see program_pipelines.c, go in the program field with
+  its top bit set so they don't group with the program of the same name.
+
+  Every packet carries one model matrix. Runs of packets that share all of
+  their state are drawn as a single instanced draw when merging is on. The
+  per-instance data is written straight into the stream ring buffer on
+  submit, and every vertex array reads its instance attributes from there.
+  Anything that differs per draw rather than per program, like the position
+  dequantization scale, goes into the instance data too so the base instance
+  can fetch it. So does the uv transform of each texture, textures that
+  share an atlas page, see texture_atlas.c, only differ in that and still
+  draw as instances of one draw.
+
+  With multi draw on, consecutive draws that share a program, vertex array
+  and textures are submitted with one glMultiDrawElementsIndirect. Meshes
+  from a MeshPool share their vertex array, so a whole pass of them collapses
+  into one call per program. Contexts without GL 4.3 get the same commands
+  as a loop of glDrawElementsInstancedBaseVertex.
+*/
+
+typedef enum {
+    RENDER_PASS_OPAQUE,
+    RENDER_PASS_TRANSPARENT,
+} RenderPass;
+
+#define MAX_PACKET_TEXTURES 2
+
+// A texture the way a draw samples it, the uv transform scales the
+// texture coordinates by xy and offsets them by zw. Only textures in an
+// atlas page need one, the rest get identity_uv_transform().
+typedef struct {
+    u32 texture;
+    Vec4 uv_transform;
+} TextureBinding;
+
+static inline Vec4
+identity_uv_transform(void) {
+    return vec4(1.0f, 1.0f, 0.0f, 0.0f);
+}
+
+typedef struct {
+    // Either a program or a pipeline, the other one is 0
+    u32 program;
+    u32 pipeline;
+    u32 vao;
+    u32 count;
+    u32 index_type;
+    u32 first_index;
+    i32 base_vertex;
+    u32 textures[MAX_PACKET_TEXTURES];
+    Vec4 uv_transforms[MAX_PACKET_TEXTURES];
+    Vec3 position_scale;
+    Mat4 model;
+} DrawPacket;
+
+// Per-instance vertex attributes, see basic_vertex.glsl
+typedef struct {
+    Mat4 model;
+    Vec4 position_scale;
+    Vec4 uv_transforms[MAX_PACKET_TEXTURES];
+} InstanceData;
+
+// Layout fixed by GL for indirect draws
+typedef struct {
+    u32 count;
+    u32 instance_count;
+    u32 first_index;
+    i32 base_vertex;
+    u32 base_instance;
+} DrawElementsIndirectCommand;
+
+typedef struct {
+    u64 key;
+    u32 index;
+} SortEntry;
+
+typedef struct {
+    u32 packets;
+    u32 draw_calls;
+    u32 multi_draw_calls;
+    u32 program_binds;
+    u32 program_binds_skipped;
+    u32 vao_binds;
+    u32 vao_binds_skipped;
+    u32 texture_binds;
+    u32 texture_binds_skipped;
+} RenderCommandStats;
+
+typedef struct {
+    DrawPacket* packets;
+    SortEntry* sort_entries;
+    SortEntry* sort_scratch;
+    u32 packet_count;
+    u32 packet_capacity;
+
+    // One per run of instanced packets, along with the packet it came from
+    DrawElementsIndirectCommand* draws;
+    u32* draw_packets;
+
+    b32 merge_instances;
+    b32 multi_draw;
+
+    RenderCommandStats stats;
+} RenderCommandBuffer;
+
+// basic_vertex.glsl reads the model matrix as a per-instance mat4 attribute,
+// which takes up four consecutive attribute locations starting from this one.
+#define INSTANCE_MODEL_LOCATION 2
+#define INSTANCE_POSITION_SCALE_LOCATION 6
+// One per texture unit, after the per-vertex attributes
+#define INSTANCE_UV_TRANSFORM_LOCATION 9
+
+// Expects the vertex array to be bound already
+static void
+point_instance_attributes(RenderContext* render_context, u32 instance_buffer, size_t offset) {
+    bind_buffer(&render_context->gl_state, GL_ARRAY_BUFFER, instance_buffer);
+    for(u32 column = 0; column < 4; ++column) {
+        u32 location = INSTANCE_MODEL_LOCATION + column;
+        glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                              (void*)(offset + offsetof(InstanceData, model) + column * sizeof(Vec4)));
+    }
+    glVertexAttribPointer(INSTANCE_POSITION_SCALE_LOCATION, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                          (void*)(offset + offsetof(InstanceData, position_scale)));
+    for(u32 unit = 0; unit < MAX_PACKET_TEXTURES; ++unit) {
+        glVertexAttribPointer(INSTANCE_UV_TRANSFORM_LOCATION + unit, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                              (void*)(offset + offsetof(InstanceData, uv_transforms) + unit * sizeof(Vec4)));
+    }
+}
+
+// Points the vertex array at the start of the stream ring buffer, submits
+// pick the slice with the base instance.
+static void
+setup_instance_attributes(RenderContext* render_context, u32 vao) {
+    bind_vertex_array(&render_context->gl_state, vao);
+    point_instance_attributes(render_context, render_context->stream_buffer.buffer, 0);
+    for(u32 location = INSTANCE_MODEL_LOCATION; location <= INSTANCE_POSITION_SCALE_LOCATION; ++location) {
+        glVertexAttribDivisor(location, 1);
+        glEnableVertexAttribArray(location);
+    }
+    for(u32 unit = 0; unit < MAX_PACKET_TEXTURES; ++unit) {
+        glVertexAttribDivisor(INSTANCE_UV_TRANSFORM_LOCATION + unit, 1);
+        glEnableVertexAttribArray(INSTANCE_UV_TRANSFORM_LOCATION + unit);
+    }
+}
+
+static void
+init_render_commands(RenderCommandBuffer* commands) {
+    memset(commands, 0, sizeof(*commands));
+    commands->merge_instances = true;
+    commands->multi_draw = true;
+}
+
+static void
+free_render_commands(RenderCommandBuffer* commands) {
+    free(commands->packets);
+    free(commands->sort_entries);
+    free(commands->sort_scratch);
+    free(commands->draws);
+    free(commands->draw_packets);
+    memset(commands, 0, sizeof(*commands));
+}
+
+static inline void
+begin_render_commands(RenderCommandBuffer* commands) {
+    commands->packet_count = 0;
+    memset(&commands->stats, 0, sizeof(commands->stats));
+}
+
+static inline u64
+make_sort_key(RenderPass pass, u32 program, Mesh mesh, const TextureBinding* textures, f32 depth) {
+    u32 texture_bits = 0;
+    if(textures) {
+        texture_bits = textures[0].texture ^ (textures[1].texture << 6);
+    }
+
+    u32 mesh_bits = hash_u32(mesh.first_index ^ ((u32)mesh.base_vertex << 16));
+
+    // depth is expected to be normalized to [0, 1]
+    u32 depth_bits = (u32)(clamp(depth, 0.0f, 1.0f) * (f32)0xffff);
+    if(pass == RENDER_PASS_TRANSPARENT) {
+        depth_bits = 0xffff - depth_bits;
+    }
+
+    u64 key = 0;
+    key |= (u64)(pass & 0xf)                 << 60;
+    key |= (u64)(program & 0x3ff)            << 50;
+    key |= (u64)(texture_bits & 0xfff)       << 38;
+    key |= (u64)(mesh.vao & 0x3ff)           << 28;
+    key |= (u64)(mesh_bits & 0xfff)          << 16;
+    key |= (u64)depth_bits;
+    return key;
+}
+
+static void
+push_draw_command(RenderCommandBuffer* commands, RenderPass pass, Mesh mesh,
+                  const TextureBinding* textures, f32 depth, Mat4 model) {
+    if(commands->packet_count == commands->packet_capacity) {
+        u32 capacity = commands->packet_capacity ? commands->packet_capacity * 2 : 256;
+        commands->packets      = realloc(commands->packets, capacity * sizeof(DrawPacket));
+        commands->sort_entries = realloc(commands->sort_entries, capacity * sizeof(SortEntry));
+        commands->sort_scratch = realloc(commands->sort_scratch, capacity * sizeof(SortEntry));
+        commands->draws        = realloc(commands->draws, capacity * sizeof(DrawElementsIndirectCommand));
+        commands->draw_packets = realloc(commands->draw_packets, capacity * sizeof(u32));
+        commands->packet_capacity = capacity;
+    }
+
+    // Draws with the fallback program until the mesh's own one is ready
+    u32 pipeline = shader_pipeline_for_drawing(mesh.shader_program);
+    u32 program = pipeline ? 0 : shader_program_for_drawing(mesh.shader_program);
+
+    u32 index = commands->packet_count++;
+    DrawPacket* packet = &commands->packets[index];
+    packet->program      = program;
+    packet->pipeline     = pipeline;
+    packet->vao          = mesh.vao;
+    packet->count        = mesh.count;
+    packet->index_type   = mesh.index_type;
+    packet->first_index  = mesh.first_index;
+    packet->base_vertex  = mesh.base_vertex;
+    packet->position_scale = mesh.position_scale;
+    packet->model        = model;
+    for(u32 unit = 0; unit < MAX_PACKET_TEXTURES; ++unit) {
+        packet->textures[unit]      = textures ? textures[unit].texture : 0;
+        packet->uv_transforms[unit] = textures ? textures[unit].uv_transform : identity_uv_transform();
+    }
+
+    u32 program_bits = pipeline ? (pipeline | 0x200) : program;
+    commands->sort_entries[index].key   = make_sort_key(pass, program_bits, mesh, textures, depth);
+    commands->sort_entries[index].index = index;
+}
+
+// LSD radix sort, 8 bits per pass. Stable, and passes where every key has
+// the same digit are skipped, which is most of them for a typical frame.
+static void
+radix_sort_entries(SortEntry* entries, SortEntry* scratch, u32 count) {
+    if(count < 2) {
+        return;
+    }
+
+    SortEntry* source = entries;
+    SortEntry* destination = scratch;
+    for(u32 shift = 0; shift < 64; shift += 8) {
+        u32 offsets[256] = {0};
+        for(u32 i = 0; i < count; ++i) {
+            ++offsets[(source[i].key >> shift) & 0xff];
+        }
+        if(offsets[(source[0].key >> shift) & 0xff] == count) {
+            continue;
+        }
+
+        u32 total = 0;
+        for(u32 digit = 0; digit < 256; ++digit) {
+            u32 digit_count = offsets[digit];
+            offsets[digit] = total;
+            total += digit_count;
+        }
+        for(u32 i = 0; i < count; ++i) {
+            destination[offsets[(source[i].key >> shift) & 0xff]++] = source[i];
+        }
+
+        SortEntry* temp = source;
+        source = destination;
+        destination = temp;
+    }
+
+    if(source != entries) {
+        memcpy(entries, source, count * sizeof(SortEntry));
+    }
+}
+
+// Packets that can be drawn as instances of one draw
+static inline b32
+packets_share_state(DrawPacket* a, DrawPacket* b) {
+    b32 result = a->program == b->program &&
+                 a->pipeline == b->pipeline &&
+                 a->vao == b->vao &&
+                 a->count == b->count &&
+                 a->index_type == b->index_type &&
+                 a->first_index == b->first_index &&
+                 a->base_vertex == b->base_vertex &&
+                 memcmp(a->textures, b->textures, sizeof(a->textures)) == 0;
+    return result;
+}
+
+// Draws that can go into one multi draw
+static inline b32
+packets_share_bindings(DrawPacket* a, DrawPacket* b) {
+    b32 result = a->program == b->program &&
+                 a->pipeline == b->pipeline &&
+                 a->vao == b->vao &&
+                 a->index_type == b->index_type &&
+                 memcmp(a->textures, b->textures, sizeof(a->textures)) == 0;
+    return result;
+}
+
+static inline u32
+index_size(u32 index_type) {
+    return index_type == GL_UNSIGNED_SHORT ? sizeof(u16) : sizeof(u32);
+}
+
+static void
+draw_direct(RenderContext* render_context, DrawPacket* packet, DrawElementsIndirectCommand* draw,
+            u32 instance_buffer) {
+    if(!GLEW_ARB_base_instance) {
+        // GL 3.3 has no base instance, so point the attributes at the run instead
+        point_instance_attributes(render_context, instance_buffer, draw->base_instance * sizeof(InstanceData));
+    }
+
+    if(packet->index_type) {
+        void* indices = (void*)(size_t)(draw->first_index * index_size(packet->index_type));
+        if(GLEW_ARB_base_instance) {
+            glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, draw->count, packet->index_type, indices,
+                                                          draw->instance_count, draw->base_vertex,
+                                                          draw->base_instance);
+        } else {
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES, draw->count, packet->index_type, indices,
+                                              draw->instance_count, draw->base_vertex);
+        }
+    } else {
+        if(GLEW_ARB_base_instance) {
+            glDrawArraysInstancedBaseInstance(GL_TRIANGLES, draw->base_vertex, draw->count,
+                                              draw->instance_count, draw->base_instance);
+        } else {
+            glDrawArraysInstanced(GL_TRIANGLES, draw->base_vertex, draw->count, draw->instance_count);
+        }
+    }
+    ++render_context->draw_calls;
+}
+
+static void
+submit_render_commands(RenderContext* render_context, RenderCommandBuffer* commands) {
+    u32 count = commands->packet_count;
+    RenderCommandStats* stats = &commands->stats;
+    stats->packets = count;
+    if(!count) {
+        return;
+    }
+
+    radix_sort_entries(commands->sort_entries, commands->sort_scratch, count);
+
+    // Gather the instance data in sorted order so every run of packets
+    // reads a contiguous range of it. Aligning the slice to a whole
+    // instance lets the base instance address it.
+    GLState* gl_state = &render_context->gl_state;
+    RingBuffer* ring = &render_context->stream_buffer;
+    RingAllocation instance_allocation = ring_buffer_alloc(gl_state, ring, count * sizeof(InstanceData),
+                                                           sizeof(InstanceData));
+    if(!instance_allocation.data) {
+        log_error_message("Dropping %u draw packets\n", count);
+        return;
+    }
+    InstanceData* instances = (InstanceData*)instance_allocation.data;
+    u32 first_instance = instance_allocation.offset / sizeof(InstanceData);
+
+    u32 draw_count = 0;
+    u32 run_start = 0;
+    while(run_start < count) {
+        DrawPacket* packet = &commands->packets[commands->sort_entries[run_start].index];
+
+        u32 run_end = run_start + 1;
+        if(commands->merge_instances) {
+            while(run_end < count &&
+                  packets_share_state(packet, &commands->packets[commands->sort_entries[run_end].index])) {
+                ++run_end;
+            }
+        }
+
+        for(u32 i = run_start; i < run_end; ++i) {
+            DrawPacket* instance_packet = &commands->packets[commands->sort_entries[i].index];
+            instances[i].model = instance_packet->model;
+            instances[i].position_scale = vec4(instance_packet->position_scale.x,
+                                               instance_packet->position_scale.y,
+                                               instance_packet->position_scale.z, 0.0f);
+            memcpy(instances[i].uv_transforms, instance_packet->uv_transforms, sizeof(instances[i].uv_transforms));
+        }
+
+        DrawElementsIndirectCommand* draw = &commands->draws[draw_count];
+        draw->count          = packet->count;
+        draw->instance_count = run_end - run_start;
+        draw->first_index    = packet->first_index;
+        draw->base_vertex    = packet->base_vertex;
+        draw->base_instance  = first_instance + run_start;
+        commands->draw_packets[draw_count] = commands->sort_entries[run_start].index;
+        ++draw_count;
+
+        run_start = run_end;
+    }
+
+    b32 multi_draw = commands->multi_draw && (GLEW_VERSION_4_3 || GLEW_ARB_multi_draw_indirect);
+    RingAllocation indirect_allocation = {0};
+    if(multi_draw) {
+        u32 size = draw_count * sizeof(DrawElementsIndirectCommand);
+        indirect_allocation = ring_buffer_alloc(gl_state, ring, size, sizeof(u32));
+        if(indirect_allocation.data) {
+            memcpy(indirect_allocation.data, commands->draws, size);
+        } else {
+            multi_draw = false;
+        }
+    }
+
+    flush_ring_buffer(gl_state, ring);
+
+    u32 batch_start = 0;
+    while(batch_start < draw_count) {
+        DrawPacket* packet = &commands->packets[commands->draw_packets[batch_start]];
+
+        // Without multi draw every draw is its own batch, we still share
+        // the binds and loop over the draws when there's no GL 4.3.
+        u32 batch_end = batch_start + 1;
+        if(commands->multi_draw) {
+            while(batch_end < draw_count &&
+                  packets_share_bindings(packet, &commands->packets[commands->draw_packets[batch_end]])) {
+                ++batch_end;
+            }
+        }
+
+        b32 program_bound = use_program(gl_state, packet->program);
+        if(packet->pipeline) {
+            // Only used with no program current, which use_program just made sure of
+            program_bound = bind_program_pipeline(gl_state, packet->pipeline) || program_bound;
+        }
+        if(program_bound) {
+            ++stats->program_binds;
+        } else {
+            ++stats->program_binds_skipped;
+        }
+
+        if(bind_vertex_array(gl_state, packet->vao)) {
+            ++stats->vao_binds;
+        } else {
+            ++stats->vao_binds_skipped;
+        }
+
+        for(u32 unit = 0; unit < MAX_PACKET_TEXTURES; ++unit) {
+            // Units the packet doesn't use are left alone
+            if(!packet->textures[unit]) {
+                continue;
+            }
+            if(bind_texture_2d(gl_state, unit, packet->textures[unit])) {
+                ++stats->texture_binds;
+            } else {
+                ++stats->texture_binds_skipped;
+            }
+        }
+
+        if(multi_draw && packet->index_type) {
+            bind_buffer(gl_state, GL_DRAW_INDIRECT_BUFFER, indirect_allocation.buffer);
+            size_t offset = indirect_allocation.offset + batch_start * sizeof(DrawElementsIndirectCommand);
+            glMultiDrawElementsIndirect(GL_TRIANGLES, packet->index_type, (void*)offset,
+                                        batch_end - batch_start, 0);
+            ++render_context->draw_calls;
+            ++stats->multi_draw_calls;
+            stats->draw_calls += batch_end - batch_start;
+        } else {
+            for(u32 i = batch_start; i < batch_end; ++i) {
+                draw_direct(render_context, &commands->packets[commands->draw_packets[i]],
+                            &commands->draws[i], instance_allocation.buffer);
+                ++stats->draw_calls;
+            }
+        }
+
+        batch_start = batch_end;
+    }
+}
+
+static inline u32
+state_changes_avoided(RenderCommandStats* stats) {
+    u32 result = stats->program_binds_skipped +
+                 stats->vao_binds_skipped +
+                 stats->texture_binds_skipped;
+    return result;
+}
@@ -0,0 +1,168 @@
+/*
+  Ring buffer for streaming per-frame data.
+
+  One big buffer split into RING_BUFFER_FRAMES regions, one per frame in
+  flight. Subsystems bump allocate aligned slices from the current frame's
+  region, write into them and bind the returned offset. A fence goes in
+  after each frame's draws and the region isn't reused until the GPU has
+  passed it, so nothing gets allocated or orphaned in steady state.
+
+  With ARB_buffer_storage the buffer is persistently mapped. On plain GL 3.3
+  the free part of the region is mapped with glMapBufferRange, unsynchronized
+  since the fences already keep us off data in use, and unmapped by
+  flush_ring_buffer before drawing.
+
+  The frame flow is:
+    begin_ring_buffer_frame
+    ring_buffer_alloc, any number of times
+    flush_ring_buffer, before any draw reading the data
+    end_ring_buffer_frame, after the last draw
+*/
+
+#define RING_BUFFER_FRAMES 3
+
+typedef struct {
+    u32 bytes_allocated;
+    u32 peak_frame_bytes;
+    u32 failed_allocations;
+    u32 fence_waits;
+} RingBufferStats;
+
+typedef struct {
+    u32 buffer;
+    b32 persistent;
+    u8* mapped;
+
+    u32 frame_size;
+    u32 frame;
+    u32 head;
+    // Start of the current glMapBufferRange mapping within the frame region
+    u32 mapped_start;
+
+    GLsync fences[RING_BUFFER_FRAMES];
+
+    RingBufferStats stats;
+} RingBuffer;
+
+typedef struct {
+    // 0 when the frame region is full
+    void* data;
+    u32 buffer;
+    u32 offset;
+} RingAllocation;
+
+static void
+init_ring_buffer(GLState* gl_state, RingBuffer* ring, u32 frame_size) {
+    memset(ring, 0, sizeof(*ring));
+    ring->frame_size = frame_size;
+    u32 size = frame_size * RING_BUFFER_FRAMES;
+
+    glGenBuffers(1, &ring->buffer);
+    bind_buffer(gl_state, GL_ARRAY_BUFFER, ring->buffer);
+
+    if(GLEW_ARB_buffer_storage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, size, 0, flags);
+        ring->mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+        ring->persistent = ring->mapped != 0;
+    }
+    if(!ring->persistent) {
+        glBufferData(GL_ARRAY_BUFFER, size, 0, GL_STREAM_DRAW);
+    }
+
+    log_debug_message("Ring buffer: %u bytes per frame, %s\n", frame_size,
+                      ring->persistent ? "persistently mapped" : "mapped per frame");
+}
+
+static void
+free_ring_buffer(GLState* gl_state, RingBuffer* ring) {
+    for(u32 i = 0; i < RING_BUFFER_FRAMES; ++i) {
+        if(ring->fences[i]) {
+            glDeleteSync(ring->fences[i]);
+        }
+    }
+    if(ring->mapped) {
+        bind_buffer(gl_state, GL_ARRAY_BUFFER, ring->buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+    delete_buffer(gl_state, ring->buffer);
+    memset(ring, 0, sizeof(*ring));
+}
+
+static void
+begin_ring_buffer_frame(RingBuffer* ring) {
+    ring->frame = (ring->frame + 1) % RING_BUFFER_FRAMES;
+    ring->head = 0;
+    ring->stats.bytes_allocated = 0;
+
+    GLsync fence = ring->fences[ring->frame];
+    if(fence) {
+        GLenum result = glClientWaitSync(fence, 0, 0);
+        if(result == GL_TIMEOUT_EXPIRED) {
+            ++ring->stats.fence_waits;
+            do {
+                result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+            } while(result == GL_TIMEOUT_EXPIRED);
+        }
+        glDeleteSync(fence);
+        ring->fences[ring->frame] = 0;
+    }
+}
+
+static RingAllocation
+ring_buffer_alloc(GLState* gl_state, RingBuffer* ring, u32 size, u32 alignment) {
+    RingAllocation result = {0};
+
+    // The offset within the whole buffer is what gets bound, and frame_size
+    // is no multiple of anything, so that's what gets aligned
+    u32 region_start = ring->frame * ring->frame_size;
+    u32 head = (region_start + ring->head + alignment - 1) / alignment * alignment - region_start;
+    if(head + size > ring->frame_size) {
+        ++ring->stats.failed_allocations;
+        log_error_message("Ring buffer out of space, %u bytes requested\n", size);
+        return result;
+    }
+
+    if(!ring->persistent && !ring->mapped) {
+        // Map everything that is still free in the region
+        bind_buffer(gl_state, GL_ARRAY_BUFFER, ring->buffer);
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+        ring->mapped_start = head;
+        ring->mapped = glMapBufferRange(GL_ARRAY_BUFFER, region_start + head,
+                                        ring->frame_size - head, flags);
+        if(!ring->mapped) {
+            ++ring->stats.failed_allocations;
+            log_error_message("Couldn't map the ring buffer\n");
+            return result;
+        }
+    }
+
+    if(ring->persistent) {
+        result.data = ring->mapped + region_start + head;
+    } else {
+        result.data = ring->mapped + (head - ring->mapped_start);
+    }
+    result.buffer = ring->buffer;
+    result.offset = region_start + head;
+
+    ring->head = head + size;
+    ring->stats.bytes_allocated = ring->head;
+    ring->stats.peak_frame_bytes = max(ring->stats.peak_frame_bytes, ring->head);
+    return result;
+}
+
+static void
+flush_ring_buffer(GLState* gl_state, RingBuffer* ring) {
+    // Persistent mappings are coherent, nothing to do
+    if(!ring->persistent && ring->mapped) {
+        bind_buffer(gl_state, GL_ARRAY_BUFFER, ring->buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        ring->mapped = 0;
+    }
+}
+
+static void
+end_ring_buffer_frame(GLState* gl_state, RingBuffer* ring) {
+    flush_ring_buffer(gl_state, ring);
+    ring->fences[ring->frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
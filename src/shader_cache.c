@@ -0,0 +1,314 @@
+/*
+  Shader stage cache.
+
+  Programs are linked from cached stage objects instead of compiling their
+  sources every time. A stage is keyed by its path and a hash of its
+  contents, so the same file used by several programs gets compiled once,
+  and an edited file becomes a new stage rather than reusing a stale one.
+
+  Stages are reference counted. Every program linked through
+  link_shader_program holds a reference to its stages until
+  delete_shader_program, and a stage's shader object is deleted when the
+  last program using it goes away.
+
+  Compiling and linking are split in two so they can overlap, see
+  async_shaders.c. acquire_shader_stage and begin_link_shader_program only
+  submit the work, nothing waits on the driver until a stage or program is
+  finished, which asks for its status. link_shader_program does both for
+  callers that want the program right away.
+
+  Compiles and links are timed from submission to finish and logged, with
+  totals in shader_cache_stats.
+*/
+
+#define MAX_SHADER_STAGES 64
+#define MAX_SHADER_PROGRAMS 64
+#define MAX_PROGRAM_STAGES 2
+#define MAX_SHADER_PATH_LENGTH 128
+
+typedef struct {
+    GLenum type;
+    char path[MAX_SHADER_PATH_LENGTH];
+    u32 path_hash;
+    u64 content_hash;
+
+    // 0 when the slot is free
+    u32 shader;
+    u32 ref_count;
+
+    // Set once the compile status has been checked
+    b32 finished;
+    b32 failed;
+    u64 submit_counter;
+
+    // The stage on its own as a separable program, see program_pipelines.c
+    u32 separable_program;
+    b32 separable_finished;
+    b32 separable_failed;
+    u64 separable_submit_counter;
+} ShaderStage;
+
+typedef struct {
+    // 0 when the slot is free
+    u32 program;
+    u32 stage_count;
+    u32 stages[MAX_PROGRAM_STAGES];
+
+    b32 linked;
+    u64 submit_counter;
+} ShaderProgramEntry;
+
+typedef struct {
+    u32 compiles;
+    u32 compile_hits;
+    u32 links;
+    f64 compile_ms;
+    f64 link_ms;
+} ShaderCacheStats;
+
+static void log_shader_source_files(void);
+
+static ShaderStage shader_stages[MAX_SHADER_STAGES];
+static ShaderProgramEntry shader_programs[MAX_SHADER_PROGRAMS];
+static ShaderCacheStats shader_cache_stats;
+
+static inline f64
+elapsed_ms(u64 start_counter) {
+    u64 elapsed = SDL_GetPerformanceCounter() - start_counter;
+    return 1000.0 * (f64)elapsed / (f64)SDL_GetPerformanceFrequency();
+}
+
+static const char*
+shader_type_name(GLenum type) {
+    switch(type) {
+        case GL_VERTEX_SHADER: return "vertex";
+        case GL_FRAGMENT_SHADER: return "fragment";
+        case GL_GEOMETRY_SHADER: return "geometry";
+    }
+    return "unknown";
+}
+
+// Returns the index of the stage with one more reference, or -1 when the
+// cache is full. A new stage is only submitted for compilation, errors show
+// up when it is finished.
+static i32
+acquire_shader_stage(GLenum type, const char* path, const char* source, u32 source_length) {
+    u32 path_hash = hash_string_32(path);
+    u64 content_hash = hash_bytes_64(source, source_length);
+
+    i32 free_slot = -1;
+    for(i32 i = 0; i < MAX_SHADER_STAGES; ++i) {
+        ShaderStage* stage = &shader_stages[i];
+        if(!stage->shader) {
+            if(free_slot < 0) {
+                free_slot = i;
+            }
+            continue;
+        }
+        if(stage->type == type && stage->path_hash == path_hash &&
+           stage->content_hash == content_hash && strcmp(stage->path, path) == 0) {
+            ++stage->ref_count;
+            ++shader_cache_stats.compile_hits;
+            return i;
+        }
+    }
+    if(free_slot < 0) {
+        log_error_message("Shader stage cache full, can't compile %s\n", path);
+        return -1;
+    }
+
+    ShaderStage* stage = &shader_stages[free_slot];
+    memset(stage, 0, sizeof(*stage));
+    stage->submit_counter = SDL_GetPerformanceCounter();
+
+    u32 shader = glCreateShader(type);
+    i32 length = source_length;
+    glShaderSource(shader, 1, &source, &length);
+    glCompileShader(shader);
+
+    stage->type         = type;
+    stage->path_hash    = path_hash;
+    stage->content_hash = content_hash;
+    stage->shader       = shader;
+    stage->ref_count    = 1;
+    strncpy(stage->path, path, MAX_SHADER_PATH_LENGTH - 1);
+    return free_slot;
+}
+
+// Checks the compile status, waiting for the compile if it is still going.
+// Returns false if it failed.
+static b32
+finish_shader_stage(i32 index) {
+    ShaderStage* stage = &shader_stages[index];
+    if(stage->finished) {
+        return !stage->failed;
+    }
+
+    i32 result = 0;
+    i32 info_log_length;
+    glGetShaderiv(stage->shader, GL_COMPILE_STATUS, &result);
+    f64 ms = elapsed_ms(stage->submit_counter);
+
+    glGetShaderiv(stage->shader, GL_INFO_LOG_LENGTH, &info_log_length);
+    if(info_log_length > 0) {
+        char error_message_buffer[info_log_length];
+        glGetShaderInfoLog(stage->shader, info_log_length, NULL, error_message_buffer);
+        log_error_message("%s: %s\n", stage->path, error_message_buffer);
+        if(!result) {
+            // Errors give the source string number of the file they're in
+            log_shader_source_files();
+        }
+    }
+
+    ++shader_cache_stats.compiles;
+    shader_cache_stats.compile_ms += ms;
+    log_debug_message("Compiled %s shader %s in %.2f ms\n", shader_type_name(stage->type), stage->path, ms);
+
+    stage->finished = true;
+    stage->failed   = !result;
+    return !stage->failed;
+}
+
+static void
+release_shader_stage(i32 index) {
+    if(index < 0) {
+        return;
+    }
+    ShaderStage* stage = &shader_stages[index];
+    assert(stage->shader && stage->ref_count > 0);
+    if(--stage->ref_count == 0) {
+        if(stage->separable_program) {
+            remove_uniform_table(stage->separable_program);
+            glDeleteProgram(stage->separable_program);
+        }
+        glDeleteShader(stage->shader);
+        memset(stage, 0, sizeof(*stage));
+    }
+}
+
+static ShaderProgramEntry*
+find_shader_program_entry(u32 program) {
+    for(u32 i = 0; i < MAX_SHADER_PROGRAMS; ++i) {
+        if(shader_programs[i].program == program) {
+            return &shader_programs[i];
+        }
+    }
+    return 0;
+}
+
+// Submits the link of a new program, which takes over the references the
+// caller acquired. Returns 0 and releases them if it can't be submitted.
+static u32
+begin_link_shader_program(const i32* stages, u32 stage_count) {
+    assert(stage_count <= MAX_PROGRAM_STAGES);
+
+    ShaderProgramEntry* entry = find_shader_program_entry(0);
+    b32 stages_valid = true;
+    for(u32 i = 0; i < stage_count; ++i) {
+        stages_valid = stages_valid && stages[i] >= 0;
+    }
+    if(!entry || !stages_valid) {
+        if(!entry) {
+            log_error_message("Too many shader programs\n");
+        }
+        for(u32 i = 0; i < stage_count; ++i) {
+            release_shader_stage(stages[i]);
+        }
+        return 0;
+    }
+
+    u64 start = SDL_GetPerformanceCounter();
+    u32 program_id = glCreateProgram();
+    if(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary) {
+        // Lets the driver keep what glGetProgramBinary needs, see program_binary_cache.c
+        glProgramParameteri(program_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    for(u32 i = 0; i < stage_count; ++i) {
+        glAttachShader(program_id, shader_stages[stages[i]].shader);
+    }
+    glLinkProgram(program_id);
+
+    entry->program        = program_id;
+    entry->stage_count    = stage_count;
+    entry->submit_counter = start;
+    for(u32 i = 0; i < stage_count; ++i) {
+        entry->stages[i] = stages[i];
+    }
+    return program_id;
+}
+
+static void delete_shader_program(GLState* gl_state, u32 program);
+
+// Checks the link status, waiting for the link and the compiles before it
+// if they are still going. Failed programs are deleted along with their
+// stage references. Returns false if it failed.
+static b32
+finish_link_shader_program(GLState* gl_state, u32 program) {
+    ShaderProgramEntry* entry = find_shader_program_entry(program);
+    assert(entry);
+    if(entry->linked) {
+        return true;
+    }
+
+    i32 result = 0;
+    i32 info_log_length;
+    glGetProgramiv(program, GL_LINK_STATUS, &result);
+    f64 ms = elapsed_ms(entry->submit_counter);
+
+    // Reports compile errors, the link already waited for the compiles
+    for(u32 i = 0; i < entry->stage_count; ++i) {
+        finish_shader_stage(entry->stages[i]);
+    }
+
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &info_log_length);
+    if(info_log_length > 0) {
+        char error_message_buffer[info_log_length];
+        glGetProgramInfoLog(program, info_log_length, NULL, error_message_buffer);
+        log_error_message("%s\n", error_message_buffer);
+    }
+
+    for(u32 i = 0; i < entry->stage_count; ++i) {
+        glDetachShader(program, shader_stages[entry->stages[i]].shader);
+    }
+
+    ++shader_cache_stats.links;
+    shader_cache_stats.link_ms += ms;
+    log_debug_message("Linked program %u from %s and %s in %.2f ms\n", program,
+                      shader_stages[entry->stages[0]].path,
+                      entry->stage_count > 1 ? shader_stages[entry->stages[1]].path : "nothing", ms);
+
+    if(!result) {
+        delete_shader_program(gl_state, program);
+        return false;
+    }
+
+    entry->linked = true;
+    reflect_program_uniforms(program);
+    return true;
+}
+
+// Compiles and links right away, returns 0 on failure
+static u32
+link_shader_program(GLState* gl_state, const i32* stages, u32 stage_count) {
+    u32 program = begin_link_shader_program(stages, stage_count);
+    if(program && !finish_link_shader_program(gl_state, program)) {
+        program = 0;
+    }
+    return program;
+}
+
+static void
+delete_shader_program(GLState* gl_state, u32 program) {
+    ShaderProgramEntry* entry = find_shader_program_entry(program);
+    if(entry) {
+        for(u32 s = 0; s < entry->stage_count; ++s) {
+            release_shader_stage(entry->stages[s]);
+        }
+        memset(entry, 0, sizeof(*entry));
+    }
+    if(gl_state->program == program) {
+        use_program(gl_state, 0);
+    }
+    remove_uniform_table(program);
+    glDeleteProgram(program);
+}
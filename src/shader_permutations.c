@@ -0,0 +1,397 @@
+/*
+  Shader permutations.
+
+  A shader template is a vertex and fragment source pair that declares the
+  features it can be built with:
+
+    #pragma keywords TEXTURED VERTEX_COLOR
+
+  GLSL ignores pragmas it doesn't know. get_shader_permutation builds the
+  template with a set of those keywords by putting a "#define KEYWORD 1"
+  prologue after the #version line of every stage that declares them, so
+  the shader code switches on them with #ifdef. Each stage only gets the
+  keywords it declares itself, which keeps a vertex stage identical, and
+  shared through the stage cache, across permutations that only differ in
+  fragment features.
+
+  Constants that stay the same for the whole run, like the light color, are
+  set once with set_shader_constant and baked in as "#define NAME value" so
+  the compiler can fold them. They only go into stages that mention them.
+
+  Permutations are compiled lazily, the first time they are asked for, and
+  cached per template by a 64-bit key: the feature mask in the low half and
+  a hash of the constants in the high half.
+
+  reload_shader_template rebuilds every permutation already asked for once
+  a file that went into the template changed. The handles stay the same,
+  so meshes holding one pick up the new program without noticing.
+*/
+
+#define MAX_SHADER_KEYWORDS 16
+#define MAX_SHADER_KEYWORD_LENGTH 32
+#define MAX_SHADER_PERMUTATIONS 32
+#define MAX_SHADER_CONSTANTS 16
+#define MAX_SHADER_CONSTANT_NAME_LENGTH 32
+#define MAX_SHADER_CONSTANT_VALUE_LENGTH 96
+#define MAX_SHADER_PROLOGUE_LENGTH 2048
+
+typedef struct {
+    char name[MAX_SHADER_CONSTANT_NAME_LENGTH];
+    char value[MAX_SHADER_CONSTANT_VALUE_LENGTH];
+} ShaderConstant;
+
+typedef struct {
+    u32 count;
+    ShaderConstant constants[MAX_SHADER_CONSTANTS];
+    u32 hash;
+} ShaderConstants;
+
+typedef struct {
+    u64 key;
+    ShaderHandle handle;
+} ShaderPermutation;
+
+typedef struct {
+    GLenum type;
+    const char* path;
+    // Preprocessed, see shader_preprocessor.c
+    PreprocessedShader preprocessed;
+    const char* source;
+    u32 length;
+    // Keywords this stage declares, as bits of ShaderTemplate.keywords
+    u32 keyword_mask;
+} ShaderTemplateStage;
+
+typedef struct {
+    ShaderTemplateStage stages[2];
+
+    u32 keyword_count;
+    char keywords[MAX_SHADER_KEYWORDS][MAX_SHADER_KEYWORD_LENGTH];
+
+    u32 permutation_count;
+    ShaderPermutation permutations[MAX_SHADER_PERMUTATIONS];
+} ShaderTemplate;
+
+static ShaderConstants shader_constants;
+
+static void
+set_shader_constant(const char* name, const char* value) {
+    ShaderConstant* constant = 0;
+    for(u32 i = 0; i < shader_constants.count; ++i) {
+        if(strcmp(shader_constants.constants[i].name, name) == 0) {
+            constant = &shader_constants.constants[i];
+            break;
+        }
+    }
+    if(!constant) {
+        if(shader_constants.count == MAX_SHADER_CONSTANTS) {
+            log_error_message("Too many shader constants, %s dropped\n", name);
+            return;
+        }
+        constant = &shader_constants.constants[shader_constants.count++];
+        memset(constant, 0, sizeof(*constant));
+        snprintf(constant->name, sizeof(constant->name), "%s", name);
+    }
+    memset(constant->value, 0, sizeof(constant->value));
+    snprintf(constant->value, sizeof(constant->value), "%s", value);
+
+    // Unused bytes are zeroed, so hashing the whole array is stable
+    u64 hash = hash_bytes_64(shader_constants.constants, shader_constants.count * sizeof(ShaderConstant));
+    shader_constants.hash = (u32)(hash ^ (hash >> 32));
+}
+
+static void
+set_shader_constant_vec3(const char* name, Vec3 value) {
+    char glsl[MAX_SHADER_CONSTANT_VALUE_LENGTH];
+    snprintf(glsl, sizeof(glsl), "vec3(%.9g, %.9g, %.9g)", value.x, value.y, value.z);
+    set_shader_constant(name, glsl);
+}
+
+static inline b32
+is_keyword_char(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static u32
+find_shader_keyword(ShaderTemplate* shader_template, const char* name, u32 length) {
+    for(u32 i = 0; i < shader_template->keyword_count; ++i) {
+        const char* keyword = shader_template->keywords[i];
+        if(strncmp(keyword, name, length) == 0 && keyword[length] == 0) {
+            return i;
+        }
+    }
+    return MAX_SHADER_KEYWORDS;
+}
+
+// Collects the keywords of every "#pragma keywords" line in the stage
+static void
+parse_shader_keywords(ShaderTemplate* shader_template, ShaderTemplateStage* stage) {
+    const char* directive = "#pragma keywords";
+    u32 directive_length = (u32)strlen(directive);
+
+    const char* end = stage->source + stage->length;
+    const char* line = stage->source;
+    while(line < end) {
+        const char* at = line;
+        while(at < end && (*at == ' ' || *at == '\t')) {
+            ++at;
+        }
+        const char* line_end = memchr(at, '\n', end - at);
+        if(!line_end) {
+            line_end = end;
+        }
+
+        if((u32)(line_end - at) > directive_length && strncmp(at, directive, directive_length) == 0) {
+            at += directive_length;
+            while(at < line_end) {
+                while(at < line_end && !is_keyword_char(*at)) {
+                    ++at;
+                }
+                const char* word = at;
+                while(at < line_end && is_keyword_char(*at)) {
+                    ++at;
+                }
+                u32 length = (u32)(at - word);
+                if(!length) {
+                    continue;
+                }
+                if(length >= MAX_SHADER_KEYWORD_LENGTH) {
+                    log_error_message("Shader keyword too long in %s\n", stage->path);
+                    continue;
+                }
+
+                u32 index = find_shader_keyword(shader_template, word, length);
+                if(index == MAX_SHADER_KEYWORDS) {
+                    if(shader_template->keyword_count == MAX_SHADER_KEYWORDS) {
+                        log_error_message("Too many shader keywords in %s\n", stage->path);
+                        continue;
+                    }
+                    index = shader_template->keyword_count++;
+                    memcpy(shader_template->keywords[index], word, length);
+                    shader_template->keywords[index][length] = 0;
+                }
+                stage->keyword_mask |= 1u << index;
+            }
+        }
+        line = line_end + 1;
+    }
+}
+
+static b32
+load_shader_template(ShaderTemplate* shader_template, const char* vertex_shader_path, const char* fragment_shader_path) {
+    memset(shader_template, 0, sizeof(*shader_template));
+    shader_template->stages[0].type = GL_VERTEX_SHADER;
+    shader_template->stages[0].path = vertex_shader_path;
+    shader_template->stages[1].type = GL_FRAGMENT_SHADER;
+    shader_template->stages[1].path = fragment_shader_path;
+
+    for(u32 i = 0; i < array_count(shader_template->stages); ++i) {
+        ShaderTemplateStage* stage = &shader_template->stages[i];
+        if(!preprocess_shader(stage->path, &stage->preprocessed)) {
+            return false;
+        }
+        stage->source = stage->preprocessed.text;
+        stage->length = stage->preprocessed.length;
+        parse_shader_keywords(shader_template, stage);
+    }
+    return true;
+}
+
+static void
+free_shader_template(ShaderTemplate* shader_template) {
+    for(u32 i = 0; i < array_count(shader_template->stages); ++i) {
+        free_preprocessed_shader(&shader_template->stages[i].preprocessed);
+    }
+    memset(shader_template, 0, sizeof(*shader_template));
+}
+
+// Bit to or into a feature mask, 0 if the template doesn't have the keyword
+static u32
+shader_keyword(ShaderTemplate* shader_template, const char* name) {
+    u32 index = find_shader_keyword(shader_template, name, (u32)strlen(name));
+    if(index == MAX_SHADER_KEYWORDS) {
+        log_error_message("%s doesn't have the %s keyword\n", shader_template->stages[1].path, name);
+        return 0;
+    }
+    return 1u << index;
+}
+
+// Returns the stage source with the prologue for the permutation, to be freed
+static char*
+build_permutation_source(ShaderTemplate* shader_template, ShaderTemplateStage* stage,
+                         u32 feature_mask, u32* length) {
+    char prologue[MAX_SHADER_PROLOGUE_LENGTH];
+    u32 prologue_length = 0;
+
+    u32 stage_features = feature_mask & stage->keyword_mask;
+    for(u32 i = 0; i < shader_template->keyword_count; ++i) {
+        if(stage_features & (1u << i)) {
+            prologue_length += snprintf(prologue + prologue_length, sizeof(prologue) - prologue_length,
+                                        "#define %s 1\n", shader_template->keywords[i]);
+        }
+    }
+    for(u32 i = 0; i < shader_constants.count; ++i) {
+        ShaderConstant* constant = &shader_constants.constants[i];
+        if(strstr(stage->source, constant->name)) {
+            prologue_length += snprintf(prologue + prologue_length, sizeof(prologue) - prologue_length,
+                                        "#define %s %s\n", constant->name, constant->value);
+        }
+    }
+    assert(prologue_length < sizeof(prologue));
+
+    // Nothing may come before #version, so the prologue goes right after
+    // it and #line puts the line numbers in error messages back. The
+    // preprocessor's own #line right after takes over from there.
+    u32 split = 0;
+    u32 line = 1;
+    if(stage->length >= 8 && strncmp(stage->source, "#version", 8) == 0) {
+        const char* version_end = memchr(stage->source, '\n', stage->length);
+        split = version_end ? (u32)(version_end - stage->source) + 1 : stage->length;
+        line = 2;
+    }
+    prologue_length += snprintf(prologue + prologue_length, sizeof(prologue) - prologue_length,
+                                "#line %u\n", line);
+
+    *length = stage->length + prologue_length;
+    char* source = malloc(*length);
+    memcpy(source, stage->source, split);
+    memcpy(source + split, prologue, prologue_length);
+    memcpy(source + split + prologue_length, stage->source + split, stage->length - split);
+    return source;
+}
+
+static inline u64
+shader_sources_binary_key(const char* vertex_shader_source, u32 vertex_shader_length,
+                          const char* fragment_shader_source, u32 fragment_shader_length) {
+    return program_binary_key(hash_bytes_64(vertex_shader_source, vertex_shader_length),
+                              hash_bytes_64(fragment_shader_source, fragment_shader_length));
+}
+
+// Program from the binary cache if it's there, otherwise submitted for an
+// asynchronous build through the stage cache
+static ShaderHandle
+submit_shader_sources(const char* vertex_shader_path, const char* vertex_shader_source, u32 vertex_shader_length,
+                      const char* fragment_shader_path, const char* fragment_shader_source, u32 fragment_shader_length) {
+    u64 binary_key = shader_sources_binary_key(vertex_shader_source, vertex_shader_length,
+                                               fragment_shader_source, fragment_shader_length);
+    u32 program = load_program_binary(binary_key);
+    if(program) {
+        return add_ready_shader_program(program);
+    }
+
+    i32 stages[2];
+    stages[0] = acquire_shader_stage(GL_VERTEX_SHADER, vertex_shader_path,
+                                     vertex_shader_source, vertex_shader_length);
+    stages[1] = acquire_shader_stage(GL_FRAGMENT_SHADER, fragment_shader_path,
+                                     fragment_shader_source, fragment_shader_length);
+    return submit_shader_program(stages, array_count(stages), binary_key);
+}
+
+static ShaderHandle
+get_shader_permutation(ShaderTemplate* shader_template, u32 feature_mask) {
+    u64 key = ((u64)shader_constants.hash << 32) | feature_mask;
+    for(u32 i = 0; i < shader_template->permutation_count; ++i) {
+        if(shader_template->permutations[i].key == key) {
+            return shader_template->permutations[i].handle;
+        }
+    }
+    if(shader_template->permutation_count == MAX_SHADER_PERMUTATIONS) {
+        log_error_message("Too many permutations of %s\n", shader_template->stages[1].path);
+        return 0;
+    }
+
+    u32 vertex_length;
+    u32 fragment_length;
+    char* vertex_source = build_permutation_source(shader_template, &shader_template->stages[0],
+                                                   feature_mask, &vertex_length);
+    char* fragment_source = build_permutation_source(shader_template, &shader_template->stages[1],
+                                                     feature_mask, &fragment_length);
+    ShaderHandle handle = submit_shader_sources(shader_template->stages[0].path, vertex_source, vertex_length,
+                                                shader_template->stages[1].path, fragment_source, fragment_length);
+    free(vertex_source);
+    free(fragment_source);
+
+    log_debug_message("Permutation %016llx of %s requested\n", (unsigned long long)key,
+                      shader_template->stages[1].path);
+
+    // Failures are cached too, so a broken permutation isn't resubmitted every frame
+    ShaderPermutation* permutation = &shader_template->permutations[shader_template->permutation_count++];
+    permutation->key    = key;
+    permutation->handle = handle;
+    return handle;
+}
+
+// Rebuilds every permutation of the template if any file that went into it
+// changed since it was preprocessed, see update_shader_source_file. The
+// handles keep drawing with their old programs until the new ones are
+// ready, and keep them if the new sources don't build. Returns true if
+// anything was resubmitted.
+static b32
+reload_shader_template(GLState* gl_state, ShaderTemplate* shader_template, u64 change_counter) {
+    b32 stale = false;
+    for(u32 i = 0; i < array_count(shader_template->stages); ++i) {
+        stale = stale || preprocessed_shader_stale(&shader_template->stages[i].preprocessed);
+    }
+    if(!stale) {
+        return false;
+    }
+
+    // Both stages are preprocessed again. One that didn't change comes out
+    // the same and is found in the stage cache.
+    PreprocessedShader preprocessed[array_count(shader_template->stages)];
+    for(u32 i = 0; i < array_count(shader_template->stages); ++i) {
+        if(!preprocess_shader(shader_template->stages[i].path, &preprocessed[i])) {
+            log_error_message("Keeping the previous %s\n", shader_template->stages[i].path);
+            for(u32 j = 0; j < i; ++j) {
+                free_preprocessed_shader(&preprocessed[j]);
+            }
+            return false;
+        }
+    }
+    for(u32 i = 0; i < array_count(shader_template->stages); ++i) {
+        ShaderTemplateStage* stage = &shader_template->stages[i];
+        free_preprocessed_shader(&stage->preprocessed);
+        stage->preprocessed = preprocessed[i];
+        stage->source       = stage->preprocessed.text;
+        stage->length       = stage->preprocessed.length;
+        // Keywords only ever get added, so the feature bits handed out stay valid
+        stage->keyword_mask = 0;
+        parse_shader_keywords(shader_template, stage);
+    }
+
+    for(u32 i = 0; i < shader_template->permutation_count; ++i) {
+        ShaderPermutation* permutation = &shader_template->permutations[i];
+        u32 feature_mask = (u32)permutation->key;
+        u32 vertex_length;
+        u32 fragment_length;
+        char* vertex_source = build_permutation_source(shader_template, &shader_template->stages[0],
+                                                       feature_mask, &vertex_length);
+        char* fragment_source = build_permutation_source(shader_template, &shader_template->stages[1],
+                                                         feature_mask, &fragment_length);
+        const char* vertex_path = shader_template->stages[0].path;
+        const char* fragment_path = shader_template->stages[1].path;
+
+        if(!permutation->handle) {
+            // Never got a handle, it can have a new one
+            permutation->handle = submit_shader_sources(vertex_path, vertex_source, vertex_length,
+                                                        fragment_path, fragment_source, fragment_length);
+        } else {
+            u64 binary_key = shader_sources_binary_key(vertex_source, vertex_length, fragment_source, fragment_length);
+            u32 program = load_program_binary(binary_key);
+            if(program) {
+                reload_ready_shader_program(gl_state, permutation->handle, program, change_counter);
+            } else {
+                i32 stages[2];
+                stages[0] = acquire_shader_stage(GL_VERTEX_SHADER, vertex_path, vertex_source, vertex_length);
+                stages[1] = acquire_shader_stage(GL_FRAGMENT_SHADER, fragment_path, fragment_source, fragment_length);
+                resubmit_shader_program(gl_state, permutation->handle, stages, array_count(stages),
+                                        binary_key, change_counter);
+            }
+        }
+        free(vertex_source);
+        free(fragment_source);
+    }
+    log_debug_message("Rebuilding %u permutations of %s\n", shader_template->permutation_count,
+                      shader_template->stages[1].path);
+    return true;
+}
@@ -0,0 +1,570 @@
+/*
+  GLSL preprocessor.
+
+  Runs over shader sources before they reach the driver:
+    - #include "file" is replaced by the file, resolved relative to the
+      including file. Every file is included at most once per shader, so
+      headers don't need guards. Includes are resolved even inside #ifdef
+      blocks, everything else about conditionals is left to the driver.
+    - Comments and indentation are stripped, tokens are joined with a
+      space only where leaving it out would change their meaning.
+    - Newlines are kept and every file starts with #line, using the file's
+      index in the source file table as the source string number, so
+      driver errors still give the original line. log_shader_source_files
+      prints the table to decode them.
+
+  Sources are tokenized with stb_c_lexer, configured below for GLSL.
+
+  Every file read goes into a dependency graph of content hashes. A
+  preprocessed shader remembers the version of every file it pulled in,
+  so once update_shader_source_file has been told a file changed,
+  preprocessed_shader_stale says exactly which shaders need rebuilding.
+  The program binary cache keys on the preprocessed text, which already
+  changes with any include, but not with comment edits.
+
+  The preprocessed text itself is kept in the derived data cache, keyed
+  by the root file's contents, along with the path and hash of every file
+  it pulled in. It's only used if all of those still match, so a changed
+  include means preprocessing again.
+*/
+
+#define STB_C_LEX_C_DECIMAL_INTS    Y
+#define STB_C_LEX_C_HEX_INTS        Y
+#define STB_C_LEX_C_OCTAL_INTS      Y
+#define STB_C_LEX_C_DECIMAL_FLOATS  Y
+#define STB_C_LEX_C99_HEX_FLOATS    N
+#define STB_C_LEX_C_IDENTIFIERS     Y
+#define STB_C_LEX_C_DQ_STRINGS      Y
+#define STB_C_LEX_C_SQ_STRINGS      N
+#define STB_C_LEX_C_CHARS           N
+#define STB_C_LEX_C_COMMENTS        Y
+#define STB_C_LEX_CPP_COMMENTS      Y
+#define STB_C_LEX_C_COMPARISONS     Y
+#define STB_C_LEX_C_LOGICAL         Y
+#define STB_C_LEX_C_SHIFTS          Y
+#define STB_C_LEX_C_INCREMENTS      Y
+#define STB_C_LEX_C_ARROW           N
+#define STB_C_LEX_EQUAL_ARROW       N
+#define STB_C_LEX_C_BITWISEEQ       Y
+#define STB_C_LEX_C_ARITHEQ         Y
+#define STB_C_LEX_PARSE_SUFFIXES    N
+#define STB_C_LEX_DECIMAL_SUFFIXES  ""
+#define STB_C_LEX_HEX_SUFFIXES      ""
+#define STB_C_LEX_OCTAL_SUFFIXES    ""
+#define STB_C_LEX_FLOAT_SUFFIXES    ""
+#define STB_C_LEX_0_IS_EOF             N
+#define STB_C_LEX_INTEGERS_AS_DOUBLES  N
+#define STB_C_LEX_MULTILINE_DSTRINGS   N
+#define STB_C_LEX_MULTILINE_SSTRINGS   N
+#define STB_C_LEX_USE_STDLIB           Y
+#define STB_C_LEX_DOLLAR_IDENTIFIER    N
+#define STB_C_LEX_FLOAT_NO_DECIMAL     Y
+#define STB_C_LEX_DEFINE_ALL_TOKEN_NAMES  N
+// We need the directives
+#define STB_C_LEX_DISCARD_PREPROCESSOR    N
+#define STB_C_LEXER_DEFINITIONS
+
+#define STB_C_LEXER_IMPLEMENTATION
+#include "stb_c_lexer.h"
+
+#define MAX_SHADER_SOURCE_FILES 64
+#define MAX_SHADER_INCLUDES 16
+#define MAX_SHADER_INCLUDE_DEPTH 8
+// Files pulled into a single preprocessed shader
+#define MAX_PREPROCESSED_FILES 16
+// Bump when preprocessing changes what ends up in the cache
+#define PREPROCESSED_SHADER_VERSION "preprocessed shader 1"
+
+typedef struct {
+    char path[MAX_SHADER_PATH_LENGTH];
+    u64 content_hash;
+    // Bumped whenever the file is read with different contents
+    u32 version;
+    // Files this one includes, the edges of the graph
+    u32 include_count;
+    u32 includes[MAX_SHADER_INCLUDES];
+} ShaderSourceFile;
+
+typedef struct {
+    char* text;
+    u32 length;
+
+    // Every file the text came from, the root first
+    u32 file_count;
+    u32 files[MAX_PREPROCESSED_FILES];
+    u32 file_versions[MAX_PREPROCESSED_FILES];
+} PreprocessedShader;
+
+typedef struct {
+    PreprocessedShader* shader;
+    u32 capacity;
+    // Line the driver will assign to the output line being written
+    u32 line;
+    b32 at_line_start;
+    b32 failed;
+    u32 source_bytes;
+} ShaderPreprocessor;
+
+// How a preprocessed shader is kept in the derived data cache, the text
+// follows
+typedef struct {
+    u32 index;
+    // Bit i is set if this file includes files[i], to rebuild the graph
+    u32 includes;
+    u64 content_hash;
+    char path[MAX_SHADER_PATH_LENGTH];
+} CachedShaderSourceFile;
+
+typedef struct {
+    u32 file_count;
+    u32 length;
+    CachedShaderSourceFile files[MAX_PREPROCESSED_FILES];
+} CachedPreprocessedShader;
+
+static ShaderSourceFile shader_source_files[MAX_SHADER_SOURCE_FILES];
+static u32 shader_source_file_count;
+
+static i32
+find_shader_source_file(const char* path) {
+    for(u32 i = 0; i < shader_source_file_count; ++i) {
+        if(strcmp(shader_source_files[i].path, path) == 0) {
+            return (i32)i;
+        }
+    }
+    return -1;
+}
+
+// Reads the file into a null terminated buffer, which the lexer wants to
+// be able to peek past the last character, and records it in the graph.
+// Returns the file index or -1.
+static i32
+read_shader_source_file(const char* path, char** source, u32* length) {
+    FileContents contents;
+    if(!read_file_contents(path, &contents)) {
+        return -1;
+    }
+    u32 size = (u32)contents.size;
+    *source = malloc(size + 1);
+    memcpy(*source, contents.data, size);
+    (*source)[size] = 0;
+    *length = size;
+    free_file_contents(&contents);
+
+    u64 content_hash = hash_bytes_64(*source, size);
+    i32 index = find_shader_source_file(path);
+    if(index < 0) {
+        if(shader_source_file_count == MAX_SHADER_SOURCE_FILES) {
+            log_error_message("Too many shader source files, can't add %s\n", path);
+            free(*source);
+            return -1;
+        }
+        index = shader_source_file_count++;
+        ShaderSourceFile* file = &shader_source_files[index];
+        memset(file, 0, sizeof(*file));
+        strncpy(file->path, path, MAX_SHADER_PATH_LENGTH - 1);
+        file->content_hash = content_hash;
+    }
+
+    ShaderSourceFile* file = &shader_source_files[index];
+    if(file->content_hash != content_hash) {
+        file->content_hash = content_hash;
+        ++file->version;
+    }
+    return index;
+}
+
+static void
+emit_shader_text(ShaderPreprocessor* preprocessor, const char* text, u32 length) {
+    PreprocessedShader* shader = preprocessor->shader;
+    if(shader->length + length + 1 > preprocessor->capacity) {
+        preprocessor->capacity = max(preprocessor->capacity * 2, shader->length + length + 1);
+        shader->text = realloc(shader->text, preprocessor->capacity);
+    }
+    memcpy(shader->text + shader->length, text, length);
+    shader->length += length;
+    shader->text[shader->length] = 0;
+    if(length) {
+        preprocessor->at_line_start = text[length - 1] == '\n';
+    }
+}
+
+static void
+emit_line_directive(ShaderPreprocessor* preprocessor, u32 line, u32 file_index) {
+    char directive[32];
+    if(!preprocessor->at_line_start) {
+        emit_shader_text(preprocessor, "\n", 1);
+    }
+    u32 length = snprintf(directive, sizeof(directive), "#line %u %u\n", line, file_index);
+    emit_shader_text(preprocessor, directive, length);
+    preprocessor->line = line;
+}
+
+// Keeps the output on the same line number as the source, jumping with
+// #line when many lines were dropped
+static void
+move_to_shader_line(ShaderPreprocessor* preprocessor, u32 line, u32 file_index) {
+    u32 lines = line - preprocessor->line;
+    if(line < preprocessor->line || lines > 8) {
+        emit_line_directive(preprocessor, line, file_index);
+        return;
+    }
+    for(u32 i = 0; i < lines; ++i) {
+        emit_shader_text(preprocessor, "\n", 1);
+    }
+    preprocessor->line = line;
+}
+
+static inline b32
+is_word_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.';
+}
+
+static inline b32
+is_operator_char(char c) {
+    return c && strchr("+-*/%<>=!&|^", c) != 0;
+}
+
+static u32
+count_newlines(const char* start, const char* end) {
+    u32 count = 0;
+    for(const char* at = start; at < end; ++at) {
+        count += *at == '\n';
+    }
+    return count;
+}
+
+static void
+resolve_include_path(const char* including_path, const char* include, char* path, u32 path_size) {
+    const char* slash = strrchr(including_path, '\\');
+    const char* forward_slash = strrchr(including_path, '/');
+    if(!slash || (forward_slash && forward_slash > slash)) {
+        slash = forward_slash;
+    }
+    u32 directory_length = slash ? (u32)(slash - including_path) + 1 : 0;
+    snprintf(path, path_size, "%.*s%s", directory_length, including_path, include);
+}
+
+static void
+add_shader_include_edge(u32 file_index, i32 included) {
+    ShaderSourceFile* file = &shader_source_files[file_index];
+    if(included < 0) {
+        return;
+    }
+    for(u32 i = 0; i < file->include_count; ++i) {
+        if(file->includes[i] == (u32)included) {
+            return;
+        }
+    }
+    if(file->include_count < MAX_SHADER_INCLUDES) {
+        file->includes[file->include_count++] = included;
+    }
+}
+
+static void
+preprocess_shader_file(ShaderPreprocessor* preprocessor, const char* path, u32 depth);
+
+static void
+preprocess_shader_source(ShaderPreprocessor* preprocessor, u32 file_index, char* source, u32 length, u32 depth) {
+    PreprocessedShader* shader = preprocessor->shader;
+    const char* path = shader_source_files[file_index].path;
+
+    // #version has to be the first thing the driver sees, so the root
+    // file's #line goes right after it
+    if(depth > 0) {
+        emit_line_directive(preprocessor, 1, file_index);
+    }
+    b32 after_version = false;
+
+    char string_store[256];
+    stb_lexer lexer;
+    stb_c_lexer_init(&lexer, source, source + length, string_store, sizeof(string_store));
+
+    u32 line = 1;
+    const char* previous_end = source;
+    b32 first_on_line = true;
+    // Counts the tokens of a #define, the space after the macro name is
+    // what makes it object-like rather than function-like
+    u32 define_token = 0;
+    while(stb_c_lexer_get_token(&lexer)) {
+        if(lexer.token == CLEX_parse_error) {
+            stb_lex_location location;
+            stb_c_lexer_get_location(&lexer, lexer.where_firstchar, &location);
+            log_error_message("%s(%d): can't parse shader source\n", path, location.line_number);
+            preprocessor->failed = true;
+            return;
+        }
+
+        const char* token_start = lexer.where_firstchar;
+        const char* token_end = lexer.where_lastchar + 1;
+        b32 gap = token_start != previous_end;
+        u32 newlines = count_newlines(previous_end, token_start);
+        if(newlines) {
+            line += newlines;
+            first_on_line = true;
+            define_token = 0;
+        }
+        if(define_token) {
+            ++define_token;
+        }
+
+        b32 version = false;
+        if(first_on_line && lexer.token == '#') {
+            // Look at the directive name without consuming the real lexer
+            stb_lexer peek = lexer;
+            b32 named = stb_c_lexer_get_token(&peek) && peek.token == CLEX_id;
+            version = named && strcmp(peek.string, "version") == 0;
+            if(named && strcmp(peek.string, "define") == 0) {
+                define_token = 1;
+            }
+
+            if(named && strcmp(peek.string, "include") == 0) {
+                if(!stb_c_lexer_get_token(&peek) || peek.token != CLEX_dqstring) {
+                    log_error_message("%s(%u): #include needs a \"file\"\n", path, line);
+                    preprocessor->failed = true;
+                    return;
+                }
+                if(depth + 1 >= MAX_SHADER_INCLUDE_DEPTH) {
+                    log_error_message("%s(%u): includes nested too deep\n", path, line);
+                    preprocessor->failed = true;
+                    return;
+                }
+                char include_path[MAX_SHADER_PATH_LENGTH];
+                resolve_include_path(path, peek.string, include_path, sizeof(include_path));
+                lexer = peek;
+                previous_end = lexer.where_lastchar + 1;
+
+                preprocess_shader_file(preprocessor, include_path, depth + 1);
+                if(preprocessor->failed) {
+                    log_error_message("  included from %s(%u)\n", path, line);
+                    return;
+                }
+                add_shader_include_edge(file_index, find_shader_source_file(include_path));
+
+                // Back in this file, on the line after the #include
+                emit_line_directive(preprocessor, line + 1, file_index);
+                first_on_line = false;
+                continue;
+            }
+        }
+
+        if(first_on_line) {
+            if(!shader->length) {
+                if(!version) {
+                    emit_line_directive(preprocessor, line, file_index);
+                }
+                after_version = version;
+            } else if(after_version) {
+                emit_line_directive(preprocessor, line, file_index);
+                after_version = false;
+            } else {
+                move_to_shader_line(preprocessor, line, file_index);
+            }
+        } else if(gap && shader->length) {
+            char last = shader->text[shader->length - 1];
+            char next = *token_start;
+            if((is_word_char(last) && is_word_char(next)) ||
+               (is_operator_char(last) && is_operator_char(next)) ||
+               define_token == 4) {
+                emit_shader_text(preprocessor, " ", 1);
+            }
+        }
+        emit_shader_text(preprocessor, token_start, (u32)(token_end - token_start));
+
+        previous_end = token_end;
+        first_on_line = false;
+    }
+    if(!preprocessor->at_line_start) {
+        emit_shader_text(preprocessor, "\n", 1);
+        ++preprocessor->line;
+    }
+}
+
+static void
+preprocess_shader_file(ShaderPreprocessor* preprocessor, const char* path, u32 depth) {
+    PreprocessedShader* shader = preprocessor->shader;
+
+    char* source;
+    u32 length;
+    i32 file_index = read_shader_source_file(path, &source, &length);
+    if(file_index < 0) {
+        log_error_message("Couldn't read shader source %s\n", path);
+        preprocessor->failed = true;
+        return;
+    }
+
+    // Once per shader
+    for(u32 i = 0; i < shader->file_count; ++i) {
+        if(shader->files[i] == (u32)file_index) {
+            free(source);
+            return;
+        }
+    }
+    if(shader->file_count == MAX_PREPROCESSED_FILES) {
+        log_error_message("%s pulls in too many files\n", shader_source_files[shader->files[0]].path);
+        preprocessor->failed = true;
+        free(source);
+        return;
+    }
+    shader->files[shader->file_count] = file_index;
+    shader->file_versions[shader->file_count] = shader_source_files[file_index].version;
+    ++shader->file_count;
+
+    preprocessor->source_bytes += length;
+    preprocess_shader_source(preprocessor, file_index, source, length, depth);
+    free(source);
+}
+
+static void
+free_preprocessed_shader(PreprocessedShader* shader) {
+    free(shader->text);
+    memset(shader, 0, sizeof(*shader));
+}
+
+// Key for the preprocessed text of the root file at path. Includes can
+// change without the root changing, so the cached text lists every file
+// it came from to be checked on load.
+static u64
+preprocessed_shader_key(const char* path, u64 root_content_hash) {
+    return derived_data_key(PREPROCESSED_SHADER_VERSION, root_content_hash, path, strlen(path));
+}
+
+// Takes the preprocessed text from the derived data cache if every file
+// it was made from is unchanged and still has the same source string
+// number, which the #line directives in the text refer to
+static b32
+load_cached_preprocessed_shader(u64 key, PreprocessedShader* shader) {
+    DerivedData derived;
+    if(!load_derived_data(key, &derived)) {
+        return false;
+    }
+    const CachedPreprocessedShader* cached = (const CachedPreprocessedShader*)derived.data;
+    b32 valid = derived.size >= sizeof(*cached) && cached->file_count <= MAX_PREPROCESSED_FILES &&
+                derived.size == sizeof(*cached) + cached->length;
+    for(u32 i = 0; valid && i < cached->file_count; ++i) {
+        const CachedShaderSourceFile* file = &cached->files[i];
+        char* source;
+        u32 length;
+        i32 index = find_shader_source_file(file->path);
+        if(index < 0 || i > 0) {
+            index = read_shader_source_file(file->path, &source, &length);
+            if(index >= 0) {
+                free(source);
+            }
+        }
+        valid = index == (i32)file->index && shader_source_files[index].content_hash == file->content_hash;
+        shader->files[i] = index;
+        shader->file_versions[i] = valid ? shader_source_files[index].version : 0;
+    }
+    if(valid) {
+        for(u32 i = 0; i < cached->file_count; ++i) {
+            for(u32 j = 0; j < cached->file_count; ++j) {
+                if(cached->files[i].includes & (1u << j)) {
+                    add_shader_include_edge(shader->files[i], shader->files[j]);
+                }
+            }
+        }
+        shader->file_count = cached->file_count;
+        shader->length = cached->length;
+        shader->text = malloc(cached->length + 1);
+        memcpy(shader->text, cached + 1, cached->length);
+        shader->text[cached->length] = 0;
+    } else {
+        memset(shader, 0, sizeof(*shader));
+    }
+    free_derived_data(&derived);
+    return valid;
+}
+
+static void
+store_cached_preprocessed_shader(u64 key, PreprocessedShader* shader) {
+    size_t size = sizeof(CachedPreprocessedShader) + shader->length;
+    CachedPreprocessedShader* cached = calloc(1, size);
+    cached->file_count = shader->file_count;
+    cached->length = shader->length;
+    for(u32 i = 0; i < shader->file_count; ++i) {
+        ShaderSourceFile* file = &shader_source_files[shader->files[i]];
+        cached->files[i].index = shader->files[i];
+        for(u32 j = 0; j < shader->file_count; ++j) {
+            for(u32 k = 0; k < file->include_count; ++k) {
+                if(file->includes[k] == shader->files[j]) {
+                    cached->files[i].includes |= 1u << j;
+                }
+            }
+        }
+        cached->files[i].content_hash = file->content_hash;
+        memcpy(cached->files[i].path, file->path, MAX_SHADER_PATH_LENGTH);
+    }
+    memcpy(cached + 1, shader->text, shader->length);
+    store_derived_data(key, cached, size);
+    free(cached);
+}
+
+static b32
+preprocess_shader(const char* path, PreprocessedShader* shader) {
+    memset(shader, 0, sizeof(*shader));
+
+    // The root is read anyway, its hash is the key
+    char* source;
+    u32 length;
+    i32 root = read_shader_source_file(path, &source, &length);
+    if(root < 0) {
+        log_error_message("Couldn't read shader source %s\n", path);
+        return false;
+    }
+    free(source);
+    u64 key = preprocessed_shader_key(path, shader_source_files[root].content_hash);
+    if(load_cached_preprocessed_shader(key, shader)) {
+        return true;
+    }
+
+    ShaderPreprocessor preprocessor = {0};
+    preprocessor.shader = shader;
+    preprocessor.at_line_start = true;
+
+    preprocess_shader_file(&preprocessor, path, 0);
+    if(preprocessor.failed || !shader->length) {
+        free_preprocessed_shader(shader);
+        return false;
+    }
+    store_cached_preprocessed_shader(key, shader);
+
+    log_debug_message("Preprocessed %s: %u files, %u bytes down to %u\n", path, shader->file_count,
+                      preprocessor.source_bytes, shader->length);
+    return true;
+}
+
+// Rereads a file the shaders depend on, returns true if its contents changed
+static b32
+update_shader_source_file(const char* path) {
+    i32 index = find_shader_source_file(path);
+    if(index < 0) {
+        return false;
+    }
+    u32 version = shader_source_files[index].version;
+    char* source;
+    u32 length;
+    if(read_shader_source_file(path, &source, &length) < 0) {
+        return false;
+    }
+    free(source);
+    return shader_source_files[index].version != version;
+}
+
+// True if any file that went into the shader changed since it was preprocessed
+static b32
+preprocessed_shader_stale(PreprocessedShader* shader) {
+    for(u32 i = 0; i < shader->file_count; ++i) {
+        if(shader_source_files[shader->files[i]].version != shader->file_versions[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+log_shader_source_files(void) {
+    log_debug_message("Shader source strings:\n");
+    for(u32 i = 0; i < shader_source_file_count; ++i) {
+        log_debug_message("  %u: %s\n", i, shader_source_files[i].path);
+    }
+}
@@ -0,0 +1,536 @@
+/*
+  Texture atlas.
+
+  Small textures share a few large RGBA8 pages instead of being a GL
+  texture each, so draws with different textures can still bind the same
+  page and merge into one instanced draw. stb_rect_pack places them, a
+  draw finds its texture in the page through a uv transform, scale in xy
+  and offset in zw, which goes into the instance data and is applied in
+  basic_fragment.glsl.
+
+  Each texture sits in a tile with an ATLAS_GUTTER texel border of its own
+  opposite edges, so the page holds what GL_REPEAT would sample past the
+  edge and neither bilinear filtering nor the mips bleed into the
+  neighbours. Tiles are placed on a grid of ATLAS_CELL texels and only the
+  first ATLAS_LEVEL_COUNT levels exist, the last one still has a one texel
+  gutter and every tile starts on a whole texel of every level. The levels
+  are the texture's own mips with the gutter wrapped around them, nothing
+  gets filtered again.
+
+  Textures are packed as they arrive. The skyline packer can't take space
+  back, so a reload with a different size leaves a dead tile behind. Once
+  a new texture doesn't fit anywhere, everything is repacked from the
+  pixels kept for it, largest first, and only then is another page added.
+
+  Tiles go up through the texture upload queue, see texture_uploads.c,
+  and an entry can be drawn once its upload ticket is done. A repack
+  moves every tile at once, so those are uploaded straight away instead.
+
+  Each page is one texture to texture_residency.c, it needs the finest
+  level any of its textures does. Pages start with the levels it always
+  keeps, finer ones are uploaded from the kept tiles as draws ask for them
+  and dropped again when they don't. Tiles only go into the levels the
+  page has storage for.
+*/
+
+// Decoded textures go into the atlas when on, see main.c
+#define USE_TEXTURE_ATLAS 1
+
+#define ATLAS_PAGE_SIZE 2048
+#define ATLAS_LEVEL_COUNT 4
+#define ATLAS_CELL (1 << (ATLAS_LEVEL_COUNT - 1))
+#define ATLAS_GUTTER ATLAS_CELL
+#define ATLAS_PAGE_CELLS (ATLAS_PAGE_SIZE / ATLAS_CELL)
+// Anything bigger is better off as its own texture
+#define ATLAS_MAX_TEXTURE_SIZE 1024
+#define MAX_ATLAS_PAGES 8
+#define MAX_ATLAS_ENTRIES 256
+
+typedef struct {
+    u32 texture;
+    char name[32];
+    TextureResidency residency;
+    stbrp_context packer;
+    stbrp_node nodes[ATLAS_PAGE_CELLS];
+    // Texels, the textures themselves and their tiles with the gutters
+    u64 texture_area;
+    u64 tile_area;
+    // Tiles of textures that were freed or moved, only a repack gets them back
+    u64 dead_area;
+} AtlasPage;
+
+typedef struct {
+    b32 used;
+    u32 page;
+    // Where the tile starts in the page, in texels of level 0
+    u32 x;
+    u32 y;
+    u32 tile_width;
+    u32 tile_height;
+    u32 width;
+    u32 height;
+    // Every level of the tile in RGBA8, kept so it can be repacked
+    size_t level_offsets[ATLAS_LEVEL_COUNT];
+    size_t size;
+    u8* pixels;
+    Vec4 uv_transform;
+    u64 upload_ticket;
+} AtlasEntry;
+
+typedef struct {
+    u32 repacks;
+    u32 uploads;
+    u64 upload_bytes;
+} TextureAtlasStats;
+
+typedef struct {
+    AtlasPage pages[MAX_ATLAS_PAGES];
+    u32 page_count;
+    AtlasEntry entries[MAX_ATLAS_ENTRIES];
+    TextureAtlasStats stats;
+} TextureAtlas;
+
+static void
+init_texture_atlas(TextureAtlas* atlas) {
+    memset(atlas, 0, sizeof(*atlas));
+}
+
+// Textures whose first ATLAS_LEVEL_COUNT levels are exact halvings
+static inline b32
+atlas_accepts(u32 width, u32 height, u32 channels, u32 level_count) {
+    b32 result = width % ATLAS_CELL == 0 && height % ATLAS_CELL == 0 &&
+                 width <= ATLAS_MAX_TEXTURE_SIZE && height <= ATLAS_MAX_TEXTURE_SIZE &&
+                 level_count >= ATLAS_LEVEL_COUNT && channels != 2;
+    return result;
+}
+
+static void
+init_atlas_page(GLState* gl_state, AtlasPage* page, u32 page_index) {
+    memset(page, 0, sizeof(*page));
+    stbrp_init_target(&page->packer, ATLAS_PAGE_CELLS, ATLAS_PAGE_CELLS, page->nodes, ATLAS_PAGE_CELLS);
+
+    glGenTextures(1, &page->texture);
+    bind_texture_2d(gl_state, 0, page->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, ATLAS_LEVEL_COUNT - 1);
+
+    u32 level_sizes[ATLAS_LEVEL_COUNT];
+    for(u32 i = 0; i < ATLAS_LEVEL_COUNT; ++i) {
+        level_sizes[i] = (ATLAS_PAGE_SIZE >> i) * (ATLAS_PAGE_SIZE >> i) * 4;
+    }
+    snprintf(page->name, sizeof(page->name), "atlas page %u", page_index);
+    TextureResidency* residency = &page->residency;
+    track_texture_residency(residency, page->name, ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE, ATLAS_LEVEL_COUNT,
+                            level_sizes);
+    // Nothing to upload into an empty page
+    allocate_resident_levels(residency, GL_RGBA, false, ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE, residency->kept_level);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, residency->kept_level);
+    residency->resident_level = residency->kept_level;
+}
+
+// Copies every level with the gutter wrapped around it, expanding to RGBA
+static void
+fill_atlas_tile(AtlasEntry* entry, const u8* pixels, u32 channels) {
+    size_t source_offsets[MAX_MIP_LEVELS];
+    mip_chain_offsets(entry->width, entry->height, channels, ATLAS_LEVEL_COUNT, source_offsets);
+    for(u32 level = 0; level < ATLAS_LEVEL_COUNT; ++level) {
+        u32 gutter = ATLAS_GUTTER >> level;
+        u32 source_width  = entry->width >> level;
+        u32 source_height = entry->height >> level;
+        u32 tile_width  = entry->tile_width >> level;
+        u32 tile_height = entry->tile_height >> level;
+        const u8* source = pixels + source_offsets[level];
+        u8* tile = entry->pixels + entry->level_offsets[level];
+        for(u32 y = 0; y < tile_height; ++y) {
+            u32 source_y = (y + source_height - gutter) % source_height;
+            for(u32 x = 0; x < tile_width; ++x) {
+                u32 source_x = (x + source_width - gutter) % source_width;
+                const u8* in = source + ((size_t)source_y * source_width + source_x) * channels;
+                u8* out = tile + ((size_t)y * tile_width + x) * 4;
+                out[0] = in[0];
+                out[1] = channels >= 3 ? in[1] : 0;
+                out[2] = channels >= 3 ? in[2] : 0;
+                out[3] = channels == 4 ? in[3] : 255;
+            }
+        }
+    }
+}
+
+// Every level the page has storage for. Queued unless it's needed right
+// away or the upload buffer is full.
+static void
+upload_atlas_entry(GLState* gl_state, TextureAtlas* atlas, AtlasEntry* entry, b32 immediate) {
+    AtlasPage* page = &atlas->pages[entry->page];
+    u32 first_level = page->residency.allocated_level;
+    size_t first_offset = entry->level_offsets[first_level];
+    UploadStaging staging = {0};
+    if(!immediate) {
+        staging = stage_texture_upload((u32)(entry->size - first_offset));
+    }
+    entry->upload_ticket = 0;
+    if(staging.slice) {
+        memcpy(staging.data, entry->pixels + first_offset, entry->size - first_offset);
+    } else {
+        bind_texture_2d(gl_state, 0, page->texture);
+    }
+    for(u32 level = first_level; level < ATLAS_LEVEL_COUNT; ++level) {
+        u32 width  = entry->tile_width >> level;
+        u32 height = entry->tile_height >> level;
+        if(staging.slice) {
+            entry->upload_ticket = queue_texture_upload(gl_state, &staging,
+                                                        (u32)(entry->level_offsets[level] - first_offset),
+                                                        page->texture, level, entry->x >> level,
+                                                        entry->y >> level, width, height, GL_RGBA, false,
+                                                        width * 4, 0);
+        } else {
+            glTexSubImage2D(GL_TEXTURE_2D, level, entry->x >> level, entry->y >> level, width, height,
+                            GL_RGBA, GL_UNSIGNED_BYTE, entry->pixels + entry->level_offsets[level]);
+        }
+        atlas->stats.upload_bytes += (u64)width * height * 4;
+    }
+    submit_texture_staging(&staging);
+    ++atlas->stats.uploads;
+}
+
+static void
+place_atlas_entry(TextureAtlas* atlas, AtlasEntry* entry, u32 page_index, u32 cell_x, u32 cell_y) {
+    AtlasPage* page = &atlas->pages[page_index];
+    entry->page = page_index;
+    entry->x = cell_x * ATLAS_CELL;
+    entry->y = cell_y * ATLAS_CELL;
+    page->texture_area += (u64)entry->width * entry->height;
+    page->tile_area    += (u64)entry->tile_width * entry->tile_height;
+
+    f32 page_size = (f32)ATLAS_PAGE_SIZE;
+    entry->uv_transform = vec4(entry->width / page_size, entry->height / page_size,
+                               (entry->x + ATLAS_GUTTER) / page_size, (entry->y + ATLAS_GUTTER) / page_size);
+}
+
+static inline void
+init_atlas_rect(stbrp_rect* rect, TextureAtlas* atlas, AtlasEntry* entry) {
+    memset(rect, 0, sizeof(*rect));
+    rect->id = (i32)(entry - atlas->entries);
+    rect->w  = (stbrp_coord)(entry->tile_width / ATLAS_CELL);
+    rect->h  = (stbrp_coord)(entry->tile_height / ATLAS_CELL);
+}
+
+// Tries the pages in order, then a new one if there's room for it
+static b32
+pack_atlas_entry(GLState* gl_state, TextureAtlas* atlas, AtlasEntry* entry, b32 allow_new_page) {
+    stbrp_rect rect;
+    init_atlas_rect(&rect, atlas, entry);
+    for(u32 i = 0; i < atlas->page_count; ++i) {
+        if(stbrp_pack_rects(&atlas->pages[i].packer, &rect, 1)) {
+            place_atlas_entry(atlas, entry, i, rect.x, rect.y);
+            return true;
+        }
+    }
+    if(!allow_new_page || atlas->page_count == MAX_ATLAS_PAGES) {
+        return false;
+    }
+    u32 page_index = atlas->page_count++;
+    init_atlas_page(gl_state, &atlas->pages[page_index], page_index);
+    if(!stbrp_pack_rects(&atlas->pages[page_index].packer, &rect, 1)) {
+        return false;
+    }
+    place_atlas_entry(atlas, entry, page_index, rect.x, rect.y);
+    return true;
+}
+
+// Packs every used entry from scratch, all at once so stb_rect_pack can
+// sort them, over as few pages as it takes. The old layout stays if they
+// don't fit in MAX_ATLAS_PAGES.
+static b32
+repack_texture_atlas(GLState* gl_state, TextureAtlas* atlas) {
+    stbrp_rect rects[MAX_ATLAS_ENTRIES];
+    u32 rect_count = 0;
+    for(u32 i = 0; i < MAX_ATLAS_ENTRIES; ++i) {
+        if(atlas->entries[i].used) {
+            init_atlas_rect(&rects[rect_count++], atlas, &atlas->entries[i]);
+        }
+    }
+
+    // Packed into scratch packers first, pages are only touched once it all fits
+    static stbrp_context packers[MAX_ATLAS_PAGES];
+    static stbrp_node nodes[MAX_ATLAS_PAGES][ATLAS_PAGE_CELLS];
+    u32 page_count = 0;
+    u32 remaining = rect_count;
+    while(remaining) {
+        if(page_count == MAX_ATLAS_PAGES) {
+            return false;
+        }
+        stbrp_init_target(&packers[page_count], ATLAS_PAGE_CELLS, ATLAS_PAGE_CELLS, nodes[page_count],
+                          ATLAS_PAGE_CELLS);
+        stbrp_pack_rects(&packers[page_count], rects, remaining);
+        u32 unpacked = 0;
+        for(u32 i = 0; i < remaining; ++i) {
+            if(!rects[i].was_packed) {
+                rects[unpacked++] = rects[i];
+            }
+        }
+        if(unpacked == remaining) {
+            // Not even on an empty page
+            return false;
+        }
+        remaining = unpacked;
+        ++page_count;
+    }
+
+    // Queued tiles would land in their old places
+    for(u32 i = 0; i < atlas->page_count; ++i) {
+        cancel_texture_uploads(atlas->pages[i].texture);
+    }
+    for(u32 i = page_count; i < atlas->page_count; ++i) {
+        untrack_texture_residency(&atlas->pages[i].residency);
+        delete_texture(gl_state, atlas->pages[i].texture);
+    }
+    for(u32 i = 0; i < page_count; ++i) {
+        AtlasPage* page = &atlas->pages[i];
+        if(i < atlas->page_count) {
+            page->texture_area = 0;
+            page->tile_area    = 0;
+            page->dead_area    = 0;
+            stbrp_init_target(&page->packer, ATLAS_PAGE_CELLS, ATLAS_PAGE_CELLS, page->nodes, ATLAS_PAGE_CELLS);
+            // Every level with storage gets all of its tiles below
+            bind_texture_2d(gl_state, 0, page->texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, page->residency.allocated_level);
+            page->residency.resident_level = page->residency.allocated_level;
+        } else {
+            init_atlas_page(gl_state, page, i);
+        }
+    }
+    atlas->page_count = page_count;
+
+    // The pages' packers keep pointers into their own nodes, so the same
+    // rects are packed into them again, which gives the same placements
+    rect_count = 0;
+    for(u32 i = 0; i < MAX_ATLAS_ENTRIES; ++i) {
+        if(atlas->entries[i].used) {
+            init_atlas_rect(&rects[rect_count++], atlas, &atlas->entries[i]);
+        }
+    }
+    remaining = rect_count;
+    for(u32 page = 0; page < page_count; ++page) {
+        stbrp_pack_rects(&atlas->pages[page].packer, rects, remaining);
+        u32 unpacked = 0;
+        for(u32 i = 0; i < remaining; ++i) {
+            if(rects[i].was_packed) {
+                AtlasEntry* entry = &atlas->entries[rects[i].id];
+                place_atlas_entry(atlas, entry, page, rects[i].x, rects[i].y);
+                upload_atlas_entry(gl_state, atlas, entry, true);
+            } else {
+                rects[unpacked++] = rects[i];
+            }
+        }
+        remaining = unpacked;
+    }
+    assert(!remaining);
+    ++atlas->stats.repacks;
+    return true;
+}
+
+static void
+release_atlas_entry(TextureAtlas* atlas, AtlasEntry* entry) {
+    AtlasPage* page = &atlas->pages[entry->page];
+    u64 tile_area = (u64)entry->tile_width * entry->tile_height;
+    page->texture_area -= (u64)entry->width * entry->height;
+    page->tile_area    -= tile_area;
+    page->dead_area    += tile_area;
+    free(entry->pixels);
+    memset(entry, 0, sizeof(*entry));
+}
+
+static void
+free_atlas_texture(TextureAtlas* atlas, u32 entry_id) {
+    if(entry_id) {
+        release_atlas_entry(atlas, &atlas->entries[entry_id - 1]);
+    }
+}
+
+static inline b32
+texture_atlas_has_dead_area(TextureAtlas* atlas) {
+    for(u32 i = 0; i < atlas->page_count; ++i) {
+        if(atlas->pages[i].dead_area) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Puts a texture with its mips, laid out as by mip_chain_offsets, in the
+// atlas. entry_id is the texture's current entry, or 0 for a new one.
+// Returns the entry, or 0 if the texture can't go in an atlas, in which
+// case the old entry is gone too.
+static u32
+set_atlas_texture(GLState* gl_state, TextureAtlas* atlas, u32 entry_id, const u8* pixels,
+                  u32 width, u32 height, u32 channels, u32 level_count) {
+    if(entry_id) {
+        AtlasEntry* entry = &atlas->entries[entry_id - 1];
+        if(entry->width == width && entry->height == height) {
+            // Same tile, same place
+            fill_atlas_tile(entry, pixels, channels);
+            upload_atlas_entry(gl_state, atlas, entry, false);
+            return entry_id;
+        }
+        release_atlas_entry(atlas, entry);
+    }
+    if(!atlas_accepts(width, height, channels, level_count)) {
+        return 0;
+    }
+
+    u32 index = 0;
+    while(index < MAX_ATLAS_ENTRIES && atlas->entries[index].used) {
+        ++index;
+    }
+    if(index == MAX_ATLAS_ENTRIES) {
+        return 0;
+    }
+    AtlasEntry* entry = &atlas->entries[index];
+    entry->used        = true;
+    entry->width       = width;
+    entry->height      = height;
+    entry->tile_width  = width + 2 * ATLAS_GUTTER;
+    entry->tile_height = height + 2 * ATLAS_GUTTER;
+    entry->size = mip_chain_offsets(entry->tile_width, entry->tile_height, 4, ATLAS_LEVEL_COUNT,
+                                    entry->level_offsets);
+    entry->pixels = malloc(entry->size);
+    fill_atlas_tile(entry, pixels, channels);
+
+    // The repack places the new one along with the rest
+    b32 packed = pack_atlas_entry(gl_state, atlas, entry, false);
+    if(!packed && texture_atlas_has_dead_area(atlas)) {
+        if(repack_texture_atlas(gl_state, atlas)) {
+            return index + 1;
+        }
+    }
+    if(!packed) {
+        packed = pack_atlas_entry(gl_state, atlas, entry, true);
+    }
+    if(!packed) {
+        log_error_message("Texture atlas full, %ux%u texture gets its own\n", width, height);
+        free(entry->pixels);
+        memset(entry, 0, sizeof(*entry));
+        return 0;
+    }
+    upload_atlas_entry(gl_state, atlas, entry, false);
+    return index + 1;
+}
+
+// The levels of every tile on the page from the coarsest missing one down
+// to first_level, in one slice per level. Each level becomes the base
+// level once all of its tiles are in. Stops at the first level there's no
+// room for, the rest is tried again on a later update. Without an upload
+// buffer they go straight from memory.
+static void
+stream_in_atlas_page(GLState* gl_state, TextureAtlas* atlas, u32 page_index, u32 first_level) {
+    AtlasPage* page = &atlas->pages[page_index];
+    TextureResidency* residency = &page->residency;
+    while(residency->allocated_level > first_level) {
+        u32 level = residency->allocated_level - 1;
+        // A full upload queue gets emptied, which binds other textures
+        bind_texture_2d(gl_state, 0, page->texture);
+        u32 size = 0;
+        for(u32 i = 0; i < MAX_ATLAS_ENTRIES; ++i) {
+            AtlasEntry* entry = &atlas->entries[i];
+            if(entry->used && entry->page == page_index) {
+                size += (entry->tile_width >> level) * (entry->tile_height >> level) * 4;
+            }
+        }
+        UploadStaging staging = {0};
+        if(size && texture_uploads.mapped) {
+            staging = stage_texture_upload(size);
+            if(!staging.slice) {
+                break;
+            }
+        }
+        allocate_resident_levels(residency, GL_RGBA, false, ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE, level);
+
+        AtlasEntry* last = 0;
+        for(u32 i = 0; i < MAX_ATLAS_ENTRIES; ++i) {
+            if(atlas->entries[i].used && atlas->entries[i].page == page_index) {
+                last = &atlas->entries[i];
+            }
+        }
+        u32 offset = 0;
+        for(u32 i = 0; i < MAX_ATLAS_ENTRIES; ++i) {
+            AtlasEntry* entry = &atlas->entries[i];
+            if(!entry->used || entry->page != page_index) {
+                continue;
+            }
+            u32 width  = entry->tile_width >> level;
+            u32 height = entry->tile_height >> level;
+            const u8* pixels = entry->pixels + entry->level_offsets[level];
+            if(staging.slice) {
+                memcpy(staging.data + offset, pixels, width * height * 4);
+                queue_texture_upload(gl_state, &staging, offset, page->texture, level, entry->x >> level,
+                                     entry->y >> level, width, height, GL_RGBA, false, width * 4,
+                                     entry == last ? &residency->resident_level : 0);
+                offset += width * height * 4;
+            } else {
+                glTexSubImage2D(GL_TEXTURE_2D, level, entry->x >> level, entry->y >> level, width, height,
+                                GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+            }
+            atlas->stats.upload_bytes += (u64)width * height * 4;
+        }
+        if(!staging.slice) {
+            // Nothing queued to wait for
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+            residency->resident_level = level;
+        }
+        submit_texture_staging(&staging);
+    }
+}
+
+// Streams levels in or drops them to what update_texture_residency wants
+static void
+apply_atlas_residency(GLState* gl_state, TextureAtlas* atlas) {
+    for(u32 i = 0; i < atlas->page_count; ++i) {
+        AtlasPage* page = &atlas->pages[i];
+        TextureResidency* residency = &page->residency;
+        if(residency->wanted_level > residency->allocated_level) {
+            bind_texture_2d(gl_state, 0, page->texture);
+            drop_resident_levels(residency, page->texture, GL_RGBA, false, residency->wanted_level);
+        } else if(residency->wanted_level < residency->allocated_level) {
+            stream_in_atlas_page(gl_state, atlas, i, residency->wanted_level);
+        }
+    }
+}
+
+static void
+log_texture_atlas_stats(TextureAtlas* atlas) {
+    u32 entry_count = 0;
+    for(u32 i = 0; i < MAX_ATLAS_ENTRIES; ++i) {
+        entry_count += atlas->entries[i].used;
+    }
+    u64 texture_area = 0;
+    u64 tile_area = 0;
+    u64 dead_area = 0;
+    for(u32 i = 0; i < atlas->page_count; ++i) {
+        texture_area += atlas->pages[i].texture_area;
+        tile_area    += atlas->pages[i].tile_area;
+        dead_area    += atlas->pages[i].dead_area;
+    }
+    f64 page_area = (f64)atlas->page_count * ATLAS_PAGE_SIZE * ATLAS_PAGE_SIZE;
+    page_area = page_area ? page_area : 1.0;
+    log_debug_message("Texture atlas: %u textures on %u pages, %.1f%% textures, %.1f%% with gutters, "
+                      "%.1f%% dead, %u repacks, %u uploads (%.2f MB)\n",
+                      entry_count, atlas->page_count, 100.0 * texture_area / page_area,
+                      100.0 * tile_area / page_area, 100.0 * dead_area / page_area, atlas->stats.repacks,
+                      atlas->stats.uploads, (f64)atlas->stats.upload_bytes / (1024.0 * 1024.0));
+}
+
+static void
+free_texture_atlas(GLState* gl_state, TextureAtlas* atlas) {
+    for(u32 i = 0; i < MAX_ATLAS_ENTRIES; ++i) {
+        free(atlas->entries[i].pixels);
+    }
+    for(u32 i = 0; i < atlas->page_count; ++i) {
+        untrack_texture_residency(&atlas->pages[i].residency);
+        cancel_texture_uploads(atlas->pages[i].texture);
+        delete_texture(gl_state, atlas->pages[i].texture);
+    }
+    memset(atlas, 0, sizeof(*atlas));
+}
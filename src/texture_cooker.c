@@ -0,0 +1,508 @@
+/*
+  Texture cooker.
+
+  Turns source images into the block compressed DDS files textures.c
+  uploads as they are, see cooked_texture.c:
+
+    texture_cooker [-threads n] [-hq] [-filter box|triangle|mitchell|catmullrom]
+                   [-clamp] [-benchmark] data/textures/container.jpg ...
+
+  Every image is decoded, flipped bottom up, given a full mip chain by
+  mip_chain.c and compressed 4x4 block by block with stb_dxt. The format follows the
+  channels: one channel is BC4, two are BC5, RGB is BC1, and RGBA is BC3
+  unless every pixel is opaque, then it's BC1 too. -hq has stb_dxt do its
+  extra refinement passes, which is slower but a little better.
+
+  Mip bands and then block rows of all the levels are shared out between
+  the threads. The mip filter is picked per texture unless -filter names
+  one, and edges wrap, the way the game samples them, unless -clamp. The output goes next to the source as .dds, written
+  under a temporary name and renamed, so the game's hot reload never
+  loads half a file.
+
+  For every texture it prints how much smaller it is than the same image
+  uploaded as RGBA8 with mips, which is what the driver keeps for a jpg
+  loaded through decode_image, and at the end the compression rate per
+  thread. -benchmark times the mip chain of every texture on one thread,
+  on all of them, and with a single stb_image_resize call per level the
+  way it was done before bands, and writes nothing.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#define STB_IMAGE_RESIZE_STATIC
+#include "stb_image_resize.h"
+#define STB_DXT_IMPLEMENTATION
+#define STB_DXT_STATIC
+// The default in this version of stb_dxt drops memset's arguments
+#define STBD_MEMSET memset
+#include "stb_dxt.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define array_count(x) ((sizeof(x) / sizeof(0 [x])) / ((size_t)(!(sizeof(x) % sizeof(0 [x])))))
+
+#define HANDMADE_MATH_IMPLEMENTATION
+#include "HandmadeMath.h"
+
+#include "types.c"
+#include "math.c"
+#include "hash.c"
+
+static void
+log_debug_message(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+static void
+log_error_message(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+#include "platform_files.c"
+#include "mip_chain.c"
+#include "cooked_texture.c"
+
+#define MAX_COOKER_THREADS 64
+
+typedef struct {
+    CookedTextureFormat format;
+    i32 dxt_mode;
+    // Of the uncompressed levels, 4 for BC1 and BC3
+    u32 channels;
+    u32 level_count;
+    u32 widths[MAX_COOKED_TEXTURE_LEVELS];
+    u32 heights[MAX_COOKED_TEXTURE_LEVELS];
+    // Into the mip chain
+    const u8* levels[MAX_COOKED_TEXTURE_LEVELS];
+
+    // All the levels, one after the other like in the file
+    u8* compressed;
+    u32 compressed_size;
+    u32 compressed_offsets[MAX_COOKED_TEXTURE_LEVELS];
+
+    // Block rows of every level, first_rows[i] is level i's first one
+    u32 row_count;
+    u32 first_rows[MAX_COOKED_TEXTURE_LEVELS + 1];
+    volatile i32 next_row;
+} CookJob;
+
+static f64
+seconds_now(void) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (f64)now.tv_sec + (f64)now.tv_nsec * 1e-9;
+}
+
+static inline u32
+take_cook_row(CookJob* job) {
+#ifdef _WIN32
+    return (u32)InterlockedIncrement((volatile LONG*)&job->next_row) - 1;
+#else
+    return (u32)__atomic_fetch_add(&job->next_row, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static void
+compress_block_row(CookJob* job, u32 level, u32 block_y) {
+    u32 width  = job->widths[level];
+    u32 height = job->heights[level];
+    u32 channels = job->channels;
+    const u8* pixels = job->levels[level];
+    u32 block_size = cooked_format_block_sizes[job->format];
+    u8* out = job->compressed + job->compressed_offsets[level] + block_y * ((width + 3) / 4) * block_size;
+
+    for(u32 block_x = 0; block_x < (width + 3) / 4; ++block_x) {
+        // Levels smaller than a block repeat their edge pixels
+        u8 block[16 * 4];
+        for(u32 y = 0; y < 4; ++y) {
+            u32 source_y = min(block_y * 4 + y, height - 1);
+            for(u32 x = 0; x < 4; ++x) {
+                u32 source_x = min(block_x * 4 + x, width - 1);
+                memcpy(&block[(y * 4 + x) * channels], &pixels[(source_y * width + source_x) * channels], channels);
+            }
+        }
+        switch(job->format) {
+            case COOKED_FORMAT_BC1: stb_compress_dxt_block(out, block, 0, job->dxt_mode); break;
+            case COOKED_FORMAT_BC3: stb_compress_dxt_block(out, block, 1, job->dxt_mode); break;
+            case COOKED_FORMAT_BC4: stb_compress_bc4_block(out, block); break;
+            case COOKED_FORMAT_BC5: stb_compress_bc5_block(out, block); break;
+            default: break;
+        }
+        out += block_size;
+    }
+}
+
+static void
+run_cook_job(void* data) {
+    CookJob* job = data;
+    u32 level = 0;
+    for(;;) {
+        u32 row = take_cook_row(job);
+        if(row >= job->row_count) {
+            return;
+        }
+        while(row >= job->first_rows[level + 1]) {
+            ++level;
+        }
+        compress_block_row(job, level, row - job->first_rows[level]);
+    }
+}
+
+static void
+run_mip_job_on_thread(void* data) {
+    run_mip_job(data);
+}
+
+typedef void CookerWork(void* data);
+
+typedef struct {
+    CookerWork* work;
+    void* data;
+} CookerThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI
+cooker_thread(void* data) {
+    CookerThreadStart* start = data;
+    start->work(start->data);
+    return 0;
+}
+#else
+static void*
+cooker_thread(void* data) {
+    CookerThreadStart* start = data;
+    start->work(start->data);
+    return 0;
+}
+#endif
+
+// Runs work on this thread and thread_count - 1 others, returns once they
+// are all done
+static void
+run_on_cooker_threads(CookerWork* work, void* data, u32 thread_count) {
+    CookerThreadStart start = {work, data};
+#ifdef _WIN32
+    HANDLE threads[MAX_COOKER_THREADS];
+    for(u32 i = 1; i < thread_count; ++i) {
+        threads[i] = CreateThread(0, 0, cooker_thread, &start, 0, 0);
+    }
+    work(data);
+    for(u32 i = 1; i < thread_count; ++i) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+#else
+    pthread_t threads[MAX_COOKER_THREADS];
+    for(u32 i = 1; i < thread_count; ++i) {
+        pthread_create(&threads[i], 0, cooker_thread, &start);
+    }
+    work(data);
+    for(u32 i = 1; i < thread_count; ++i) {
+        pthread_join(threads[i], 0);
+    }
+#endif
+}
+
+static u32
+processor_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (u32)count : 1;
+#endif
+}
+
+// Picks the format and converts the pixels to what its compressor takes
+static u8*
+prepare_pixels(u8* pixels, u32 width, u32 height, u32 channels, CookedTextureFormat* format, u32* out_channels) {
+    u32 pixel_count = width * height;
+    if(channels == 1 || channels == 2) {
+        *format = channels == 1 ? COOKED_FORMAT_BC4 : COOKED_FORMAT_BC5;
+        *out_channels = channels;
+        return pixels;
+    }
+
+    b32 opaque = true;
+    for(u32 i = 0; channels == 4 && i < pixel_count && opaque; ++i) {
+        opaque = pixels[i * 4 + 3] == 255;
+    }
+    *format = opaque ? COOKED_FORMAT_BC1 : COOKED_FORMAT_BC3;
+    *out_channels = 4;
+    if(channels == 4) {
+        return pixels;
+    }
+    u8* rgba = malloc(pixel_count * 4);
+    for(u32 i = 0; i < pixel_count; ++i) {
+        rgba[i * 4 + 0] = pixels[i * 3 + 0];
+        rgba[i * 4 + 1] = pixels[i * 3 + 1];
+        rgba[i * 4 + 2] = pixels[i * 3 + 2];
+        rgba[i * 4 + 3] = 255;
+    }
+    stbi_image_free(pixels);
+    return rgba;
+}
+
+// A mip chain the way it was built before bands, one stb_image_resize
+// call per level on one thread, for -benchmark to compare against
+static b32
+build_mip_chain_per_level(MipChain* chain, MipSettings settings) {
+    i32 alpha_channel = chain->channels == 4 ? 3 : STBIR_ALPHA_CHANNEL_NONE;
+    // Not stbir_resize_uint8_srgb_edgemode, which ignores the filter
+    stbir_colorspace colorspace = settings.srgb ? STBIR_COLORSPACE_SRGB : STBIR_COLORSPACE_LINEAR;
+    for(u32 i = 1; i < chain->level_count; ++i) {
+        const u8* input = chain->pixels + chain->level_offsets[i - 1];
+        u8* output = chain->pixels + chain->level_offsets[i];
+        u32 input_width  = mip_dimension(chain->width, i - 1);
+        u32 input_height = mip_dimension(chain->height, i - 1);
+        u32 width  = mip_dimension(chain->width, i);
+        u32 height = mip_dimension(chain->height, i);
+        i32 result = stbir_resize_uint8_generic(input, input_width, input_height, 0, output, width, height, 0,
+                                                chain->channels, alpha_channel, 0, settings.edge, settings.filter,
+                                                colorspace, 0);
+        if(!result) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static b32
+write_cooked_texture(const char* path, CookJob* job) {
+    char temp_path[MAX_COOKED_TEXTURE_PATH_LENGTH + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    DdsHeader header;
+    fill_dds_header(&header, job->format, job->widths[0], job->heights[0], job->level_count);
+
+    FILE* file = fopen(temp_path, "wb");
+    b32 written = file && fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  fwrite(job->compressed, 1, job->compressed_size, file) == job->compressed_size;
+    written = file && fclose(file) == 0 && written;
+    if(!written || !replace_file(temp_path, path)) {
+        remove(temp_path);
+        return false;
+    }
+    return true;
+}
+
+typedef struct {
+    u32 thread_count;
+    i32 dxt_mode;
+    // 0 picks one per texture
+    stbir_filter filter;
+    b32 clamp;
+    b32 benchmark;
+} CookOptions;
+
+typedef struct {
+    u32 textures;
+    u64 texels;
+    f64 mip_seconds;
+    f64 compress_seconds;
+    u64 uncompressed_bytes;
+    u64 compressed_bytes;
+} CookStats;
+
+static const char* mip_filter_names[] = {"default", "box", "triangle", "cubic b-spline", "catmull-rom", "mitchell"};
+static const char* cooked_format_names[COOKED_FORMAT_COUNT] = {"BC1", "BC3", "BC4", "BC5"};
+
+#define MIP_BENCHMARK_ITERATIONS 20
+
+// Milliseconds for one chain, the best of a few runs
+static f64
+time_mip_chain(MipChain* chain, MipSettings settings, u32 thread_count) {
+    f64 best = 1e30;
+    for(u32 i = 0; i < MIP_BENCHMARK_ITERATIONS; ++i) {
+        f64 start = seconds_now();
+        if(thread_count) {
+            MipJob job;
+            init_mip_job(&job, chain, settings);
+            run_on_cooker_threads(run_mip_job_on_thread, &job, thread_count);
+        } else {
+            build_mip_chain_per_level(chain, settings);
+        }
+        best = min(best, seconds_now() - start);
+    }
+    return best * 1000.0;
+}
+
+static void
+benchmark_mip_chain(const char* source_path, MipChain* chain, MipSettings settings, u32 thread_count) {
+    f64 per_level_ms = time_mip_chain(chain, settings, 0);
+    f64 one_thread_ms = time_mip_chain(chain, settings, 1);
+    f64 threads_ms = time_mip_chain(chain, settings, thread_count);
+    log_debug_message("%s: %ux%u %s mips, per level stbir %.2f ms, banded on 1 thread %.2f ms, "
+                      "on %u threads %.2f ms (%.1fx)\n",
+                      source_path, chain->width, chain->height, mip_filter_names[settings.filter], per_level_ms,
+                      one_thread_ms, thread_count, threads_ms, per_level_ms / threads_ms);
+}
+
+static b32
+cook_texture(const char* source_path, const CookOptions* options, CookStats* stats) {
+    FileContents source;
+    if(!read_loose_file_contents(source_path, &source)) {
+        log_error_message("Can't read %s\n", source_path);
+        return false;
+    }
+    i32 width, height, channels;
+    u8* pixels = stbi_load_from_memory((const u8*)source.data, (i32)source.size, &width, &height, &channels, 0);
+    free_file_contents(&source);
+    if(!pixels) {
+        log_error_message("Can't decode %s: %s\n", source_path, stbi_failure_reason());
+        return false;
+    }
+
+    CookJob job = {0};
+    job.dxt_mode = options->dxt_mode;
+    pixels = prepare_pixels(pixels, width, height, channels, &job.format, &job.channels);
+    MipSettings settings = choose_mip_settings(pixels, width, height, job.channels, !options->clamp);
+    if(options->filter) {
+        settings.filter = options->filter;
+    }
+    MipChain chain;
+    init_mip_chain(&chain, pixels, width, height, job.channels);
+    stbi_image_free(pixels);
+
+    if(options->benchmark) {
+        benchmark_mip_chain(source_path, &chain, settings, options->thread_count);
+        free_mip_chain(&chain);
+        return true;
+    }
+
+    f64 mip_start = seconds_now();
+    MipJob mip_job;
+    init_mip_job(&mip_job, &chain, settings);
+    run_on_cooker_threads(run_mip_job_on_thread, &mip_job, options->thread_count);
+    f64 mip_seconds = seconds_now() - mip_start;
+    b32 result = !mip_job.failed;
+
+    job.level_count = chain.level_count;
+    u64 texels = 0;
+    for(u32 i = 0; i < job.level_count; ++i) {
+        job.widths[i]  = mip_dimension(width, i);
+        job.heights[i] = mip_dimension(height, i);
+        job.levels[i]  = chain.pixels + chain.level_offsets[i];
+        job.compressed_offsets[i] = job.compressed_size;
+        job.compressed_size += cooked_level_size(job.format, job.widths[i], job.heights[i]);
+        job.first_rows[i] = job.row_count;
+        job.row_count += (job.heights[i] + 3) / 4;
+        texels += job.widths[i] * job.heights[i];
+    }
+    job.first_rows[job.level_count] = job.row_count;
+    job.compressed = malloc(job.compressed_size);
+
+    char path[MAX_COOKED_TEXTURE_PATH_LENGTH];
+    cooked_texture_path(source_path, path, sizeof(path));
+    if(result) {
+        f64 start = seconds_now();
+        run_on_cooker_threads(run_cook_job, &job, options->thread_count);
+        f64 seconds = seconds_now() - start;
+
+        result = write_cooked_texture(path, &job);
+        if(result) {
+            // What the driver would keep for it uncompressed
+            u64 uncompressed = texels * 4;
+            log_debug_message("%s: %dx%d %s, %u levels (%s), %.2f MB -> %.2f MB, saves %.2f MB (%.1fx), "
+                              "mips %.2f ms, compression %.2f ms\n",
+                              path, width, height, cooked_format_names[job.format], job.level_count,
+                              mip_filter_names[settings.filter], (f64)uncompressed / (1024.0 * 1024.0),
+                              (f64)job.compressed_size / (1024.0 * 1024.0),
+                              (f64)(uncompressed - job.compressed_size) / (1024.0 * 1024.0),
+                              (f64)uncompressed / job.compressed_size, mip_seconds * 1000.0, seconds * 1000.0);
+            ++stats->textures;
+            stats->texels += texels;
+            stats->mip_seconds += mip_seconds;
+            stats->compress_seconds += seconds;
+            stats->uncompressed_bytes += uncompressed;
+            stats->compressed_bytes += job.compressed_size;
+        } else {
+            log_error_message("Can't write %s\n", path);
+        }
+    } else {
+        log_error_message("Can't build the mips of %s\n", source_path);
+    }
+
+    free_mip_chain(&chain);
+    free(job.compressed);
+    return result;
+}
+
+i32
+main(int argc, char** argv) {
+    CookOptions options = {0};
+    options.thread_count = processor_count();
+    options.dxt_mode = STB_DXT_NORMAL;
+    i32 first = 1;
+    for(; first < argc && argv[first][0] == '-'; ++first) {
+        if(strcmp(argv[first], "-threads") == 0 && first + 1 < argc) {
+            options.thread_count = (u32)atoi(argv[++first]);
+        } else if(strcmp(argv[first], "-hq") == 0) {
+            options.dxt_mode = STB_DXT_HIGHQUAL;
+        } else if(strcmp(argv[first], "-clamp") == 0) {
+            options.clamp = true;
+        } else if(strcmp(argv[first], "-benchmark") == 0) {
+            options.benchmark = true;
+        } else if(strcmp(argv[first], "-filter") == 0 && first + 1 < argc) {
+            const char* name = argv[++first];
+            options.filter = strcmp(name, "box") == 0        ? STBIR_FILTER_BOX
+                           : strcmp(name, "triangle") == 0   ? STBIR_FILTER_TRIANGLE
+                           : strcmp(name, "mitchell") == 0   ? STBIR_FILTER_MITCHELL
+                           : strcmp(name, "catmullrom") == 0 ? STBIR_FILTER_CATMULLROM
+                                                             : STBIR_FILTER_DEFAULT;
+            if(!options.filter) {
+                break;
+            }
+        } else {
+            break;
+        }
+    }
+    if(first == argc || argv[first][0] == '-') {
+        printf("usage: %s [-threads n] [-hq] [-filter box|triangle|mitchell|catmullrom] [-clamp] [-benchmark] "
+               "image...\n", argv[0]);
+        return 1;
+    }
+    options.thread_count = max(min(options.thread_count, MAX_COOKER_THREADS), 1);
+    stbi_set_flip_vertically_on_load(1);
+
+    CookStats stats = {0};
+    b32 result = true;
+    for(i32 i = first; i < argc; ++i) {
+        result = cook_texture(argv[i], &options, &stats) && result;
+    }
+    if(stats.textures) {
+        f64 megapixels = (f64)stats.texels / 1e6;
+        log_debug_message("Cooked %u textures on %u threads: %.2f MB -> %.2f MB, mips %.2f ms, "
+                          "%.2f megapixels/s compressed, %.2f per thread\n",
+                          stats.textures, options.thread_count, (f64)stats.uncompressed_bytes / (1024.0 * 1024.0),
+                          (f64)stats.compressed_bytes / (1024.0 * 1024.0), stats.mip_seconds * 1000.0,
+                          megapixels / stats.compress_seconds, megapixels / stats.compress_seconds / options.thread_count);
+    }
+    return result ? 0 : 1;
+}
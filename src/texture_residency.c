@@ -0,0 +1,269 @@
+/*
+  Texture residency.
+
+  Textures don't keep every level in video memory. Each draw says how
+  much detail it needs from a texture, from how many of its texels land on
+  a pixel, see texture_detail_level, and update_texture_residency decides
+  which levels every texture gets within the memory budget. Small levels
+  come first: the levels from RESIDENCY_MIN_LEVEL_SIZE down are always
+  kept, so a texture always has something to draw with, and the rest is
+  handed out a level at a time round every texture that wants more. One
+  only gets its finest level once the others have had their turn at the
+  coarser ones.
+
+  The owners stream the levels, textures.c reads them from the file again
+  and texture_atlas.c uploads them from the tiles it keeps. Levels are
+  dropped by moving GL_TEXTURE_BASE_LEVEL past them and giving them no
+  size, which is fine for completeness since only the levels from the base
+  level on count, and lets the driver have the memory back. Levels nothing
+  asks for stay for RESIDENCY_DROP_FRAMES as long as there's room, so a
+  cube turning away and back doesn't stream them again.
+*/
+
+#define DEFAULT_TEXTURE_MEMORY_BUDGET (64 * 1024 * 1024)
+#define MAX_RESIDENT_TEXTURES 256
+// Levels this wide and high or less always stay
+#define RESIDENCY_MIN_LEVEL_SIZE 64
+#define RESIDENCY_DROP_FRAMES 120
+
+typedef struct {
+    const char* name;
+    u32 level_count;
+    u32 level_sizes[MAX_MIP_LEVELS];
+    // The first level no bigger than RESIDENCY_MIN_LEVEL_SIZE, it and the
+    // ones after it always stay
+    u32 kept_level;
+    // Levels from allocated_level on have storage, the ones from
+    // resident_level on are uploaded too, it's the base level.
+    // level_count when there's nothing yet.
+    u32 allocated_level;
+    u32 resident_level;
+    // The finest level a draw asked for since the last update, level_count for none
+    u32 required_level;
+    // What the budget left room for
+    u32 wanted_level;
+    // Updates with allocated levels finer than required
+    u32 unused_frames;
+} TextureResidency;
+
+typedef struct {
+    u64 peak_bytes;
+    u32 levels_allocated;
+    u32 levels_dropped;
+    // Updates where what was required didn't fit
+    u32 over_budget_updates;
+} TextureResidencyStats;
+
+typedef struct {
+    u64 budget;
+    TextureResidency* textures[MAX_RESIDENT_TEXTURES];
+    u32 texture_count;
+    TextureResidencyStats stats;
+} TextureResidencyManager;
+
+static TextureResidencyManager texture_residency;
+
+static void
+init_texture_residency(u64 budget) {
+    memset(&texture_residency, 0, sizeof(texture_residency));
+    texture_residency.budget = budget;
+}
+
+static inline u32
+residency_kept_level(u32 width, u32 height, u32 level_count) {
+    u32 level = 0;
+    while(level + 1 < level_count && (mip_dimension(width, level) > RESIDENCY_MIN_LEVEL_SIZE ||
+                                      mip_dimension(height, level) > RESIDENCY_MIN_LEVEL_SIZE)) {
+        ++level;
+    }
+    return level;
+}
+
+// Takes a texture's size, nothing is allocated or resident until the owner
+// says so
+static void
+reset_texture_residency(TextureResidency* residency, const char* name, u32 width, u32 height,
+                        u32 level_count, const u32* level_sizes) {
+    residency->name        = name;
+    residency->level_count = level_count;
+    memcpy(residency->level_sizes, level_sizes, level_count * sizeof(u32));
+    residency->kept_level      = residency_kept_level(width, height, level_count);
+    residency->allocated_level = level_count;
+    residency->resident_level  = level_count;
+    residency->required_level  = level_count;
+    // Everything, unless an update says otherwise
+    residency->wanted_level    = 0;
+    residency->unused_frames   = 0;
+}
+
+// Resets it and has the budget cover it from the next update on
+static void
+track_texture_residency(TextureResidency* residency, const char* name, u32 width, u32 height,
+                        u32 level_count, const u32* level_sizes) {
+    b32 tracked = false;
+    for(u32 i = 0; i < texture_residency.texture_count; ++i) {
+        tracked = tracked || texture_residency.textures[i] == residency;
+    }
+    if(!tracked) {
+        if(texture_residency.texture_count == MAX_RESIDENT_TEXTURES) {
+            log_error_message("Too many textures for residency tracking, %s gets all of its levels\n", name);
+        } else {
+            texture_residency.textures[texture_residency.texture_count++] = residency;
+        }
+    }
+    reset_texture_residency(residency, name, width, height, level_count, level_sizes);
+}
+
+static void
+untrack_texture_residency(TextureResidency* residency) {
+    for(u32 i = 0; i < texture_residency.texture_count; ++i) {
+        if(texture_residency.textures[i] == residency) {
+            texture_residency.textures[i] = texture_residency.textures[--texture_residency.texture_count];
+            break;
+        }
+    }
+    memset(residency, 0, sizeof(*residency));
+}
+
+static inline u64
+residency_bytes(const TextureResidency* residency, u32 first_level) {
+    u64 bytes = 0;
+    for(u32 i = first_level; i < residency->level_count; ++i) {
+        bytes += residency->level_sizes[i];
+    }
+    return bytes;
+}
+
+// The level that has about one texel per pixel for a texture size texels
+// wide, drawn with uv_density uv units per world unit where a world unit
+// covers pixels_per_unit pixels
+static inline u32
+texture_detail_level(u32 size, f32 uv_density, f32 pixels_per_unit) {
+    f32 texels_per_pixel = (f32)size * uv_density / (max(pixels_per_unit, 1e-6f));
+    if(texels_per_pixel <= 1.0f) {
+        return 0;
+    }
+    return (u32)floorf(log2f(texels_per_pixel));
+}
+
+static inline void
+require_texture_level(TextureResidency* residency, u32 level) {
+    residency->required_level = min(residency->required_level, level);
+}
+
+// Video memory of every level with storage
+static u64
+resident_texture_bytes(void) {
+    u64 bytes = 0;
+    for(u32 i = 0; i < texture_residency.texture_count; ++i) {
+        const TextureResidency* residency = texture_residency.textures[i];
+        bytes += residency_bytes(residency, residency->allocated_level);
+    }
+    return bytes;
+}
+
+// Sets every texture's wanted_level from what the draws since the last
+// update required, and starts over for the next
+static void
+update_texture_residency(void) {
+    TextureResidencyManager* manager = &texture_residency;
+    u64 total = 0;
+    for(u32 i = 0; i < manager->texture_count; ++i) {
+        TextureResidency* residency = manager->textures[i];
+        u32 needed = min(residency->required_level, residency->kept_level);
+        residency->wanted_level = residency->kept_level;
+        residency->unused_frames = residency->allocated_level < needed ? residency->unused_frames + 1 : 0;
+        total += residency_bytes(residency, residency->kept_level);
+    }
+
+    b32 handed_out = true;
+    b32 over_budget = false;
+    while(handed_out) {
+        handed_out = false;
+        for(u32 i = 0; i < manager->texture_count; ++i) {
+            TextureResidency* residency = manager->textures[i];
+            if(residency->wanted_level > residency->required_level) {
+                u32 size = residency->level_sizes[residency->wanted_level - 1];
+                if(total + size <= manager->budget) {
+                    --residency->wanted_level;
+                    total += size;
+                    handed_out = true;
+                } else {
+                    over_budget = true;
+                }
+            }
+        }
+    }
+
+    // What was recently used stays if it still fits
+    for(u32 i = 0; i < manager->texture_count; ++i) {
+        TextureResidency* residency = manager->textures[i];
+        if(residency->allocated_level < residency->wanted_level && residency->unused_frames < RESIDENCY_DROP_FRAMES) {
+            u64 size = residency_bytes(residency, residency->allocated_level) -
+                       residency_bytes(residency, residency->wanted_level);
+            if(total + size <= manager->budget) {
+                residency->wanted_level = residency->allocated_level;
+                total += size;
+            }
+        }
+        residency->required_level = residency->level_count;
+    }
+
+    manager->stats.over_budget_updates += over_budget;
+    manager->stats.peak_bytes = max(manager->stats.peak_bytes, resident_texture_bytes());
+}
+
+// Gives the bound texture storage for every level from first_level on.
+// The levels still need uploading, the base level stays.
+static void
+allocate_resident_levels(TextureResidency* residency, GLenum format, b32 compressed, u32 width, u32 height,
+                         u32 first_level) {
+    for(u32 i = first_level; i < residency->allocated_level; ++i) {
+        if(compressed) {
+            glCompressedTexImage2D(GL_TEXTURE_2D, i, format, mip_dimension(width, i), mip_dimension(height, i), 0,
+                                   residency->level_sizes[i], 0);
+        } else {
+            glTexImage2D(GL_TEXTURE_2D, i, format, mip_dimension(width, i), mip_dimension(height, i), 0,
+                         format, GL_UNSIGNED_BYTE, 0);
+        }
+        ++texture_residency.stats.levels_allocated;
+    }
+    residency->allocated_level = min(residency->allocated_level, first_level);
+}
+
+// Moves the bound texture's base level to first_level unless it's past it
+// already, and lets every level before it go, along with their uploads
+static void
+drop_resident_levels(TextureResidency* residency, u32 texture, GLenum format, b32 compressed, u32 first_level) {
+    cancel_texture_level_uploads(texture, 0, first_level);
+    if(residency->resident_level < first_level) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, first_level);
+        residency->resident_level = first_level;
+    }
+    for(u32 i = residency->allocated_level; i < first_level; ++i) {
+        if(compressed) {
+            glCompressedTexImage2D(GL_TEXTURE_2D, i, format, 0, 0, 0, 0, 0);
+        } else {
+            glTexImage2D(GL_TEXTURE_2D, i, format, 0, 0, 0, format, GL_UNSIGNED_BYTE, 0);
+        }
+        ++texture_residency.stats.levels_dropped;
+    }
+    residency->allocated_level = max(residency->allocated_level, first_level);
+}
+
+static void
+log_texture_residency(void) {
+    TextureResidencyStats* stats = &texture_residency.stats;
+    log_debug_message("Texture memory: %.2f MB of a %.2f MB budget, peak %.2f MB, %u levels allocated, "
+                      "%u dropped, %u updates over budget\n",
+                      (f64)resident_texture_bytes() / (1024.0 * 1024.0),
+                      (f64)texture_residency.budget / (1024.0 * 1024.0), (f64)stats->peak_bytes / (1024.0 * 1024.0),
+                      stats->levels_allocated, stats->levels_dropped, stats->over_budget_updates);
+    for(u32 i = 0; i < texture_residency.texture_count; ++i) {
+        const TextureResidency* residency = texture_residency.textures[i];
+        log_debug_message("  %s: level %u resident of %u, %u allocated, %u wanted, %.2f MB\n", residency->name,
+                          residency->resident_level, residency->level_count, residency->allocated_level,
+                          residency->wanted_level,
+                          (f64)residency_bytes(residency, residency->allocated_level) / (1024.0 * 1024.0));
+    }
+}
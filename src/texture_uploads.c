@@ -0,0 +1,396 @@
+/*
+  Texture uploads.
+
+  Pixels get to textures through one big pixel unpack buffer, persistently
+  mapped, rather than from client memory. The async I/O workers take a
+  slice of it as soon as an image is decoded and copy the levels in, see
+  decode_image, so the main thread never touches the pixels and the
+  driver doesn't have to copy them out of our memory before returning.
+  The main thread queues glTexSubImage2D calls that read from the slice's
+  offset, and process_texture_uploads issues them in order, at most a
+  budget of bytes per frame. Levels are split into bands of rows to stay
+  under it, so a big texture becomes resident over a few frames instead
+  of stalling one.
+
+  Slices are handed out like a ring. Once every upload reading from one
+  has been issued a fence goes in after them, and its space comes back
+  once the fence has passed and every slice before it has come back.
+
+  Every queued upload gets a ticket, in increasing order, and
+  texture_upload_done says whether it has been issued yet. Uploads given a
+  base_level move the texture's GL_TEXTURE_BASE_LEVEL to their level when
+  they finish, and store it there, so a texture uploaded smallest level
+  first can be drawn from its first finished level on.
+
+  Without ARB_buffer_storage there's nothing the workers can write to,
+  staging fails and textures are uploaded straight from memory instead.
+*/
+
+#define TEXTURE_UPLOAD_BUFFER_SIZE (16 * 1024 * 1024)
+#define TEXTURE_UPLOAD_FRAME_BUDGET (2 * 1024 * 1024)
+#define MAX_UPLOAD_SLICES 64
+#define MAX_TEXTURE_UPLOADS 256
+#define UPLOAD_SLICE_ALIGNMENT 256
+
+typedef enum {
+    UPLOAD_SLICE_FREE,
+    // Handed out, being filled or waiting for its uploads to be queued
+    UPLOAD_SLICE_FILLING,
+    // Uploads queued, the fence goes in after the last of them
+    UPLOAD_SLICE_SUBMITTED,
+    UPLOAD_SLICE_FENCED,
+    // Given back without uploading anything, nothing to wait for
+    UPLOAD_SLICE_RELEASED,
+} UploadSliceState;
+
+typedef struct {
+    UploadSliceState state;
+    u32 start;
+    u32 end;
+    u32 pending_uploads;
+    GLsync fence;
+} UploadSlice;
+
+typedef struct {
+    // Index of the slice + 1, 0 when nothing could be staged
+    u32 slice;
+    u8* data;
+    // Of data within the buffer
+    u32 offset;
+} UploadStaging;
+
+typedef struct {
+    // 0 once cancelled
+    u32 texture;
+    u32 level;
+    u32 x;
+    u32 y;
+    u32 width;
+    u32 height;
+    GLenum format;
+    b32 compressed;
+    // Bytes per row, or per row of 4x4 blocks when compressed
+    u32 row_size;
+    u32 rows_done;
+    u32 slice;
+    u32 offset;
+    // Set to the level once it's in, along with GL_TEXTURE_BASE_LEVEL
+    u32* base_level;
+    u64 ticket;
+} TextureUpload;
+
+typedef struct {
+    u64 bytes;
+    // That uploaded anything
+    u32 frames;
+    u32 peak_frame_bytes;
+    u32 uploads;
+    u32 staged;
+    u32 staging_failures;
+} TextureUploadStats;
+
+typedef struct {
+    u32 buffer;
+    u8* mapped;
+    SDL_mutex* mutex;
+
+    // The live ones start at first_slice, in the order they were handed out
+    UploadSlice slices[MAX_UPLOAD_SLICES];
+    u32 first_slice;
+    u32 slice_count;
+    // Where the next slice goes
+    u32 head;
+
+    TextureUpload queue[MAX_TEXTURE_UPLOADS];
+    u32 first_upload;
+    u32 upload_count;
+    u64 next_ticket;
+
+    TextureUploadStats stats;
+} TextureUploads;
+
+static TextureUploads texture_uploads;
+
+static void
+init_texture_uploads(GLState* gl_state) {
+    memset(&texture_uploads, 0, sizeof(texture_uploads));
+    texture_uploads.mutex = SDL_CreateMutex();
+    texture_uploads.next_ticket = 1;
+    if(!GLEW_ARB_buffer_storage) {
+        log_debug_message("No ARB_buffer_storage, textures upload from memory\n");
+        return;
+    }
+
+    glGenBuffers(1, &texture_uploads.buffer);
+    bind_buffer(gl_state, GL_PIXEL_UNPACK_BUFFER, texture_uploads.buffer);
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, TEXTURE_UPLOAD_BUFFER_SIZE, 0, flags);
+    texture_uploads.mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, TEXTURE_UPLOAD_BUFFER_SIZE, flags);
+    if(!texture_uploads.mapped) {
+        log_error_message("Couldn't map the texture upload buffer\n");
+        delete_buffer(gl_state, texture_uploads.buffer);
+        texture_uploads.buffer = 0;
+    }
+    bind_buffer(gl_state, GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+// Frees the oldest slices while they're done with, the fenced ones once
+// their fence has passed, which only the main thread can check. Expects
+// the lock.
+static void
+pop_finished_upload_slices(b32 check_fences) {
+    while(texture_uploads.slice_count) {
+        UploadSlice* slice = &texture_uploads.slices[texture_uploads.first_slice];
+        if(slice->state == UPLOAD_SLICE_FENCED && check_fences) {
+            GLenum result = glClientWaitSync(slice->fence, 0, 0);
+            if(result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED) {
+                break;
+            }
+            glDeleteSync(slice->fence);
+        } else if(slice->state != UPLOAD_SLICE_RELEASED) {
+            break;
+        }
+        slice->state = UPLOAD_SLICE_FREE;
+        texture_uploads.first_slice = (texture_uploads.first_slice + 1) % MAX_UPLOAD_SLICES;
+        --texture_uploads.slice_count;
+    }
+    if(!texture_uploads.slice_count) {
+        texture_uploads.head = 0;
+    }
+}
+
+// Takes a slice of the upload buffer from any thread. Returns one with a
+// slice of 0 when the buffer is full, the caller uploads from memory then.
+static UploadStaging
+stage_texture_upload(u32 size) {
+    UploadStaging staging = {0};
+    if(!texture_uploads.mapped) {
+        return staging;
+    }
+    size = (size + UPLOAD_SLICE_ALIGNMENT - 1) / UPLOAD_SLICE_ALIGNMENT * UPLOAD_SLICE_ALIGNMENT;
+
+    SDL_LockMutex(texture_uploads.mutex);
+    pop_finished_upload_slices(false);
+    u32 start = TEXTURE_UPLOAD_BUFFER_SIZE;
+    u32 head = texture_uploads.head;
+    if(!texture_uploads.slice_count) {
+        start = 0;
+    } else if(texture_uploads.slice_count < MAX_UPLOAD_SLICES) {
+        u32 tail = texture_uploads.slices[texture_uploads.first_slice].start;
+        if(head > tail) {
+            // In use from the tail to the head, free on both sides of it
+            if(head + size <= TEXTURE_UPLOAD_BUFFER_SIZE) {
+                start = head;
+            } else if(size <= tail) {
+                start = 0;
+            }
+        } else if(head + size <= tail) {
+            start = head;
+        }
+    }
+    if(start + size <= TEXTURE_UPLOAD_BUFFER_SIZE) {
+        u32 index = (texture_uploads.first_slice + texture_uploads.slice_count) % MAX_UPLOAD_SLICES;
+        UploadSlice* slice = &texture_uploads.slices[index];
+        memset(slice, 0, sizeof(*slice));
+        slice->state = UPLOAD_SLICE_FILLING;
+        slice->start = start;
+        slice->end   = start + size;
+        ++texture_uploads.slice_count;
+        texture_uploads.head = slice->end;
+
+        staging.slice  = index + 1;
+        staging.data   = texture_uploads.mapped + start;
+        staging.offset = start;
+        ++texture_uploads.stats.staged;
+    } else {
+        ++texture_uploads.stats.staging_failures;
+    }
+    SDL_UnlockMutex(texture_uploads.mutex);
+    return staging;
+}
+
+// Gives a slice back without uploading from it, from any thread
+static void
+release_texture_staging(UploadStaging* staging) {
+    if(staging->slice) {
+        SDL_LockMutex(texture_uploads.mutex);
+        texture_uploads.slices[staging->slice - 1].state = UPLOAD_SLICE_RELEASED;
+        SDL_UnlockMutex(texture_uploads.mutex);
+        memset(staging, 0, sizeof(*staging));
+    }
+}
+
+// Fences the slice once it's submitted and nothing is left to read it.
+// Expects the lock.
+static void
+fence_finished_slice(UploadSlice* slice) {
+    if(slice->state == UPLOAD_SLICE_SUBMITTED && !slice->pending_uploads) {
+        slice->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slice->state = UPLOAD_SLICE_FENCED;
+    }
+}
+
+// Everything the slice is needed for is queued
+static void
+submit_texture_staging(UploadStaging* staging) {
+    if(staging->slice) {
+        SDL_LockMutex(texture_uploads.mutex);
+        UploadSlice* slice = &texture_uploads.slices[staging->slice - 1];
+        slice->state = UPLOAD_SLICE_SUBMITTED;
+        fence_finished_slice(slice);
+        SDL_UnlockMutex(texture_uploads.mutex);
+        memset(staging, 0, sizeof(*staging));
+    }
+}
+
+static inline b32
+texture_upload_done(u64 ticket) {
+    u64 first_pending = texture_uploads.upload_count ?
+        texture_uploads.queue[texture_uploads.first_upload].ticket : texture_uploads.next_ticket;
+    return ticket < first_pending;
+}
+
+// Drops the uploads still queued for levels first_level up to end_level
+static void
+cancel_texture_level_uploads(u32 texture, u32 first_level, u32 end_level) {
+    for(u32 i = 0; i < texture_uploads.upload_count; ++i) {
+        TextureUpload* upload = &texture_uploads.queue[(texture_uploads.first_upload + i) % MAX_TEXTURE_UPLOADS];
+        if(upload->texture == texture && upload->level >= first_level && upload->level < end_level) {
+            upload->texture = 0;
+        }
+    }
+}
+
+// Call before deleting the texture
+static inline void
+cancel_texture_uploads(u32 texture) {
+    cancel_texture_level_uploads(texture, 0, ~0u);
+}
+
+static inline u32
+texture_upload_rows(TextureUpload* upload) {
+    return upload->compressed ? (upload->height + 3) / 4 : upload->height;
+}
+
+// Issues queued uploads until budget bytes have gone out this frame.
+// Anything that's left goes out in the next frames.
+static void
+process_texture_uploads(GLState* gl_state, u32 budget) {
+    SDL_LockMutex(texture_uploads.mutex);
+    pop_finished_upload_slices(true);
+    SDL_UnlockMutex(texture_uploads.mutex);
+
+    u32 frame_bytes = 0;
+    b32 bound = false;
+    while(texture_uploads.upload_count) {
+        TextureUpload* upload = &texture_uploads.queue[texture_uploads.first_upload];
+        if(upload->texture) {
+            u32 rows = texture_upload_rows(upload) - upload->rows_done;
+            u32 budget_rows = frame_bytes < budget ? (budget - frame_bytes) / upload->row_size : 0;
+            // At least one band a frame, even past the budget
+            if(!budget_rows && frame_bytes) {
+                break;
+            }
+            rows = min(rows, max(budget_rows, 1));
+
+            if(!bound) {
+                bind_buffer(gl_state, GL_PIXEL_UNPACK_BUFFER, texture_uploads.buffer);
+                // Rows of 3 or 1 byte pixels aren't always 4 byte aligned
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+                bound = true;
+            }
+            bind_texture_2d(gl_state, 0, upload->texture);
+            u32 size = rows * upload->row_size;
+            void* offset = (void*)(size_t)(upload->offset + upload->rows_done * upload->row_size);
+            if(upload->compressed) {
+                u32 y = upload->rows_done * 4;
+                u32 height = min(rows * 4, upload->height - y);
+                glCompressedTexSubImage2D(GL_TEXTURE_2D, upload->level, upload->x, upload->y + y, upload->width,
+                                          height, upload->format, size, offset);
+            } else {
+                glTexSubImage2D(GL_TEXTURE_2D, upload->level, upload->x, upload->y + upload->rows_done,
+                                upload->width, rows, upload->format, GL_UNSIGNED_BYTE, offset);
+            }
+            upload->rows_done += rows;
+            frame_bytes += size;
+            if(upload->rows_done < texture_upload_rows(upload)) {
+                break;
+            }
+            if(upload->base_level) {
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, upload->level);
+                *upload->base_level = upload->level;
+            }
+            ++texture_uploads.stats.uploads;
+        }
+
+        SDL_LockMutex(texture_uploads.mutex);
+        UploadSlice* slice = &texture_uploads.slices[upload->slice - 1];
+        --slice->pending_uploads;
+        fence_finished_slice(slice);
+        SDL_UnlockMutex(texture_uploads.mutex);
+        texture_uploads.first_upload = (texture_uploads.first_upload + 1) % MAX_TEXTURE_UPLOADS;
+        --texture_uploads.upload_count;
+    }
+    if(bound) {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        bind_buffer(gl_state, GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    if(frame_bytes) {
+        texture_uploads.stats.bytes += frame_bytes;
+        ++texture_uploads.stats.frames;
+        texture_uploads.stats.peak_frame_bytes = max(texture_uploads.stats.peak_frame_bytes, frame_bytes);
+    }
+}
+
+// Queues a region of one level to be uploaded from data_offset into the
+// staging slice. Rows are row_size bytes apart, rows of blocks for a
+// compressed format. Returns the upload's ticket.
+static u64
+queue_texture_upload(GLState* gl_state, UploadStaging* staging, u32 data_offset, u32 texture, u32 level,
+                     u32 x, u32 y, u32 width, u32 height, GLenum format, b32 compressed, u32 row_size,
+                     u32* base_level) {
+    if(texture_uploads.upload_count == MAX_TEXTURE_UPLOADS) {
+        // Not expected to happen, but the queue can always be emptied
+        process_texture_uploads(gl_state, ~0u);
+    }
+    u32 index = (texture_uploads.first_upload + texture_uploads.upload_count++) % MAX_TEXTURE_UPLOADS;
+    TextureUpload* upload = &texture_uploads.queue[index];
+    memset(upload, 0, sizeof(*upload));
+    upload->texture    = texture;
+    upload->level      = level;
+    upload->x          = x;
+    upload->y          = y;
+    upload->width      = width;
+    upload->height     = height;
+    upload->format     = format;
+    upload->compressed = compressed;
+    upload->row_size   = row_size;
+    upload->slice      = staging->slice;
+    upload->offset     = staging->offset + data_offset;
+    upload->base_level = base_level;
+    upload->ticket     = texture_uploads.next_ticket++;
+
+    SDL_LockMutex(texture_uploads.mutex);
+    ++texture_uploads.slices[staging->slice - 1].pending_uploads;
+    SDL_UnlockMutex(texture_uploads.mutex);
+    return upload->ticket;
+}
+
+// After the async I/O workers are gone, nothing stages any more
+static void
+shutdown_texture_uploads(GLState* gl_state) {
+    for(u32 i = 0; i < MAX_UPLOAD_SLICES; ++i) {
+        if(texture_uploads.slices[i].state == UPLOAD_SLICE_FENCED) {
+            glDeleteSync(texture_uploads.slices[i].fence);
+        }
+    }
+    if(texture_uploads.buffer) {
+        bind_buffer(gl_state, GL_PIXEL_UNPACK_BUFFER, texture_uploads.buffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        bind_buffer(gl_state, GL_PIXEL_UNPACK_BUFFER, 0);
+        delete_buffer(gl_state, texture_uploads.buffer);
+    }
+    SDL_DestroyMutex(texture_uploads.mutex);
+    memset(&texture_uploads, 0, sizeof(texture_uploads));
+}
@@ -0,0 +1,825 @@
+/*
+  Textures.
+
+  load_texture looks for a cooked .dds next to the source image first,
+  see texture_cooker.c. Its levels are block compressed already, there's
+  nothing to decode and nothing to generate. Without one the source image
+  is read and decoded on the async I/O workers, see decode_image, which
+  also builds its mips there with mip_chain.c, so the driver never has to.
+  Large chains are split into bands that the idle workers help with. The
+  edges wrap, like the GL_REPEAT the textures are sampled with.
+
+  Either way the worker ends by copying the levels into a slice of the
+  texture upload buffer, see texture_uploads.c. poll_texture then only
+  allocates the texture and queues the uploads, smallest level first, and
+  the texture can be drawn once the smallest level is in. A reload keeps
+  the old texture until all of the new one is. When the upload buffer is
+  full the levels stay in memory and are uploaded from there, all at
+  once, by upload_texture_levels.
+
+  Only the levels texture_residency.c asks for are read. A first load
+  gets the small ones it always keeps, apply_texture_residency reads the
+  file again for finer ones once draws need them, copying just those
+  levels out, and drops them when the budget says so.
+
+  Decoded textures that are small enough go into a texture atlas page
+  instead when poll_texture is given one, see texture_atlas.c, and
+  texture_binding hands out the page along with where the texture is in
+  it. Cooked textures are block compressed and always get their own.
+
+  Hot reloads of the source read the source, it's newer than the cooked
+  file, and cooking again reloads the .dds.
+
+  Decoding a jpg or png and filtering its mips costs far more than
+  reading it, and gives the same pixels every time, so the whole chain is
+  kept in the derived data cache, keyed by a hash of the file's contents and how it was decoded.
+  After the first launch a texture is a hash of the file and a mapped view
+  of its pixels, the decoder never runs.
+*/
+
+// Bump when decoding changes what ends up in the cache
+#define DECODED_IMAGE_VERSION "decoded image 2"
+
+typedef struct {
+    i32 width;
+    i32 height;
+    i32 channels;
+    // Every level one after the other, see mip_chain_offsets
+    u32 level_count;
+    size_t size;
+    u8* pixels;
+    // Set when the pixels point into a cached entry rather than the heap
+    b32 cached;
+    DerivedData derived;
+    // The levels to upload, from first_level up to end_level
+    u32 first_level;
+    u32 end_level;
+    // Where those went instead when they were staged, pixels is 0 then
+    UploadStaging staging;
+} DecodedImage;
+
+// What a decoded image is stored as, the levels follow
+typedef struct {
+    i32 width;
+    i32 height;
+    i32 channels;
+    u32 level_count;
+} CachedImageHeader;
+
+// Whatever changes the decoded pixels for the same file
+typedef struct {
+    u32 flip;
+} DecodedImageParameters;
+
+// decode_image's flags
+#define DECODE_IMAGE_FLIP 0x1
+// Copy into an upload slice on the worker
+#define DECODE_IMAGE_STAGE 0x2
+// Unless the atlas would take it, that needs the pixels in memory
+#define DECODE_IMAGE_ATLAS 0x4
+
+// The levels residency keeps whatever the budget, see texture_read_levels
+#define READ_KEPT_LEVELS 0xff
+
+// decode_image's and read_cooked_texture's user_data, the flags and which
+// levels to stage, from first_level up to end_level. end_level 0 is up to
+// the last one.
+static inline void*
+texture_read_user_data(u32 flags, u32 first_level, u32 end_level) {
+    return (void*)(size_t)(flags | first_level << 8 | end_level << 16);
+}
+
+static inline u32
+texture_read_flags(void* user_data) {
+    return (u32)(size_t)user_data & 0xff;
+}
+
+// The levels user_data asks for, clamped to the ones there are
+static void
+texture_read_levels(void* user_data, u32 width, u32 height, u32 level_count, u32* first_level, u32* end_level) {
+    u32 parameters = (u32)(size_t)user_data;
+    u32 first = (parameters >> 8) & 0xff;
+    u32 end   = (parameters >> 16) & 0xff;
+    end = end ? min(end, level_count) : level_count;
+    if(first == READ_KEPT_LEVELS) {
+        first = residency_kept_level(width, height, level_count);
+    }
+    *first_level = min(first, end - 1);
+    *end_level   = end;
+}
+
+static b32
+load_cached_image(u64 key, DecodedImage* image) {
+    if(!load_derived_data(key, &image->derived)) {
+        return false;
+    }
+    const CachedImageHeader* header = (const CachedImageHeader*)image->derived.data;
+    size_t offsets[MAX_MIP_LEVELS];
+    if(image->derived.size < sizeof(*header) || header->level_count > MAX_MIP_LEVELS ||
+       image->derived.size != sizeof(*header) + mip_chain_offsets(header->width, header->height, header->channels,
+                                                                  header->level_count, offsets)) {
+        free_derived_data(&image->derived);
+        return false;
+    }
+    image->width       = header->width;
+    image->height      = header->height;
+    image->channels    = header->channels;
+    image->level_count = header->level_count;
+    image->size        = image->derived.size - sizeof(*header);
+    image->pixels      = (u8*)(header + 1);
+    image->cached      = true;
+    return true;
+}
+
+static void
+store_cached_image(u64 key, const DecodedImage* image) {
+    CachedImageHeader header = {0};
+    header.width       = image->width;
+    header.height      = image->height;
+    header.channels    = image->channels;
+    header.level_count = image->level_count;
+    u8* data = malloc(sizeof(header) + image->size);
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), image->pixels, image->size);
+    store_derived_data(key, data, sizeof(header) + image->size);
+    free(data);
+}
+
+static void
+free_decoded_pixels(DecodedImage* image) {
+    if(image->cached) {
+        free_derived_data(&image->derived);
+    } else {
+        free(image->pixels);
+    }
+    image->pixels = 0;
+    image->cached = false;
+}
+
+// Where first_level starts in the pixels and how many bytes it is up to end_level
+static size_t
+decoded_level_range(const DecodedImage* image, size_t* size) {
+    size_t offsets[MAX_MIP_LEVELS];
+    mip_chain_offsets(image->width, image->height, image->channels, image->level_count, offsets);
+    size_t end = image->end_level < image->level_count ? offsets[image->end_level] : image->size;
+    *size = end - offsets[image->first_level];
+    return offsets[image->first_level];
+}
+
+// Moves the levels to upload into an upload slice, they stay where they
+// are if there's no room for them
+static void
+stage_decoded_image(DecodedImage* image) {
+    size_t size;
+    size_t offset = decoded_level_range(image, &size);
+    image->staging = stage_texture_upload((u32)size);
+    if(image->staging.slice) {
+        memcpy(image->staging.data, image->pixels + offset, size);
+        free_decoded_pixels(image);
+    }
+}
+
+static void
+run_mip_job_on_worker(void* data) {
+    run_mip_job(data);
+}
+
+// Runs on an I/O worker. When the first level down has more than one band
+// the idle workers take bands too, smaller chains aren't worth waking them.
+static b32
+build_texture_mip_chain(MipChain* chain, MipSettings settings) {
+    MipJob job;
+    init_mip_job(&job, chain, settings);
+    if(chain->level_count > 1 && mip_level_band_count(&job, 1) > 1) {
+        share_async_work(run_mip_job_on_worker, &job);
+    } else {
+        run_mip_job(&job);
+    }
+    return !job.failed;
+}
+
+// Async read decode function, runs on an I/O worker. user_data holds
+// DECODE_IMAGE flags and the levels to stage. The whole chain is decoded
+// and cached either way. Flips the rows itself, stb_image's flip setting is
+// shared by all threads. The filtering reads each level back, so the
+// chain is built in memory and copied to the upload buffer once it's
+// done, reading from write combined memory would be much slower.
+static void*
+decode_image(const char* data, size_t size, void* user_data) {
+    u32 flags = texture_read_flags(user_data);
+    DecodedImageParameters parameters = {0};
+    parameters.flip = (flags & DECODE_IMAGE_FLIP) != 0;
+    u64 key = derived_data_key(DECODED_IMAGE_VERSION, hash_bytes_64(data, size), &parameters, sizeof(parameters));
+
+    DecodedImage image = {0};
+    if(!load_cached_image(key, &image)) {
+        u8* pixels = stbi_load_from_memory((const u8*)data, (i32)size, &image.width, &image.height,
+                                           &image.channels, 0);
+        if(!pixels) {
+            return 0;
+        }
+        if(parameters.flip) {
+            size_t row_size = (size_t)image.width * image.channels;
+            u8* row = malloc(row_size);
+            for(i32 y = 0; y < image.height / 2; ++y) {
+                u8* top    = pixels + y * row_size;
+                u8* bottom = pixels + (image.height - 1 - y) * row_size;
+                memcpy(row, top, row_size);
+                memcpy(top, bottom, row_size);
+                memcpy(bottom, row, row_size);
+            }
+            free(row);
+        }
+
+        // Textures are sampled with GL_REPEAT
+        MipSettings settings = choose_mip_settings(pixels, image.width, image.height, image.channels, true);
+        MipChain chain;
+        init_mip_chain(&chain, pixels, image.width, image.height, image.channels);
+        stbi_image_free(pixels);
+        if(!build_texture_mip_chain(&chain, settings)) {
+            free_mip_chain(&chain);
+            return 0;
+        }
+        image.level_count = chain.level_count;
+        image.size        = chain.size;
+        image.pixels      = chain.pixels;
+        store_cached_image(key, &image);
+    }
+    texture_read_levels(user_data, image.width, image.height, image.level_count, &image.first_level,
+                        &image.end_level);
+    if(flags & DECODE_IMAGE_STAGE) {
+        b32 atlased = (flags & DECODE_IMAGE_ATLAS) &&
+                      atlas_accepts(image.width, image.height, image.channels, image.level_count);
+        if(!atlased) {
+            stage_decoded_image(&image);
+        }
+    }
+    DecodedImage* result = malloc(sizeof(DecodedImage));
+    *result = image;
+    return result;
+}
+
+static void
+free_decoded_image(void* result) {
+    DecodedImage* image = result;
+    release_texture_staging(&image->staging);
+    if(image->pixels) {
+        free_decoded_pixels(image);
+    }
+    free(image);
+}
+
+// 0 for a channel count there's no format for
+static GLenum
+image_gl_format(i32 channels) {
+    switch(channels) {
+        case 1: return GL_RED;
+        case 3: return GL_RGB;
+        case 4: return GL_RGBA;
+        default: return 0;
+    }
+}
+
+static inline void
+set_texture_sampling(u32 level_count) {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level_count - 1);
+}
+
+static GLenum
+cooked_texture_gl_format(CookedTextureFormat format) {
+    switch(format) {
+        case COOKED_FORMAT_BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case COOKED_FORMAT_BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case COOKED_FORMAT_BC4: return GL_COMPRESSED_RED_RGTC1;
+        case COOKED_FORMAT_BC5: return GL_COMPRESSED_RG_RGTC2;
+        default: return 0;
+    }
+}
+
+// A cooked texture read on a worker, the levels' data pointers are 0
+typedef struct {
+    CookedTexture cooked;
+    // The levels to upload, from first_level up to end_level
+    u32 first_level;
+    u32 end_level;
+    // Holds those levels one after the other
+    UploadStaging staging;
+    // Or a copy of them when there was no room to stage them
+    u8* data;
+} CookedTextureRead;
+
+// Async read decode function for a .dds, runs on an I/O worker. user_data
+// holds the levels to stage, see texture_read_user_data. Fails if it isn't
+// one we can load, the source gets decoded instead then.
+static void*
+read_cooked_texture(const char* data, size_t size, void* user_data) {
+    CookedTextureRead read = {0};
+    if(!parse_cooked_texture(data, size, &read.cooked)) {
+        return 0;
+    }
+    texture_read_levels(user_data, read.cooked.levels[0].width, read.cooked.levels[0].height,
+                        read.cooked.level_count, &read.first_level, &read.end_level);
+    u32 total_size = 0;
+    for(u32 i = read.first_level; i < read.end_level; ++i) {
+        total_size += read.cooked.levels[i].size;
+    }
+    read.staging = stage_texture_upload(total_size);
+    if(!read.staging.slice) {
+        read.data = malloc(total_size);
+    }
+    u8* out = read.staging.slice ? read.staging.data : read.data;
+    for(u32 i = read.first_level; i < read.end_level; ++i) {
+        memcpy(out, read.cooked.levels[i].data, read.cooked.levels[i].size);
+        out += read.cooked.levels[i].size;
+    }
+    // They point into the file, which is gone once this returns
+    for(u32 i = 0; i < read.cooked.level_count; ++i) {
+        read.cooked.levels[i].data = 0;
+    }
+    CookedTextureRead* result = malloc(sizeof(CookedTextureRead));
+    *result = read;
+    return result;
+}
+
+static void
+free_cooked_texture_read(void* result) {
+    CookedTextureRead* read = result;
+    release_texture_staging(&read->staging);
+    free(read->data);
+    free(read);
+}
+
+// How a texture's levels sit one after the other, a range of them gets staged
+typedef struct {
+    GLenum format;
+    b32 compressed;
+    u32 width;
+    u32 height;
+    u32 level_count;
+    u32 level_offsets[MAX_MIP_LEVELS];
+    u32 level_sizes[MAX_MIP_LEVELS];
+    // Bytes per row, per row of blocks when compressed
+    u32 row_sizes[MAX_MIP_LEVELS];
+} StagedTextureLayout;
+
+static void
+decoded_image_layout(const DecodedImage* image, StagedTextureLayout* layout) {
+    memset(layout, 0, sizeof(*layout));
+    layout->format      = image_gl_format(image->channels);
+    layout->width       = image->width;
+    layout->height      = image->height;
+    layout->level_count = image->level_count;
+    size_t offsets[MAX_MIP_LEVELS];
+    mip_chain_offsets(image->width, image->height, image->channels, image->level_count, offsets);
+    for(u32 i = 0; i < image->level_count; ++i) {
+        layout->level_offsets[i] = (u32)offsets[i];
+        layout->row_sizes[i]     = mip_dimension(image->width, i) * image->channels;
+        layout->level_sizes[i]   = layout->row_sizes[i] * mip_dimension(image->height, i);
+    }
+}
+
+static void
+cooked_texture_layout(const CookedTexture* cooked, StagedTextureLayout* layout) {
+    memset(layout, 0, sizeof(*layout));
+    layout->format      = cooked_texture_gl_format(cooked->format);
+    layout->compressed  = true;
+    layout->width       = cooked->levels[0].width;
+    layout->height      = cooked->levels[0].height;
+    layout->level_count = cooked->level_count;
+    u32 offset = 0;
+    for(u32 i = 0; i < cooked->level_count; ++i) {
+        const CookedTextureLevel* level = &cooked->levels[i];
+        layout->level_offsets[i] = offset;
+        layout->level_sizes[i]   = level->size;
+        layout->row_sizes[i]     = ((level->width + 3) / 4) * cooked_format_block_sizes[cooked->format];
+        offset += level->size;
+    }
+}
+
+
+// Levels first_level up to end_level of a texture, one after the other in
+// an upload slice, or in memory when there was no room
+typedef struct {
+    StagedTextureLayout layout;
+    u32 first_level;
+    u32 end_level;
+    UploadStaging staging;
+    const u8* data;
+} TextureLevels;
+
+// Gives the bound texture storage for the levels and uploads them. Staged
+// ones are queued smallest first, each one becomes the base level once
+// it's in, last_ticket is the last of them. From memory they go all at
+// once. residency follows along.
+static void
+upload_texture_levels(GLState* gl_state, u32 texture, TextureLevels* levels, TextureResidency* residency,
+                      u64* last_ticket) {
+    const StagedTextureLayout* layout = &levels->layout;
+    allocate_resident_levels(residency, layout->format, layout->compressed, layout->width, layout->height,
+                             levels->first_level);
+    u32 first_offset = layout->level_offsets[levels->first_level];
+    *last_ticket = 0;
+    if(levels->staging.slice) {
+        for(u32 i = levels->end_level; i-- > levels->first_level;) {
+            *last_ticket = queue_texture_upload(gl_state, &levels->staging, layout->level_offsets[i] - first_offset,
+                                                texture, i, 0, 0, mip_dimension(layout->width, i),
+                                                mip_dimension(layout->height, i), layout->format,
+                                                layout->compressed, layout->row_sizes[i],
+                                                &residency->resident_level);
+        }
+        submit_texture_staging(&levels->staging);
+        return;
+    }
+
+    // Rows of 3 or 1 byte pixels aren't always 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for(u32 i = levels->first_level; i < levels->end_level; ++i) {
+        const u8* data = levels->data + layout->level_offsets[i] - first_offset;
+        u32 width  = mip_dimension(layout->width, i);
+        u32 height = mip_dimension(layout->height, i);
+        if(layout->compressed) {
+            glCompressedTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, width, height, layout->format,
+                                      layout->level_sizes[i], data);
+        } else {
+            glTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, width, height, layout->format, GL_UNSIGNED_BYTE, data);
+        }
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, levels->first_level);
+    residency->resident_level = levels->first_level;
+}
+
+// A texture with only the given levels, it can be drawn once its smallest
+// one is in, residency says when
+static u32
+create_texture(GLState* gl_state, TextureLevels* levels, TextureResidency* residency, u64* last_ticket) {
+    u32 texture;
+    glGenTextures(1, &texture);
+    bind_texture_2d(gl_state, 0, texture);
+    set_texture_sampling(levels->layout.level_count);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, levels->end_level - 1);
+    upload_texture_levels(gl_state, texture, levels, residency, last_ticket);
+    return texture;
+}
+
+typedef struct {
+    const char* path;
+    char cooked_path[MAX_COOKED_TEXTURE_PATH_LENGTH];
+    u32 texture;
+    // Its entry in the atlas instead of a texture of its own, 0 for none
+    u32 atlas_entry;
+    // Decoded into the atlas if it fits
+    b32 use_atlas;
+    // Where texture came from and its levels, which stream in and out
+    b32 cooked;
+    StagedTextureLayout layout;
+    TextureResidency residency;
+
+    // A reload still uploading, replaces texture once pending_ticket is done
+    u32 pending_texture;
+    u64 pending_ticket;
+    b32 pending_cooked;
+    StagedTextureLayout pending_layout;
+    TextureResidency pending_residency;
+
+    AsyncReadHandle read;
+    // Reading the .dds, the source is tried if that fails
+    b32 reading_cooked;
+    // The read is for more levels of texture rather than a new one
+    b32 streaming;
+    // The last upload of streamed levels, nothing more is read until it's done
+    u64 stream_ticket;
+    // Until the next reload, the file may be gone
+    b32 stream_failed;
+    // When the change that started a reload was seen, 0 for the first load
+    u64 reload_counter;
+} Texture;
+
+typedef struct {
+    u32 cooked;
+    u32 decoded;
+    u32 atlased;
+    // Uploaded through the upload buffer rather than from memory
+    u32 staged;
+    // Reads for more levels
+    u32 streamed;
+    u64 cooked_bytes;
+    // Estimated as RGBA8 with mips
+    u64 decoded_bytes;
+} TextureStats;
+
+static TextureStats texture_stats;
+
+// Levels first_level up to end_level, 0 for all of them
+static void
+request_texture_read(Texture* texture, b32 cooked, u32 first_level, u32 end_level) {
+    cancel_async_read(texture->read);
+    texture->reading_cooked = cooked;
+    texture->streaming = false;
+    if(cooked) {
+        texture->read = request_async_read(texture->cooked_path, ASYNC_READ_PRIORITY_HIGH, read_cooked_texture,
+                                           free_cooked_texture_read,
+                                           texture_read_user_data(0, first_level, end_level));
+    } else {
+        u32 flags = DECODE_IMAGE_FLIP | DECODE_IMAGE_STAGE;
+        // More levels of a texture of its own don't go in the atlas
+        if(texture->use_atlas && !end_level) {
+            flags |= DECODE_IMAGE_ATLAS;
+        }
+        texture->read = request_async_read(texture->path, ASYNC_READ_PRIORITY_HIGH, decode_image,
+                                           free_decoded_image, texture_read_user_data(flags, first_level, end_level));
+    }
+}
+
+// The cooked formats need S3TC, RGTC is core
+static inline b32
+cooked_textures_supported(void) {
+    return GLEW_EXT_texture_compression_s3tc;
+}
+
+// Starts reading, poll_texture finishes it. path has to stay around.
+// use_atlas says whether poll_texture will be given an atlas.
+static void
+load_texture(Texture* texture, const char* path, b32 use_atlas) {
+    memset(texture, 0, sizeof(*texture));
+    texture->path = path;
+    texture->use_atlas = use_atlas;
+    cooked_texture_path(path, texture->cooked_path, sizeof(texture->cooked_path));
+    request_texture_read(texture, cooked_textures_supported() && file_exists(texture->cooked_path),
+                         READ_KEPT_LEVELS, 0);
+}
+
+// Reads the texture again if changed_path is its source or its .dds.
+// Returns false if it's neither.
+static b32
+reload_texture(Texture* texture, const char* changed_path, u64 change_counter) {
+    b32 cooked = strcmp(changed_path, texture->cooked_path) == 0;
+    if(!cooked && strcmp(changed_path, texture->path) != 0) {
+        return false;
+    }
+    // With the levels it has now
+    u32 first_level = texture->texture ? texture->residency.allocated_level : READ_KEPT_LEVELS;
+    request_texture_read(texture, cooked && cooked_textures_supported(), first_level, 0);
+    texture->reload_counter = change_counter;
+    texture->stream_failed = false;
+    return true;
+}
+
+static void
+delete_uploading_texture(GLState* gl_state, u32 texture) {
+    cancel_texture_uploads(texture);
+    delete_texture(gl_state, texture);
+}
+
+// Replaces whatever the texture had with new_texture or atlas_entry, the
+// caller sets up new_texture's residency
+static void
+swap_in_texture(GLState* gl_state, TextureAtlas* atlas, Texture* texture, u32 new_texture, u32 atlas_entry) {
+    if(texture->texture) {
+        delete_uploading_texture(gl_state, texture->texture);
+        untrack_texture_residency(&texture->residency);
+    }
+    if(texture->atlas_entry) {
+        free_atlas_texture(atlas, texture->atlas_entry);
+    }
+    texture->texture = new_texture;
+    texture->atlas_entry = atlas_entry;
+    texture->stream_ticket = 0;
+    if(texture->reload_counter) {
+        log_debug_message("Reloaded %s %.2f ms after the change\n", texture->path,
+                          elapsed_ms(texture->reload_counter));
+        texture->reload_counter = 0;
+    }
+}
+
+// Uploads streamed levels into the texture, unless the file changed size
+// or format since, a reload is on its way then
+static void
+stream_in_texture(GLState* gl_state, Texture* texture, TextureLevels* levels) {
+    if(memcmp(&levels->layout, &texture->layout, sizeof(texture->layout)) != 0) {
+        return;
+    }
+    bind_texture_2d(gl_state, 0, texture->texture);
+    upload_texture_levels(gl_state, texture->texture, levels, &texture->residency, &texture->stream_ticket);
+    ++texture_stats.streamed;
+}
+
+// Starts uploading the texture once its read is done, into the atlas if
+// there is one and it fits, and swaps it in when enough of it is there.
+// A reload that fails keeps the old texture.
+static void
+poll_texture(RenderContext* render_context, TextureAtlas* atlas, Texture* texture) {
+    GLState* gl_state = &render_context->gl_state;
+    AsyncReadStatus status = async_read_status(texture->read);
+    if(status == ASYNC_READ_DONE) {
+        TextureLevels levels;
+        memset(&levels, 0, sizeof(levels));
+        b32 has_levels = false;
+        u32 atlas_entry = 0;
+        CookedTextureRead* read = 0;
+        DecodedImage* image = 0;
+        if(texture->reading_cooked) {
+            read = take_async_read_result(texture->read);
+            cooked_texture_layout(&read->cooked, &levels.layout);
+            levels.first_level = read->first_level;
+            levels.end_level   = read->end_level;
+            levels.staging     = read->staging;
+            levels.data        = read->data;
+            memset(&read->staging, 0, sizeof(read->staging));
+            has_levels = true;
+            if(!texture->streaming) {
+                ++texture_stats.cooked;
+                for(u32 i = 0; i < read->cooked.level_count; ++i) {
+                    texture_stats.cooked_bytes += read->cooked.levels[i].size;
+                }
+            }
+        } else {
+            image = take_async_read_result(texture->read);
+            if(atlas && image->pixels && !texture->streaming) {
+                // Updated in place, or moved out if it doesn't fit any more
+                atlas_entry = set_atlas_texture(gl_state, atlas, texture->atlas_entry, image->pixels,
+                                                image->width, image->height, image->channels,
+                                                image->level_count);
+                texture->atlas_entry = 0;
+            }
+            if(atlas_entry) {
+                ++texture_stats.atlased;
+            } else if(image_gl_format(image->channels)) {
+                // The worker had no room for it, or left it for the atlas
+                if(!image->staging.slice) {
+                    stage_decoded_image(image);
+                }
+                decoded_image_layout(image, &levels.layout);
+                levels.first_level = image->first_level;
+                levels.end_level   = image->end_level;
+                levels.staging     = image->staging;
+                if(image->pixels) {
+                    size_t size;
+                    levels.data = image->pixels + decoded_level_range(image, &size);
+                }
+                memset(&image->staging, 0, sizeof(image->staging));
+                has_levels = true;
+            } else {
+                log_error_message("Can't make a texture with %d channels\n", image->channels);
+            }
+            if(!texture->streaming) {
+                ++texture_stats.decoded;
+                texture_stats.decoded_bytes += image->width * image->height * 4 * 4 / 3;
+            }
+        }
+        texture->read = 0;
+
+        if(texture->streaming) {
+            if(has_levels) {
+                stream_in_texture(gl_state, texture, &levels);
+            }
+            texture->streaming = false;
+        } else if(has_levels) {
+            const StagedTextureLayout* layout = &levels.layout;
+            texture_stats.staged += levels.staging.slice != 0;
+            if(!texture->texture && !texture->atlas_entry) {
+                // A first load is drawn from its smallest level on
+                u64 last_ticket;
+                texture->cooked = texture->reading_cooked;
+                texture->layout = *layout;
+                track_texture_residency(&texture->residency, texture->path, layout->width, layout->height,
+                                        layout->level_count, layout->level_sizes);
+                texture->texture = create_texture(gl_state, &levels, &texture->residency, &last_ticket);
+            } else {
+                // A reload once all of it is there
+                if(texture->pending_texture) {
+                    delete_uploading_texture(gl_state, texture->pending_texture);
+                }
+                texture->pending_cooked = texture->reading_cooked;
+                texture->pending_layout = *layout;
+                reset_texture_residency(&texture->pending_residency, texture->path, layout->width, layout->height,
+                                        layout->level_count, layout->level_sizes);
+                texture->pending_texture = create_texture(gl_state, &levels, &texture->pending_residency,
+                                                          &texture->pending_ticket);
+            }
+        } else if(atlas_entry) {
+            swap_in_texture(gl_state, atlas, texture, 0, atlas_entry);
+        } else {
+            texture->reload_counter = 0;
+        }
+        // Unused if the streamed levels didn't match
+        release_texture_staging(&levels.staging);
+        if(read) {
+            free_cooked_texture_read(read);
+        }
+        if(image) {
+            free_decoded_image(image);
+        }
+    } else if(status == ASYNC_READ_FAILED) {
+        cancel_async_read(texture->read);
+        texture->read = 0;
+        if(texture->streaming) {
+            log_error_message("Couldn't read more levels of %s\n", texture->path);
+            texture->streaming = false;
+            texture->stream_failed = true;
+        } else if(texture->reading_cooked) {
+            log_error_message("Couldn't load %s, decoding %s instead\n", texture->cooked_path, texture->path);
+            u32 first_level = texture->texture ? texture->residency.allocated_level : READ_KEPT_LEVELS;
+            request_texture_read(texture, false, first_level, 0);
+        } else {
+            log_error_message("Error loading texture %s\n", texture->path);
+            texture->reload_counter = 0;
+        }
+    }
+
+    if(texture->pending_texture && texture_upload_done(texture->pending_ticket)) {
+        swap_in_texture(gl_state, atlas, texture, texture->pending_texture, 0);
+        const StagedTextureLayout* layout = &texture->pending_layout;
+        texture->cooked = texture->pending_cooked;
+        texture->layout = *layout;
+        track_texture_residency(&texture->residency, texture->path, layout->width, layout->height,
+                                layout->level_count, layout->level_sizes);
+        texture->residency.allocated_level = texture->pending_residency.allocated_level;
+        texture->residency.resident_level  = texture->pending_residency.resident_level;
+        texture->pending_texture = 0;
+    }
+}
+
+// Asks residency for the detail a draw needs. The texture is drawn with
+// uv_density uv units per world unit, where a world unit covers
+// pixels_per_unit pixels.
+static void
+require_texture_detail(TextureAtlas* atlas, Texture* texture, f32 uv_density, f32 pixels_per_unit) {
+    if(texture->atlas_entry) {
+        const AtlasEntry* entry = &atlas->entries[texture->atlas_entry - 1];
+        u32 level = texture_detail_level(max(entry->width, entry->height), uv_density, pixels_per_unit);
+        require_texture_level(&atlas->pages[entry->page].residency, min(level, ATLAS_LEVEL_COUNT - 1));
+    } else if(texture->texture) {
+        u32 level = texture_detail_level(max(texture->layout.width, texture->layout.height), uv_density,
+                                         pixels_per_unit);
+        require_texture_level(&texture->residency, min(level, texture->residency.level_count - 1));
+    }
+}
+
+// Drops levels or reads more of them to what update_texture_residency
+// wants. Nothing is read while the texture is being loaded again.
+static void
+apply_texture_residency(GLState* gl_state, Texture* texture) {
+    TextureResidency* residency = &texture->residency;
+    if(!texture->texture || (texture->read && !texture->streaming)) {
+        return;
+    }
+    if(residency->wanted_level > residency->allocated_level) {
+        if(texture->streaming) {
+            cancel_async_read(texture->read);
+            texture->read = 0;
+            texture->streaming = false;
+        }
+        bind_texture_2d(gl_state, 0, texture->texture);
+        drop_resident_levels(residency, texture->texture, texture->layout.format, texture->layout.compressed,
+                             residency->wanted_level);
+    }
+    b32 streaming = texture->streaming || !texture_upload_done(texture->stream_ticket);
+    if(residency->wanted_level < residency->resident_level && !streaming && !texture->stream_failed) {
+        request_texture_read(texture, texture->cooked, residency->wanted_level, residency->resident_level);
+        texture->streaming = true;
+    }
+}
+
+static inline b32
+texture_ready(const TextureAtlas* atlas, const Texture* texture) {
+    if(texture->atlas_entry) {
+        return texture_upload_done(atlas->entries[texture->atlas_entry - 1].upload_ticket);
+    }
+    return texture->texture && texture->residency.resident_level < texture->residency.level_count;
+}
+
+// What a draw binds for it, its atlas page when it's in one
+static TextureBinding
+texture_binding(const TextureAtlas* atlas, const Texture* texture) {
+    TextureBinding binding;
+    if(texture->atlas_entry) {
+        const AtlasEntry* entry = &atlas->entries[texture->atlas_entry - 1];
+        binding.texture      = atlas->pages[entry->page].texture;
+        binding.uv_transform = entry->uv_transform;
+    } else {
+        binding.texture      = texture->texture;
+        binding.uv_transform = identity_uv_transform();
+    }
+    return binding;
+}
+
+static void
+free_texture(GLState* gl_state, TextureAtlas* atlas, Texture* texture) {
+    cancel_async_read(texture->read);
+    if(texture->texture) {
+        delete_uploading_texture(gl_state, texture->texture);
+        untrack_texture_residency(&texture->residency);
+    }
+    if(texture->pending_texture) {
+        delete_uploading_texture(gl_state, texture->pending_texture);
+    }
+    if(texture->atlas_entry) {
+        free_atlas_texture(atlas, texture->atlas_entry);
+    }
+    memset(texture, 0, sizeof(*texture));
+}
@@ -35,8 +35,17 @@ typedef struct {
 
 typedef struct {
     u32 vao;
+    // Index count for indexed meshes, vertex count otherwise
     u32 count;
+    // ShaderHandle, resolved to a GL program at draw time, see async_shaders.c
     u32 shader_program;
+    // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, 0 when the mesh isn't indexed
+    u32 index_type;
+    // Where the mesh starts in buffers shared with other meshes, see mesh_pool.c
+    u32 first_index;
+    i32 base_vertex;
+    // Dequantizes positions in the vertex shader, 1 for float positions
+    Vec3 position_scale;
 } Mesh;
 
 typedef struct {
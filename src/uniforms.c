@@ -0,0 +1,343 @@
+/*
+  Uniform reflection and caching.
+
+  After a program is linked its active uniforms are enumerated once into a
+  table keyed by interned name, so setting a uniform never has to ask the
+  driver for the current program or a location. Every uniform also keeps a
+  copy of the last value uploaded, and setting the same value again is
+  skipped.
+
+  Names are interned once, usually at startup:
+    UniformName model_name = intern_uniform_name("model");
+    set_uniform_mat4(render_context, program, model_name, model);
+*/
+
+// 0 is never a valid interned name
+typedef u32 UniformName;
+
+#define MAX_INTERNED_NAMES 256
+#define MAX_INTERNED_NAME_LENGTH 64
+// Both of these have to be powers of two
+#define INTERNED_NAME_SLOTS (MAX_INTERNED_NAMES * 2)
+#define UNIFORM_SLOTS 32
+#define MAX_UNIFORM_TABLES 64
+
+typedef struct {
+    char names[MAX_INTERNED_NAMES][MAX_INTERNED_NAME_LENGTH];
+    u32 name_count;
+    // Holds name index + 1, 0 means the slot is free
+    u32 slots[INTERNED_NAME_SLOTS];
+} NameInterner;
+
+typedef struct {
+    UniformName name;
+    i32 location;
+    GLenum type;
+    b32 has_value;
+    union {
+        f32 f[16];
+        i32 i[4];
+    } value;
+} Uniform;
+
+typedef struct {
+    u32 program;
+    u32 uniform_count;
+    Uniform uniforms[UNIFORM_SLOTS];
+} UniformTable;
+
+typedef struct {
+    u32 uploads;
+    u32 redundant_uploads_skipped;
+} UniformStats;
+
+static void bind_frame_uniform_block(u32 program);
+
+static NameInterner name_interner;
+static UniformTable uniform_tables[MAX_UNIFORM_TABLES];
+static UniformStats uniform_stats;
+
+static UniformName
+intern_uniform_name_length(const char* name, u32 length) {
+    if(length >= MAX_INTERNED_NAME_LENGTH) {
+        log_error_message("Uniform name too long: %s\n", name);
+        return 0;
+    }
+
+    u32 mask = INTERNED_NAME_SLOTS - 1;
+    u32 slot = hash_bytes_32(name, length) & mask;
+    for(;;) {
+        u32 entry = name_interner.slots[slot];
+        if(!entry) {
+            break;
+        }
+        const char* interned = name_interner.names[entry - 1];
+        if(strncmp(interned, name, length) == 0 && interned[length] == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if(name_interner.name_count == MAX_INTERNED_NAMES) {
+        log_error_message("Out of interned uniform names\n");
+        return 0;
+    }
+
+    u32 index = name_interner.name_count++;
+    memcpy(name_interner.names[index], name, length);
+    name_interner.names[index][length] = 0;
+    name_interner.slots[slot] = index + 1;
+    return index + 1;
+}
+
+static inline UniformName
+intern_uniform_name(const char* name) {
+    return intern_uniform_name_length(name, (u32)strlen(name));
+}
+
+static UniformTable*
+find_uniform_table(u32 program, b32 create) {
+    u32 mask = MAX_UNIFORM_TABLES - 1;
+    u32 slot = hash_u32(program) & mask;
+    for(u32 probe = 0; probe < MAX_UNIFORM_TABLES; ++probe) {
+        UniformTable* table = &uniform_tables[slot];
+        if(table->program == program) {
+            return table;
+        }
+        if(!table->program) {
+            if(create) {
+                table->program = program;
+                return table;
+            }
+            return 0;
+        }
+        slot = (slot + 1) & mask;
+    }
+    if(create) {
+        log_error_message("Out of uniform tables\n");
+    }
+    return 0;
+}
+
+// Call before the program is deleted, GL hands the name out again and the
+// next program with it mustn't find these locations and values
+static void
+remove_uniform_table(u32 program) {
+    UniformTable* table = find_uniform_table(program, false);
+    if(!table) {
+        return;
+    }
+    // Backward shift, the tables after it in its probe chain move up so
+    // lookups still find them without passing an empty slot
+    u32 mask = MAX_UNIFORM_TABLES - 1;
+    u32 hole = (u32)(table - uniform_tables);
+    u32 slot = hole;
+    for(u32 probe = 1; probe < MAX_UNIFORM_TABLES; ++probe) {
+        slot = (slot + 1) & mask;
+        UniformTable* next = &uniform_tables[slot];
+        if(!next->program) {
+            break;
+        }
+        // It can fill the hole unless its home slot is past the hole
+        u32 home = hash_u32(next->program) & mask;
+        if(((slot - home) & mask) >= ((slot - hole) & mask)) {
+            uniform_tables[hole] = *next;
+            hole = slot;
+        }
+    }
+    memset(&uniform_tables[hole], 0, sizeof(uniform_tables[hole]));
+}
+
+static Uniform*
+find_uniform(UniformTable* table, UniformName name, b32 create) {
+    u32 mask = UNIFORM_SLOTS - 1;
+    u32 slot = hash_u32(name) & mask;
+    for(u32 probe = 0; probe < UNIFORM_SLOTS; ++probe) {
+        Uniform* uniform = &table->uniforms[slot];
+        if(uniform->name == name) {
+            return uniform;
+        }
+        if(!uniform->name) {
+            if(create) {
+                uniform->name = name;
+                return uniform;
+            }
+            return 0;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return 0;
+}
+
+// Enumerates the active uniforms of a freshly linked program. Calling this
+// again for the same handle after a relink throws away the old table.
+static void
+reflect_program_uniforms(u32 program) {
+    UniformTable* table = find_uniform_table(program, true);
+    if(!table) {
+        return;
+    }
+    memset(table->uniforms, 0, sizeof(table->uniforms));
+    table->uniform_count = 0;
+
+    bind_frame_uniform_block(program);
+
+    i32 active_uniform_count = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &active_uniform_count);
+    for(i32 i = 0; i < active_uniform_count; ++i) {
+        char name[MAX_INTERNED_NAME_LENGTH];
+        GLsizei length = 0;
+        GLint size = 0;
+        GLenum type = 0;
+        glGetActiveUniform(program, i, sizeof(name), &length, &size, &type, name);
+
+        // Uniforms that live in a uniform block don't have a location
+        i32 location = glGetUniformLocation(program, name);
+        if(location < 0) {
+            continue;
+        }
+
+        // Arrays are reported as "name[0]", we want to look them up by "name"
+        if(length > 3 && strcmp(name + length - 3, "[0]") == 0) {
+            length -= 3;
+        }
+
+        if(table->uniform_count == UNIFORM_SLOTS) {
+            log_error_message("Too many uniforms in program %u\n", program);
+            break;
+        }
+
+        UniformName interned = intern_uniform_name_length(name, length);
+        Uniform* uniform = find_uniform(table, interned, true);
+        if(uniform) {
+            uniform->location = location;
+            uniform->type     = type;
+            ++table->uniform_count;
+        }
+    }
+}
+
+// Returns the uniform only if the new value differs from what was uploaded last.
+static Uniform*
+uniform_needs_upload(RenderContext* render_context, u32 program, UniformName name, const void* value, size_t size) {
+    UniformTable* table = find_uniform_table(program, false);
+    if(!table) {
+        return 0;
+    }
+    Uniform* uniform = find_uniform(table, name, false);
+    if(!uniform) {
+        return 0;
+    }
+
+    if(uniform->has_value && memcmp(&uniform->value, value, size) == 0) {
+        ++uniform_stats.redundant_uploads_skipped;
+        return 0;
+    }
+    memcpy(&uniform->value, value, size);
+    uniform->has_value = true;
+    ++uniform_stats.uploads;
+
+    // Without glProgramUniform* the program has to be current to set its uniforms
+    if(!GLEW_ARB_separate_shader_objects) {
+        use_program(&render_context->gl_state, program);
+    }
+    return uniform;
+}
+
+static void
+set_uniform_mat4(RenderContext* render_context, u32 program, UniformName name, Mat4 matrix) {
+    Uniform* uniform = uniform_needs_upload(render_context, program, name, &matrix.Elements[0][0], sizeof(f32) * 16);
+    if(!uniform) {
+        return;
+    }
+    if(GLEW_ARB_separate_shader_objects) {
+        glProgramUniformMatrix4fv(program, uniform->location, 1, GL_FALSE, &matrix.Elements[0][0]);
+    } else {
+        glUniformMatrix4fv(uniform->location, 1, GL_FALSE, &matrix.Elements[0][0]);
+    }
+}
+
+static void
+set_uniform_3f(RenderContext* render_context, u32 program, UniformName name, f32 f1, f32 f2, f32 f3) {
+    f32 value[3] = {f1, f2, f3};
+    Uniform* uniform = uniform_needs_upload(render_context, program, name, value, sizeof(value));
+    if(!uniform) {
+        return;
+    }
+    if(GLEW_ARB_separate_shader_objects) {
+        glProgramUniform3f(program, uniform->location, f1, f2, f3);
+    } else {
+        glUniform3f(uniform->location, f1, f2, f3);
+    }
+}
+
+static inline void
+set_uniform_vec3(RenderContext* render_context, u32 program, UniformName name, Vec3 v) {
+    set_uniform_3f(render_context, program, name, v.x, v.y, v.z);
+}
+
+static void
+set_uniform_1i(RenderContext* render_context, u32 program, UniformName name, i32 val) {
+    Uniform* uniform = uniform_needs_upload(render_context, program, name, &val, sizeof(val));
+    if(!uniform) {
+        return;
+    }
+    if(GLEW_ARB_separate_shader_objects) {
+        glProgramUniform1i(program, uniform->location, val);
+    } else {
+        glUniform1i(uniform->location, val);
+    }
+}
+
+/*
+  Per-frame globals shared by every program through a std140 uniform block.
+  Shaders declare the matching block as:
+
+    layout(std140) uniform FrameUniforms {
+        mat4 view;
+        mat4 projection;
+        vec4 view_pos;
+        vec4 light_pos;
+        vec4 light_color;
+    };
+
+  The block gets bound to FRAME_UNIFORMS_BINDING when a program is reflected.
+  The data is written once per frame into the stream ring buffer and never
+  touched per draw.
+*/
+
+#define FRAME_UNIFORMS_BINDING 0
+
+typedef struct {
+    Mat4 view;
+    Mat4 projection;
+    // vec3s are padded to 16 bytes in std140, w is unused
+    Vec4 view_pos;
+    Vec4 light_pos;
+    Vec4 light_color;
+} FrameUniforms;
+
+_Static_assert(sizeof(FrameUniforms) == 176, "FrameUniforms must match the std140 layout");
+
+static void
+bind_frame_uniform_block(u32 program) {
+    u32 block_index = glGetUniformBlockIndex(program, "FrameUniforms");
+    if(block_index != GL_INVALID_INDEX) {
+        glUniformBlockBinding(program, block_index, FRAME_UNIFORMS_BINDING);
+    }
+}
+
+// Writes the frame's globals into the ring buffer and binds that slice
+static void
+update_frame_uniforms(RenderContext* render_context, FrameUniforms* frame_uniforms) {
+    GLState* gl_state = &render_context->gl_state;
+    RingAllocation allocation = ring_buffer_alloc(gl_state, &render_context->stream_buffer,
+                                                  sizeof(FrameUniforms),
+                                                  render_context->uniform_buffer_alignment);
+    if(!allocation.data) {
+        return;
+    }
+    memcpy(allocation.data, frame_uniforms, sizeof(FrameUniforms));
+    bind_buffer_range(gl_state, GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING,
+                      allocation.buffer, allocation.offset, sizeof(FrameUniforms));
+}
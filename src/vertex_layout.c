@@ -0,0 +1,247 @@
+/*
+  Vertex layouts.
+
+  A layout describes the attributes of a vertex declaratively and gets
+  packed into a single interleaved stream. Attributes can be stored as:
+    - VERTEX_FORMAT_F32: floats as is.
+    - VERTEX_FORMAT_F16: half floats, good for UVs.
+    - VERTEX_FORMAT_SNORM16: 16-bit signed normalized. Meant for positions,
+      which get divided by the per-axis extent of the mesh when packing.
+      The extent ends up in Mesh.position_scale, which reaches
+      basic_vertex.glsl as instance data and gets multiplied back in.
+    - VERTEX_FORMAT_INT_2_10_10_10: three signed normalized 10-bit values in
+      one GL_INT_2_10_10_10_REV, for normals and other unit vectors.
+
+  Every attribute starts on a 4 byte boundary. Attributes the mesh has no
+  stream for are filled with zeros, so meshes with fewer attributes can
+  share buffers with the rest.
+*/
+
+#define MAX_VERTEX_ATTRIBUTES 8
+// Quantized positions get dequantized with Mesh.position_scale
+#define VERTEX_POSITION_LOCATION 0
+
+typedef enum {
+    VERTEX_FORMAT_F32,
+    VERTEX_FORMAT_F16,
+    VERTEX_FORMAT_SNORM16,
+    VERTEX_FORMAT_INT_2_10_10_10,
+} VertexFormat;
+
+typedef struct {
+    u32 location;
+    u32 component_count;
+    VertexFormat format;
+    u32 offset;
+} VertexAttribute;
+
+typedef struct {
+    const char* name;
+    u32 attribute_count;
+    VertexAttribute attributes[MAX_VERTEX_ATTRIBUTES];
+    u32 stride;
+} VertexLayout;
+
+static u32
+vertex_attribute_size(VertexFormat format, u32 component_count) {
+    u32 size = 0;
+    switch(format) {
+        case VERTEX_FORMAT_F32: size = component_count * sizeof(f32); break;
+        case VERTEX_FORMAT_F16: size = component_count * sizeof(u16); break;
+        case VERTEX_FORMAT_SNORM16: size = component_count * sizeof(i16); break;
+        case VERTEX_FORMAT_INT_2_10_10_10: size = sizeof(u32); break;
+    }
+    // Keep the next attribute aligned
+    return (size + 3) & ~3u;
+}
+
+static void
+add_vertex_attribute(VertexLayout* layout, u32 location, u32 component_count, VertexFormat format) {
+    assert(layout->attribute_count < MAX_VERTEX_ATTRIBUTES);
+    assert(format != VERTEX_FORMAT_INT_2_10_10_10 || component_count == 3);
+
+    VertexAttribute* attribute = &layout->attributes[layout->attribute_count++];
+    attribute->location        = location;
+    attribute->component_count = component_count;
+    attribute->format          = format;
+    attribute->offset          = layout->stride;
+    layout->stride += vertex_attribute_size(format, component_count);
+}
+
+static u16
+f32_to_f16(f32 value) {
+    union { f32 f; u32 u; } bits = { .f = value };
+    u32 sign = (bits.u >> 16) & 0x8000;
+    i32 exponent = (i32)((bits.u >> 23) & 0xff) - 127 + 15;
+    u32 mantissa = bits.u & 0x7fffff;
+
+    if(exponent <= 0) {
+        // Too small for a normal half, flush to zero
+        return (u16)sign;
+    }
+    if(exponent >= 31) {
+        // Too big, clamp to infinity. NaNs don't show up in vertex data.
+        return (u16)(sign | 0x7c00);
+    }
+    // Round to nearest
+    u32 half = sign | ((u32)exponent << 10) | (mantissa >> 13);
+    if(mantissa & 0x1000) {
+        ++half;
+    }
+    return (u16)half;
+}
+
+static inline i16
+f32_to_snorm16(f32 value) {
+    f32 clamped = clamp(value, -1.0f, 1.0f);
+    return (i16)(clamped * 32767.0f + (clamped >= 0 ? 0.5f : -0.5f));
+}
+
+static inline u32
+pack_int_2_10_10_10(f32 x, f32 y, f32 z) {
+    i32 ix = (i32)(clamp(x, -1.0f, 1.0f) * 511.0f + (x >= 0 ? 0.5f : -0.5f));
+    i32 iy = (i32)(clamp(y, -1.0f, 1.0f) * 511.0f + (y >= 0 ? 0.5f : -0.5f));
+    i32 iz = (i32)(clamp(z, -1.0f, 1.0f) * 511.0f + (z >= 0 ? 0.5f : -0.5f));
+    u32 result = ((u32)ix & 0x3ff) | (((u32)iy & 0x3ff) << 10) | (((u32)iz & 0x3ff) << 20);
+    return result;
+}
+
+static VertexStream*
+find_vertex_stream(MeshData* mesh_data, u32 location) {
+    for(u32 s = 0; s < mesh_data->stream_count; ++s) {
+        if(mesh_data->streams[s].location == location) {
+            return &mesh_data->streams[s];
+        }
+    }
+    return 0;
+}
+
+// Largest absolute value per component, used as the quantization scale
+static Vec3
+vertex_stream_extent(VertexStream* stream, u32 vertex_count) {
+    f32 extent[3] = {0, 0, 0};
+    u32 n = min(stream->component_count, 3);
+    for(u32 vertex = 0; vertex < vertex_count; ++vertex) {
+        for(u32 c = 0; c < n; ++c) {
+            extent[c] = max(extent[c], HMM_ABS(stream->data[vertex * stream->component_count + c]));
+        }
+    }
+    Vec3 result;
+    for(u32 c = 0; c < 3; ++c) {
+        result.Elements[c] = extent[c] > 0 ? extent[c] : 1.0f;
+    }
+    return result;
+}
+
+// Packs the mesh into an interleaved buffer of vertex_count * layout->stride
+// bytes. Returns the position dequantization scale, 1 if positions are floats.
+static Vec3
+pack_vertices(VertexLayout* layout, MeshData* mesh_data, u8* output) {
+    Vec3 position_scale = vec3(1.0f, 1.0f, 1.0f);
+
+    for(u32 a = 0; a < layout->attribute_count; ++a) {
+        VertexAttribute* attribute = &layout->attributes[a];
+        VertexStream* stream = find_vertex_stream(mesh_data, attribute->location);
+        if(!stream) {
+            for(u32 vertex = 0; vertex < mesh_data->vertex_count; ++vertex) {
+                memset(output + vertex * layout->stride + attribute->offset, 0,
+                       vertex_attribute_size(attribute->format, attribute->component_count));
+            }
+            continue;
+        }
+
+        Vec3 scale = vec3(1.0f, 1.0f, 1.0f);
+        if(attribute->format == VERTEX_FORMAT_SNORM16) {
+            scale = vertex_stream_extent(stream, mesh_data->vertex_count);
+            if(attribute->location == VERTEX_POSITION_LOCATION) {
+                position_scale = scale;
+            }
+        }
+
+        for(u32 vertex = 0; vertex < mesh_data->vertex_count; ++vertex) {
+            const f32* source = stream->data + vertex * stream->component_count;
+            u8* destination = output + vertex * layout->stride + attribute->offset;
+            u32 n = min(attribute->component_count, stream->component_count);
+
+            switch(attribute->format) {
+                case VERTEX_FORMAT_F32: {
+                    memcpy(destination, source, n * sizeof(f32));
+                } break;
+
+                case VERTEX_FORMAT_F16: {
+                    u16* halves = (u16*)destination;
+                    for(u32 c = 0; c < n; ++c) {
+                        halves[c] = f32_to_f16(source[c]);
+                    }
+                } break;
+
+                case VERTEX_FORMAT_SNORM16: {
+                    i16* values = (i16*)destination;
+                    for(u32 c = 0; c < n; ++c) {
+                        f32 extent = c < 3 ? scale.Elements[c] : 1.0f;
+                        values[c] = f32_to_snorm16(source[c] / extent);
+                    }
+                } break;
+
+                case VERTEX_FORMAT_INT_2_10_10_10: {
+                    u32 packed = pack_int_2_10_10_10(source[0], source[1], source[2]);
+                    memcpy(destination, &packed, sizeof(packed));
+                } break;
+            }
+        }
+    }
+
+    return position_scale;
+}
+
+static void
+set_vertex_attribute_pointer(VertexLayout* layout, VertexAttribute* attribute) {
+    void* offset = (void*)(size_t)attribute->offset;
+    switch(attribute->format) {
+        case VERTEX_FORMAT_F32: {
+            glVertexAttribPointer(attribute->location, attribute->component_count, GL_FLOAT,
+                                  GL_FALSE, layout->stride, offset);
+        } break;
+
+        case VERTEX_FORMAT_F16: {
+            glVertexAttribPointer(attribute->location, attribute->component_count, GL_HALF_FLOAT,
+                                  GL_FALSE, layout->stride, offset);
+        } break;
+
+        case VERTEX_FORMAT_SNORM16: {
+            glVertexAttribPointer(attribute->location, attribute->component_count, GL_SHORT,
+                                  GL_TRUE, layout->stride, offset);
+        } break;
+
+        case VERTEX_FORMAT_INT_2_10_10_10: {
+            glVertexAttribPointer(attribute->location, 4, GL_INT_2_10_10_10_REV,
+                                  GL_TRUE, layout->stride, offset);
+        } break;
+    }
+    glEnableVertexAttribArray(attribute->location);
+}
+
+// Bytes per vertex of the mesh stored as plain float streams, which is what
+// we had before layouts
+static u32
+float_stream_vertex_size(MeshData* mesh_data) {
+    u32 size = 0;
+    for(u32 s = 0; s < mesh_data->stream_count; ++s) {
+        size += mesh_data->streams[s].component_count * sizeof(f32);
+    }
+    return size;
+}
+
+static void
+log_vertex_layout_sizes(const char* mesh_name, MeshData* mesh_data, VertexLayout* layouts, u32 layout_count) {
+    u32 float_size = float_stream_vertex_size(mesh_data);
+    log_debug_message("Vertex layouts for %s (%u vertices):\n", mesh_name, mesh_data->vertex_count);
+    log_debug_message("  %-32s %3u bytes/vertex %8u bytes\n", "float streams",
+                      float_size, float_size * mesh_data->vertex_count);
+    for(u32 i = 0; i < layout_count; ++i) {
+        u32 stride = layouts[i].stride;
+        log_debug_message("  %-32s %3u bytes/vertex %8u bytes (%.0f%%)\n", layouts[i].name,
+                          stride, stride * mesh_data->vertex_count,
+                          100.0f * (f32)stride / (f32)float_size);
+    }
+}